@@ -0,0 +1,630 @@
+/**
+ * Copyright 2021 Peter Torelli
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Winsock must come before Windows.h
+#include <winsock2.h>
+#include "bench.hpp"
+#include "stream_client.hpp"
+#include "dist/json/json.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <memory>
+
+using namespace std;
+
+typedef chrono::high_resolution_clock bench_clock;
+
+static double
+elapsed_ms(bench_clock::time_point a, bench_clock::time_point b)
+{
+	return chrono::duration_cast<chrono::nanoseconds>(b - a).count() / 1e6;
+}
+
+struct WriterArgs
+{
+	FileWriter  *writer;
+	atomic<bool> spinning;
+};
+
+static DWORD WINAPI
+writer_spin(LPVOID arg)
+{
+	WriterArgs *args = (WriterArgs*)arg;
+	while (args->spinning)
+	{
+		args->writer->wait(10);
+	}
+	return 0;
+}
+
+WriteBenchResult
+bench_write(string fn, uint64_t bytes, bool direct)
+{
+	WriteBenchResult result = {};
+	// Far too big for the stack, and the pages need their alignment
+	unique_ptr<FileWriter> writer(new FileWriter);
+	// One energy sample per add() so every sample reaches the file
+	writer->samplerate(2'000'000, 2'000'000);
+	writer->direct(direct);
+	writer->open(fn);
+	WriterArgs args;
+	args.writer = writer.get();
+	args.spinning = true;
+	HANDLE thread = CreateThread(NULL, 0, writer_spin, &args, 0, NULL);
+	if (thread == NULL)
+	{
+		writer->close();
+		throw runtime_error("Failed to create bench writer thread");
+	}
+	uint64_t samples = bytes / sizeof(float);
+	bench_clock::time_point start = bench_clock::now();
+	for (uint64_t n(0); n < samples; ++n)
+	{
+		if ((n % MAX_PAGE_SIZE) == 0 && writer->pages_in_flight() >= MAX_OVERLAPPED_WRITES - 2)
+		{
+			bench_clock::time_point a = bench_clock::now();
+			while (writer->pages_in_flight() >= MAX_OVERLAPPED_WRITES - 2)
+			{
+				Sleep(0);
+			}
+			result.stall_ms += elapsed_ms(a, bench_clock::now());
+		}
+		writer->add(1e-3f + (float)(n & 0xff) * 1e-6f, 3.3f, 0);
+	}
+	args.spinning = false;
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+	writer->close();
+	result.seconds = elapsed_ms(start, bench_clock::now()) / 1e3;
+	result.mbps = (double)samples * sizeof(float) / 1e6 / result.seconds;
+	result.peak_pages = writer->m_peak_pages;
+	DeleteFileA(fn.c_str());
+	return result;
+}
+
+vector<UCHAR>
+bench_packets(size_t num_pkts)
+{
+	vector<UCHAR> data(num_pkts * sizeof(JoulescopePacket));
+	JoulescopePacket *pkt = (JoulescopePacket*)data.data();
+	uint64_t n = 0;
+	for (size_t p(0); p < num_pkts; ++p, ++pkt)
+	{
+		pkt->buffer_type = 1;
+		pkt->status = 0;
+		pkt->length = (uint16_t)sizeof(JoulescopePacket);
+		pkt->pkt_index = (uint16_t)p;
+		pkt->usb_frame_index = 0;
+		for (size_t j(0); j < JS110_SAMPLES_PER_PACKET; ++j, ++n)
+		{
+			// Same encoding as FakeJoulescope, plus a little ripple
+			uint32_t range = (uint32_t)((n / BENCH_RANGE_SAMPLES) & 1);
+			uint32_t gpi0 = (uint32_t)((n / BENCH_GPI0_SAMPLES) & 1);
+			uint32_t toggle = (uint32_t)(n & 1);
+			uint32_t i_code = 2000 + (uint32_t)(n * 7 % 64);
+			uint32_t raw_i = (((i_code & ~1u) | gpi0) << 2) | range;
+			uint32_t raw_v = (8250u << 2) | (toggle << 1);
+			pkt->samples[j] = (raw_v << 16) | raw_i;
+		}
+	}
+	return data;
+}
+
+vector<UCHAR>
+bench_load_packets(string fn)
+{
+	ifstream file(fn, ios::binary);
+	if (!file)
+	{
+		throw runtime_error("Unable to open packet file " + fn);
+	}
+	vector<UCHAR> data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+	data.resize(data.size() / sizeof(JoulescopePacket) * sizeof(JoulescopePacket));
+	if (data.empty())
+	{
+		throw runtime_error("No whole packets in " + fn);
+	}
+	return data;
+}
+
+// `run` returns how long its timed part took
+static double
+median_ms(function<double(void)> run)
+{
+	vector<double> ms;
+	for (int i(0); i < BENCH_REPEATS; ++i)
+	{
+		ms.push_back(run());
+	}
+	sort(ms.begin(), ms.end());
+	return ms[ms.size() / 2];
+}
+
+// Keep pages moving when a writer is fed faster than real time
+static void
+reap(FileWriter& writer)
+{
+	writer.wait(0);
+	while (writer.pages_in_flight() >= MAX_OVERLAPPED_WRITES - 2)
+	{
+		writer.wait(10);
+	}
+}
+
+vector<PipelineBenchResult>
+bench_pipeline(string fn, const vector<UCHAR>& packets)
+{
+	const size_t chunk = 256 * sizeof(JoulescopePacket);
+	const uint64_t samples = packets.size() / sizeof(JoulescopePacket) * JS110_SAMPLES_PER_PACKET;
+	vector<PipelineBenchResult> results;
+	auto record = [&](string name, double ms)
+	{
+		results.push_back(PipelineBenchResult{ name, samples, ms * 1e6 / (double)samples });
+	};
+	// Far too big for the stack
+	unique_ptr<FileWriter> writer(new FileWriter);
+	unique_ptr<RawProcessor> processor(new RawProcessor);
+	unique_ptr<RawBuffer> buffer(new RawBuffer);
+	processor->set_writer(writer.get());
+	buffer->set_raw_processor(processor.get());
+	writer->samplerate(1000, 2'000'000);
+	writer->open(fn);
+	vector<vector<UCHAR>> chunks;
+	for (size_t pos(0); pos < packets.size(); pos += chunk)
+	{
+		chunks.emplace_back(packets.begin() + pos, packets.begin() + min(pos + chunk, packets.size()));
+	}
+
+	// Each chunk is processed (untimed) so the raw buffer never fills. A
+	// recording need not start at packet index 0, hence the resync.
+	record("raw-add-data", median_ms([&]()
+	{
+		double ms = 0.0;
+		buffer->reset();
+		buffer->resync();
+		for (auto& c : chunks)
+		{
+			bench_clock::time_point a = bench_clock::now();
+			buffer->add_data(c);
+			ms += elapsed_ms(a, bench_clock::now());
+			buffer->process_data();
+			reap(*writer);
+		}
+		return ms;
+	}));
+	record("raw-process-data", median_ms([&]()
+	{
+		double ms = 0.0;
+		buffer->reset();
+		buffer->resync();
+		for (auto& c : chunks)
+		{
+			buffer->add_data(c);
+			bench_clock::time_point a = bench_clock::now();
+			buffer->process_data();
+			ms += elapsed_ms(a, bench_clock::now());
+			reap(*writer);
+		}
+		return ms;
+	}));
+
+	// The processor alone, on the raw words already unpacked
+	vector<uint16_t> raw_i, raw_v;
+	const JoulescopePacket *pkt = (const JoulescopePacket*)packets.data();
+	for (size_t p(0); p < packets.size() / sizeof(JoulescopePacket); ++p, ++pkt)
+	{
+		for (size_t j(0); j < JS110_SAMPLES_PER_PACKET; ++j)
+		{
+			raw_i.push_back((uint16_t)(pkt->samples[j] & 0xffff));
+			raw_v.push_back((uint16_t)(pkt->samples[j] >> 16));
+		}
+	}
+	const pair<const char*, uint8_t> modes[] = {
+		{ "off", SUPPRESS_MODE_OFF },
+		{ "mean", SUPPRESS_MODE_MEAN },
+		{ "interp", SUPPRESS_MODE_INTERP },
+		{ "nan", SUPPRESS_MODE_NAN },
+	};
+	uint8_t suppress_mode = processor->_suppress_mode;
+	for (auto& mode : modes)
+	{
+		processor->_suppress_mode = mode.second;
+		record(string("processor-") + mode.first, median_ms([&]()
+		{
+			processor->reset();
+			bench_clock::time_point a = bench_clock::now();
+			for (size_t k(0); k < raw_i.size(); ++k)
+			{
+				processor->process(raw_i[k], raw_v[k]);
+				if ((k & 0xffff) == 0)
+				{
+					reap(*writer);
+				}
+			}
+			return elapsed_ms(a, bench_clock::now());
+		}));
+	}
+	processor->_suppress_mode = suppress_mode;
+	writer->close();
+
+	// The writer alone, on calibrated values
+	vector<float> cal_i(raw_i.size());
+	vector<uint8_t> bits(raw_i.size());
+	for (size_t k(0); k < raw_i.size(); ++k)
+	{
+		cal_i[k] = (float)(raw_i[k] >> 2) * 5e-7f;
+		bits[k] = (uint8_t)((raw_i[k] & 0x0003) | ((raw_i[k] & 0x0004) << 2));
+	}
+	auto writer_add = [&]()
+	{
+		writer->open(fn);
+		bench_clock::time_point a = bench_clock::now();
+		for (size_t k(0); k < cal_i.size(); ++k)
+		{
+			writer->add(cal_i[k], 3.3f, bits[k]);
+			if ((k & 0xffff) == 0)
+			{
+				reap(*writer);
+			}
+		}
+		double ms = elapsed_ms(a, bench_clock::now());
+		writer->close();
+		return ms;
+	};
+	for (unsigned ratio : { 1u, 20u, 2000u })
+	{
+		writer->samplerate(2'000'000 / ratio, 2'000'000);
+		record("writer-add-" + to_string(ratio), median_ms(writer_add));
+	}
+	// Laps go nowhere; the cost measured is the edge check and the queue
+	LapNotifier laps;
+	ostream discard(nullptr);
+	laps.start(&discard);
+	writer->set_lap_notifier(&laps);
+	writer->m_observe_timestamps = true;
+	record("writer-add-gpi0", median_ms(writer_add));
+	writer->m_observe_timestamps = false;
+	writer->set_lap_notifier(nullptr);
+	laps.stop();
+	DeleteFileA(fn.c_str());
+	return results;
+}
+
+void
+bench_save_baseline(string fn, const vector<PipelineBenchResult>& results)
+{
+	Json::Value root(Json::objectValue);
+	for (auto& r : results)
+	{
+		root[r.name] = r.ns_per_sample;
+	}
+	ofstream file(fn, ios::binary);
+	if (!file)
+	{
+		throw runtime_error("Unable to write baseline " + fn);
+	}
+	file << root;
+}
+
+map<string, double>
+bench_load_baseline(string fn)
+{
+	ifstream file(fn, ios::binary);
+	if (!file)
+	{
+		throw runtime_error("Unable to read baseline " + fn);
+	}
+	Json::Value root;
+	Json::CharReaderBuilder builder;
+	JSONCPP_STRING err;
+	if (!Json::parseFromStream(builder, file, &root, &err))
+	{
+		throw runtime_error("Bad baseline " + fn + ": " + err);
+	}
+	map<string, double> baseline;
+	for (auto& name : root.getMemberNames())
+	{
+		baseline[name] = root[name].asDouble();
+	}
+	return baseline;
+}
+
+static double
+filetime_s(const FILETIME& ft)
+{
+	// 100 ns units
+	return (double)(((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime) / 1e7;
+}
+
+HeadroomBenchResult
+bench_headroom(string fn, unsigned factor, double seconds, unsigned rate,
+	bool direct, unsigned queue_packets, unsigned read_packets)
+{
+	HeadroomBenchResult result = {};
+	result.factor = factor;
+	const double packets_per_s = 2e6 * factor / JS110_SAMPLES_PER_PACKET;
+	// Reused round and round, with fresh packet indices
+	vector<UCHAR> pattern = bench_packets(BENCH_PACKETS);
+	const size_t pattern_packets = pattern.size() / sizeof(JoulescopePacket);
+	unique_ptr<FileWriter> writer(new FileWriter);
+	unique_ptr<RawProcessor> processor(new RawProcessor);
+	unique_ptr<RawBuffer> buffer(new RawBuffer);
+	processor->set_writer(writer.get());
+	buffer->set_raw_processor(processor.get());
+	writer->samplerate(rate, 2'000'000);
+	writer->direct(direct);
+	writer->open(fn);
+	vector<UCHAR> read(read_packets * sizeof(JoulescopePacket));
+	double add_ms = 0.0, process_ms = 0.0, write_ms = 0.0;
+	// Spinning for the paced source is user time too; it is taken back out
+	double idle_ms = 0.0;
+	bool idle = false;
+	bench_clock::time_point idle_from;
+	FILETIME created, exited, kernel0, user0, kernel1, user1;
+	GetThreadTimes(GetCurrentThread(), &created, &exited, &kernel0, &user0);
+	uint64_t taken = 0;
+	bench_clock::time_point start = bench_clock::now();
+	try
+	{
+		for (;;)
+		{
+			bench_clock::time_point now = bench_clock::now();
+			double t = elapsed_ms(start, now) / 1e3;
+			if (t >= seconds)
+			{
+				break;
+			}
+			uint64_t produced = (uint64_t)(t * packets_per_s);
+			uint64_t backlog = produced - taken;
+			if (backlog > queue_packets)
+			{
+				result.dropped += backlog - queue_packets;
+				taken = produced - queue_packets;
+				backlog = queue_packets;
+			}
+			result.max_backlog = max(result.max_backlog, backlog);
+			if (backlog == 0)
+			{
+				if (!idle)
+				{
+					idle = true;
+					idle_from = now;
+				}
+				YieldProcessor();
+				continue;
+			}
+			if (idle)
+			{
+				idle_ms += elapsed_ms(idle_from, now);
+				idle = false;
+			}
+			size_t n = (size_t)min<uint64_t>(backlog, read_packets);
+			JoulescopePacket *pkt = (JoulescopePacket*)read.data();
+			for (size_t k(0); k < n; ++k)
+			{
+				CopyMemory(&pkt[k], pattern.data() + ((taken + k) % pattern_packets) * sizeof(JoulescopePacket),
+					sizeof(JoulescopePacket));
+				pkt[k].pkt_index = (uint16_t)(taken + k);
+			}
+			read.resize(n * sizeof(JoulescopePacket));
+			taken += n;
+			bench_clock::time_point a = bench_clock::now();
+			buffer->add_data(read);
+			bench_clock::time_point b = bench_clock::now();
+			buffer->process_data();
+			bench_clock::time_point c = bench_clock::now();
+			writer->wait(0);
+			bench_clock::time_point d = bench_clock::now();
+			read.resize(read_packets * sizeof(JoulescopePacket));
+			add_ms += elapsed_ms(a, b);
+			process_ms += elapsed_ms(b, c);
+			write_ms += elapsed_ms(c, d);
+		}
+		writer->close();
+	}
+	catch (runtime_error re)
+	{
+		// The ring ran out, or a write failed
+		result.error = re.what();
+		try
+		{
+			writer->close();
+		}
+		catch (...)
+		{
+		}
+	}
+	double wall_ms = elapsed_ms(start, bench_clock::now());
+	GetThreadTimes(GetCurrentThread(), &created, &exited, &kernel1, &user1);
+	if (idle)
+	{
+		idle_ms += elapsed_ms(idle_from, bench_clock::now());
+	}
+	result.packets = taken;
+	result.peak_pages = writer->m_peak_pages;
+	result.add_data_pct = add_ms / wall_ms * 100.0;
+	result.process_pct = process_ms / wall_ms * 100.0;
+	result.write_pct = write_ms / wall_ms * 100.0;
+	result.cpu_user_s = max(0.0, filetime_s(user1) - filetime_s(user0) - idle_ms / 1e3);
+	result.cpu_kernel_s = filetime_s(kernel1) - filetime_s(kernel0);
+	result.ok = result.error.empty() && result.dropped == 0;
+	DeleteFileA(fn.c_str());
+	return result;
+}
+
+// Exact as a float, so a client can tell which record it is holding
+static float
+stream_bench_value(uint64_t record)
+{
+	return (float)(record % (1 << 24));
+}
+
+struct StreamBenchClient
+{
+	unsigned short    port;
+	DWORD             pause_ms; // after every frame
+	atomic<uint64_t>  received; // records up to the end of the last frame
+	StreamBenchResult result;
+};
+
+static DWORD WINAPI
+stream_bench_client(LPVOID arg)
+{
+	StreamBenchClient *c = (StreamBenchClient*)arg;
+	StreamBenchResult& r = c->result;
+	try
+	{
+		StreamClient client;
+		client.open("127.0.0.1", c->port);
+		StreamFrameHeader hdr;
+		vector<float> data;
+		uint64_t expected = 0;
+		while (r.error.empty() && client.read(hdr, data))
+		{
+			if (hdr.kind != STREAM_KIND_ENERGY || hdr.first_record < expected ||
+				(hdr.first_record - expected) % STREAM_BLOCK_FLOATS != 0)
+			{
+				r.error = "frame " + to_string(r.frames) + " starts at record "
+					+ to_string(hdr.first_record) + ", expected " + to_string(expected);
+				break;
+			}
+			uint64_t skipped = (hdr.first_record - expected) / STREAM_BLOCK_FLOATS;
+			if (hdr.dropped > skipped)
+			{
+				r.error = "frame " + to_string(r.frames) + " reports " + to_string(hdr.dropped)
+					+ " blocks dropped but only " + to_string(skipped) + " are missing";
+				break;
+			}
+			for (uint32_t k(0); k < hdr.count; ++k)
+			{
+				if (data[k] != stream_bench_value(hdr.first_record + k))
+				{
+					r.error = "record " + to_string(hdr.first_record + k) + " has the wrong value";
+					break;
+				}
+			}
+			expected = hdr.first_record + hdr.count;
+			++r.frames;
+			r.records += hdr.count;
+			r.skipped_blocks += skipped;
+			r.dropped += hdr.dropped;
+			r.max_decimation = max(r.max_decimation, hdr.decimation);
+			c->received = expected;
+			if (c->pause_ms > 0)
+			{
+				Sleep(c->pause_ms);
+			}
+		}
+	}
+	catch (runtime_error re)
+	{
+		r.error = re.what();
+	}
+	return 0;
+}
+
+vector<StreamBenchResult>
+bench_stream(unsigned short port, double seconds)
+{
+	StreamServer server;
+	server.start(port, STREAM_KIND_ENERGY);
+	StreamBenchClient fast, slow;
+	fast.pause_ms = 0;
+	slow.pause_ms = BENCH_STREAM_SLOW_MS;
+	fast.result.name = "fast";
+	slow.result.name = "slow";
+	HANDLE threads[2] = {};
+	for (StreamBenchClient *c : { &fast, &slow })
+	{
+		c->port = port;
+		c->received = 0;
+		c->result.ok = false;
+		c->result.frames = c->result.records = c->result.skipped_blocks = c->result.dropped = 0;
+		c->result.max_decimation = 0;
+	}
+	threads[0] = CreateThread(NULL, 0, stream_bench_client, &fast, 0, NULL);
+	threads[1] = CreateThread(NULL, 0, stream_bench_client, &slow, 0, NULL);
+	if (threads[0] == NULL || threads[1] == NULL)
+	{
+		server.stop();
+		for (HANDLE thread : threads)
+		{
+			if (thread != NULL)
+			{
+				WaitForSingleObject(thread, INFINITE);
+				CloseHandle(thread);
+			}
+		}
+		throw runtime_error("Failed to create stream bench client thread");
+	}
+	// Records count from begin(), so both must be connected before it
+	bench_clock::time_point start = bench_clock::now();
+	while (server.clients() < 2 && elapsed_ms(start, bench_clock::now()) < 5000.0)
+	{
+		Sleep(1);
+	}
+	uint64_t n = 0;
+	if (server.clients() == 2)
+	{
+		server.begin((float)BENCH_STREAM_RATE);
+		start = bench_clock::now();
+		for (;;)
+		{
+			double t = elapsed_ms(start, bench_clock::now()) / 1e3;
+			if (t >= seconds)
+			{
+				break;
+			}
+			for (uint64_t target = (uint64_t)(t * BENCH_STREAM_RATE); n < target; ++n)
+			{
+				server.put(stream_bench_value(n));
+			}
+			Sleep(1);
+		}
+		server.flush();
+		// Give the fast client what is still queued before the sockets close
+		bench_clock::time_point a = bench_clock::now();
+		while (fast.received < n && elapsed_ms(a, bench_clock::now()) < 2000.0)
+		{
+			Sleep(1);
+		}
+	}
+	server.stop();
+	WaitForMultipleObjects(2, threads, TRUE, INFINITE);
+	CloseHandle(threads[0]);
+	CloseHandle(threads[1]);
+	if (n == 0 && fast.result.error.empty())
+	{
+		fast.result.error = "never connected";
+	}
+	StreamBenchResult& f = fast.result;
+	if (f.error.empty() && (f.records != n || f.dropped > 0 || f.max_decimation != 1))
+	{
+		f.error = "got " + to_string(f.records) + " of " + to_string(n) + " records";
+	}
+	f.ok = f.error.empty();
+	StreamBenchResult& s = slow.result;
+	if (s.error.empty() && (s.dropped == 0 || s.max_decimation < 2))
+	{
+		s.error = "was never dropped or decimated";
+	}
+	s.ok = s.error.empty();
+	return { f, s };
+}
@@ -0,0 +1,131 @@
+/**
+ * Copyright 2021 Peter Torelli
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "file_writer.hpp"
+#include "raw_buffer.hpp"
+#include <map>
+#include <string>
+#include <vector>
+
+#define BENCH_REPEATS       5     // each result is the median of this many runs
+#define BENCH_PACKETS       16384 // synthetic data: about 1 s at 2 MS/s
+#define BENCH_RANGE_SAMPLES 1000  // synthetic current range flips this often
+#define BENCH_GPI0_SAMPLES  5000  // and GPI0 this often
+#define BENCH_REGRESSION    0.10  // slower than the baseline by this is flagged
+#define BENCH_STREAM_RATE   1'000'000 // records per second through the stream server
+#define BENCH_STREAM_SLOW_MS 20       // the slow client's pause after every frame
+
+/**
+ * Benchmarks behind the `bench` command. They run without a Joulescope and
+ * print their results as `m-bench-...` lines.
+ */
+
+struct WriteBenchResult
+{
+	double   seconds;    // first sample to file closed
+	double   mbps;       // megabytes of samples per second
+	double   stall_ms;   // time the producer waited on a full ring
+	unsigned peak_pages; // most pages in flight at once
+};
+
+/**
+ * Push `bytes` worth of samples through a FileWriter as fast as the ring
+ * allows, with a writer thread reaping pages exactly as during a trace.
+ * The producer backs off when the ring is nearly full instead of letting
+ * it overflow, and that back-off time is reported as the stall.
+ */
+WriteBenchResult bench_write(std::string fn, uint64_t bytes, bool direct);
+
+struct PipelineBenchResult
+{
+	std::string name;
+	uint64_t    samples;       // per run
+	double      ns_per_sample; // median over BENCH_REPEATS runs
+};
+
+/**
+ * Time each stage of the sample path on its own, in the same thread, over
+ * `packets` (whole 512-byte USB packets, as from bench_packets() or a
+ * recording). `fn` is a scratch file for the FileWriter. The stages are:
+ *
+ *   raw-add-data           RawBuffer::add_data(), 256 packets per call
+ *   raw-process-data       RawBuffer::process_data(), the whole chain
+ *   processor-<mode>       RawProcessor::process() in each suppression
+ *                          mode, into a FileWriter at 1 kHz
+ *   writer-add-<ratio>     FileWriter::add() at 2 MS/s / ratio
+ *   writer-add-gpi0        the same at 1 kHz, with laps on, so every GPI0
+ *                          edge goes through gpi0_check() and the lap queue
+ */
+std::vector<PipelineBenchResult> bench_pipeline(std::string fn, const std::vector<UCHAR>& packets);
+// Packets of a JS110 on a steady load that changes range and toggles GPI0
+std::vector<UCHAR> bench_packets(size_t num_pkts);
+std::vector<UCHAR> bench_load_packets(std::string fn);
+struct HeadroomBenchResult
+{
+	unsigned    factor;           // times 2 MS/s
+	bool        ok;               // no drops, ring never exhausted
+	std::string error;            // what stopped the run early, if anything
+	uint64_t    packets;          // produced by the source
+	uint64_t    dropped;          // lost to a full USB queue
+	uint64_t    max_backlog;      // packets, most the pipeline fell behind
+	unsigned    peak_pages;       // most write pages in flight at once
+	double      add_data_pct;     // of wall time, RawBuffer::add_data()
+	double      process_pct;      // RawBuffer::process_data(): processor and writer
+	double      write_pct;        // reaping page writes
+	double      cpu_user_s;       // less the source's idle spinning
+	double      cpu_kernel_s;
+};
+
+/**
+ * Run the whole sample path for `seconds` against a source that produces
+ * packets in real time at `factor` times the JS110's rate, on one thread
+ * as the event loop would. Like the device, the source only holds
+ * `queue_packets` (the USB read queue); anything the pipeline has not
+ * taken by the time it would overflow is dropped, and reaches the
+ * RawBuffer as a packet index gap. The pipeline takes up to
+ * `read_packets` at a time. The FileWriter writes a real file `fn` at
+ * `rate` Hz, buffered or `direct`.
+ */
+HeadroomBenchResult bench_headroom(std::string fn, unsigned factor, double seconds,
+	unsigned rate, bool direct, unsigned queue_packets, unsigned read_packets);
+struct StreamBenchResult
+{
+	std::string name;           // "fast" or "slow" client
+	bool        ok;
+	std::string error;          // what the client found wrong, if anything
+	uint64_t    frames;
+	uint64_t    records;        // received
+	uint64_t    skipped_blocks; // never sent: dropped or decimated away
+	uint64_t    dropped;        // blocks the server reported dropping
+	uint32_t    max_decimation;
+};
+
+/**
+ * Serve `seconds` of energy records at BENCH_STREAM_RATE from a
+ * StreamServer on `port` to two StreamClients over loopback. Every record
+ * carries its own index, so each client checks that every frame starts on
+ * a block boundary at or after where the last one ended, that its records
+ * are the ones `first_record` says, and that `dropped` never claims more
+ * blocks than are missing. The fast client must get every record with no
+ * drops at decimation 1; the slow one pauses after every frame, so it must
+ * see drops and a decimation above 1.
+ */
+std::vector<StreamBenchResult> bench_stream(unsigned short port, double seconds);
+// Baselines are {"<name>": ns_per_sample, ...}
+void bench_save_baseline(std::string fn, const std::vector<PipelineBenchResult>& results);
+std::map<std::string, double> bench_load_baseline(std::string fn);
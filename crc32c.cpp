@@ -0,0 +1,118 @@
+/**
+ * Copyright 2021 Peter Torelli
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "crc32c.hpp"
+
+#include <cstring>
+
+#if defined(_M_X64) || defined(_M_IX86)
+#	include <intrin.h>
+#	include <nmmintrin.h>
+#	define CRC32C_HW
+#endif
+
+using namespace std;
+
+struct CrcTable
+{
+	uint32_t entry[256];
+	CrcTable(uint32_t poly)
+	{
+		for (uint32_t i(0); i < 256; ++i)
+		{
+			uint32_t c = i;
+			for (int k(0); k < 8; ++k)
+			{
+				c = (c & 1) ? (c >> 1) ^ poly : c >> 1;
+			}
+			entry[i] = c;
+		}
+	}
+};
+
+static const CrcTable g_crc32c_table(0x82f63b78u); // reflected 0x1edc6f41
+static const CrcTable g_crc32_table(0xedb88320u);  // reflected 0x04c11db7
+
+static uint32_t
+crc_table(const CrcTable& table, const uint8_t *p, size_t len, uint32_t crc)
+{
+	while (len--)
+	{
+		crc = table.entry[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+#ifdef CRC32C_HW
+static bool
+have_sse42(void)
+{
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] & (1 << 20)) != 0;
+}
+
+static const bool g_have_sse42 = have_sse42();
+
+static uint32_t
+crc32c_hw(const uint8_t *p, size_t len, uint32_t crc)
+{
+#	if defined(_M_X64)
+	uint64_t crc64 = crc;
+	uint64_t qword;
+	while (len >= sizeof(qword))
+	{
+		memcpy(&qword, p, sizeof(qword));
+		crc64 = _mm_crc32_u64(crc64, qword);
+		p += sizeof(qword);
+		len -= sizeof(qword);
+	}
+	crc = (uint32_t)crc64;
+#	endif
+	uint32_t dword;
+	while (len >= sizeof(dword))
+	{
+		memcpy(&dword, p, sizeof(dword));
+		crc = _mm_crc32_u32(crc, dword);
+		p += sizeof(dword);
+		len -= sizeof(dword);
+	}
+	while (len--)
+	{
+		crc = _mm_crc32_u8(crc, *p++);
+	}
+	return crc;
+}
+#endif
+
+uint32_t
+crc32c(const void *data, size_t len, uint32_t crc)
+{
+	const uint8_t *p = (const uint8_t*)data;
+#ifdef CRC32C_HW
+	if (g_have_sse42)
+	{
+		return ~crc32c_hw(p, len, ~crc);
+	}
+#endif
+	return ~crc_table(g_crc32c_table, p, len, ~crc);
+}
+
+uint32_t
+crc32(const void *data, size_t len, uint32_t crc)
+{
+	return ~crc_table(g_crc32_table, (const uint8_t*)data, len, ~crc);
+}
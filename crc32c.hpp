@@ -0,0 +1,34 @@
+/**
+ * Copyright 2021 Peter Torelli
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cinttypes>
+#include <cstddef>
+
+/**
+ * CRC-32C (Castagnoli). Uses the SSE4.2 crc32 instruction when the CPU has
+ * it (several GB/s, so checksumming every page written is noise next to the
+ * write itself) and a table otherwise. Chain calls by passing the previous
+ * result as `crc`; start from 0.
+ */
+uint32_t crc32c(const void *data, size_t len, uint32_t crc = 0);
+
+/**
+ * The zlib CRC-32, which is what the Joulescope uses in its datafile
+ * headers. Same chaining convention as crc32c().
+ */
+uint32_t crc32(const void *data, size_t len, uint32_t crc = 0);
@@ -16,6 +16,7 @@
  */
 
 #include "device.hpp"
+#include "timeline.hpp"
 
 using namespace std;
 
@@ -49,11 +50,15 @@ string string_format(const string& format, Args ... args)
 string GetLastErrorText(void);
 
 EndpointIn::EndpointIn(
-	HANDLE _winusb,
+	UsbTransport *_transport,
 	UCHAR _pipe_id,
 	UINT _transfers,
 	UINT _block_size,
-	RawBuffer *raw_buffer
+	RawBuffer *raw_buffer,
+	DeviceStats *_stats,
+	bool _adaptive,
+	bool _per_completion,
+	std::ostream *_notify
 	/*
 	EndpointIn_data_fn_t data_fn,
 	EndpointIn_process_fn_t process_fn,
@@ -61,7 +66,7 @@ EndpointIn::EndpointIn(
 	*/
 )
 {
-	m_winusb = _winusb;
+	m_transport = _transport;
 	m_pipe_id = _pipe_id;
 	m_overlapped_free.clear();
 	m_overlapped_pending.clear();
@@ -73,6 +78,7 @@ EndpointIn::EndpointIn(
 	m_stop_fn = stop_fn;
 	*/
 	m_raw_buffer = raw_buffer;
+	m_stats = _stats;
 	m_process_transfers = 0;
 	m_state = state_e::ST_IDLE;
 	m_stop_code = DeviceEvent::NONE; // python uses None and enum & getlasterror!
@@ -82,6 +88,13 @@ EndpointIn::EndpointIn(
 	m_transfer_count = 0;
 	m_transfer_expire_max = 0;
 	m_event = NULL;
+	m_adaptive = _adaptive;
+	m_per_completion = _per_completion;
+	m_notify = _notify;
+	m_overlapped_count = 0;
+	m_issue_seq = 0;
+	m_deliver_seq = 0;
+	_tune_reset();
 }
 
 void
@@ -101,6 +114,12 @@ EndpointIn::_open(void)
 		DBG("EndpointIn::_open() ... adding TransferOverlapped #" << i << "");
 		m_overlapped_free.push_back(new TransferOverlapped(m_event, m_transfer_size));
 	}
+	m_overlapped_count = m_transfers;
+	m_issue_seq = 0;
+	m_deliver_seq = 0;
+	m_completed.clear();
+	m_last_completion = chrono::steady_clock::now();
+	_tune_reset();
 }
 
 void
@@ -112,9 +131,6 @@ EndpointIn::_close(void)
 		DBG("EndpointIn::_close() ... CloseHandle(event=" << m_event << ")");
 		CloseHandle(m_event);
 	}
-#ifdef ENDPOINT_PERFSTATS
-	print_stats_to_console();
-#endif
 	m_event = NULL;
 }
 
@@ -125,9 +141,11 @@ EndpointIn::_issue(TransferOverlapped* ov)
 	DBG("EndpointIn::_issue()");
 	BOOL result;
 	ov->reset();
+	ov->m_issued = chrono::steady_clock::now();
+	ov->m_seq = m_issue_seq++;
 	// QUESTION: why don't we use LengthTransferred here? (arg 5)
-	DBG("EndpointIn::_issue() ... Calling WinUsb_ReadPipe(pipe_id=" << (int)m_pipe_id << ")");
-	result = WinUsb_ReadPipe(m_winusb, m_pipe_id, ov->m_buffer.data(), (ULONG)ov->m_buffer.size(), NULL, ov->ov_ptr());
+	DBG("EndpointIn::_issue() ... Calling read_pipe(pipe_id=" << (int)m_pipe_id << ")");
+	result = m_transport->read_pipe(m_pipe_id, ov);
 	DBG("EndpointIn::_issue() ... result       =" << result << ")");
 	if (!result)
 	{
@@ -161,104 +179,197 @@ EndpointIn::_pend(void)
 			return true;
 		}
 	}
+	// Tuning asked for a deeper queue
+	while (m_overlapped_count < m_transfers)
+	{
+		++m_overlapped_count;
+		if (_issue(new TransferOverlapped(m_event, m_transfer_size)))
+		{
+			return true;
+		}
+	}
 	DBG("EndpointIn::_pend() ... all good, return 'true'");
 	return false;
 }
 
+/**
+ * Collect every transfer that has finished, not just the oldest: they all
+ * share one event, and WinUSB may report them out of order. Each finished
+ * buffer's data is set aside and the buffer goes straight back to the
+ * device, so the full number of reads stays queued; the data is then
+ * handed to the RawBuffer strictly in the order the reads were issued.
+ * Re-issuing a read resets the shared event, so keep scanning until a
+ * pass finds nothing; anything finishing after that sets it again.
+ */
 bool
 EndpointIn::_expire(void)
 {
 	DBG("EndpointIn::_expire()");
 	bool rv(false);
-	DWORD length_transferred(0);
+	ULONG length_transferred(0);
 	UINT count(0);
+	TransferOverlapped *failed = nullptr;
+	DWORD ec(0);
 
-	DBG("EndpointIn::_expire() ... entering big loop at line " << __LINE__ << "");
 	DBG("EndpointIn::_expire() ... # of pending overlapped =" << m_overlapped_pending.size() << "");
 	DBG("EndpointIn::_expire() ... # of -free-- overlapped =" << m_overlapped_free.size() << "");
-	fflush(stdout);
-	while (!rv && !m_overlapped_pending.empty())
+	while (!rv)
 	{
-		TransferOverlapped *ov = m_overlapped_pending.front();
-		if (WinUsb_GetOverlappedResult(m_winusb, ov->ov_ptr(), &length_transferred, FALSE))
+		m_overlapped_done.clear();
+		for (TransferOverlappedDeque::iterator itr = m_overlapped_pending.begin(); itr != m_overlapped_pending.end();)
 		{
-			DBG("EndpointIn::_expire() ... success!");
-			DBG("EndpointIn::_expire() ... remove the pending event");
-			m_overlapped_pending.pop_front(); // in the Python code, he reassigns ov here TODO?
-			++m_transfer_count;
-			ULONG length = length_transferred; // seems a little redundant
-			m_byte_count_this += length;
-			++count;
-			if (m_raw_buffer != nullptr)
+			TransferOverlapped *ov = *itr;
+			if (m_transport->get_overlapped_result(ov, &length_transferred, FALSE))
 			{
-				if (length > ov->m_buffer.size())
+				if (length_transferred > ov->m_buffer.size())
 				{
 					throw runtime_error("EndpointIn::_expire() ... transferred bytes exceed storage buffer size");
 				}
-				vector<UCHAR> slice(ov->m_buffer.begin(), ov->m_buffer.begin() + length);
-#ifdef ENDPOINT_PERFSTATS
-				std::chrono::high_resolution_clock::time_point a = std::chrono::high_resolution_clock::now();
-				rv = m_data_fn(slice);
-				std::chrono::high_resolution_clock::time_point b = std::chrono::high_resolution_clock::now();
-				auto delta = b - a;
-				float nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(delta).count() / 1e9;
-				m_perf_stats.data_fn_time.push_back(nsec);
-#else
-				rv = m_raw_buffer->add_data(slice);
-#endif
+				m_overlapped_done.push_back(std::make_pair(ov, length_transferred));
+				itr = m_overlapped_pending.erase(itr);
+				continue;
 			}
-			if (rv)
+			ec = GetLastError();
+			if (ec == ERROR_IO_INCOMPLETE || ec == ERROR_IO_PENDING)
 			{
-				string msg = string_format("EndpointIn %02x terminated by data_fn", m_pipe_id);
-				_halt(DeviceEvent::ENDPOINT_CALLBACK_STOP, msg);
-				m_overlapped_free.push_back(ov);
+				++itr;
+				continue;
 			}
-			else
+			DBG("EndpointIn::_expire() ... BAD FAIL");
+			failed = ov;
+			m_overlapped_pending.erase(itr);
+			break;
+		}
+		if (m_overlapped_done.empty() && failed == nullptr)
+		{
+			break;
+		}
+		chrono::steady_clock::time_point now = chrono::steady_clock::now();
+		for (auto& done : m_overlapped_done)
+		{
+			TransferOverlapped *ov = done.first;
+			ULONG length = done.second;
+			++m_transfer_count;
+			m_byte_count_this += length;
+			++count;
+			m_window_latency_ms += chrono::duration<double, milli>(now - ov->m_issued).count();
+			++m_window_transfers;
+			m_window_packets += length / BULK_IN_LENGTH;
+			g_timeline.instant("transfer-complete", "bytes", length);
+			if (m_stats != nullptr)
+			{
+				m_stats->completion_interval.record(now - m_last_completion);
+			}
+			m_last_completion = now;
+			// Swap the data out so the buffer can go back right away
+			vector<UCHAR>& data = m_completed[ov->m_seq];
+			data.swap(ov->m_buffer);
+			data.resize(length);
+			if (!m_spare.empty())
 			{
-				DBG("EndpointIn::_expire() ... issuing the TransferOverlapped ... a copy or actual? does it matter?");
-				rv = _issue(ov);
+				ov->m_buffer.swap(m_spare.back());
+				m_spare.pop_back();
 			}
 		}
-		else
+		for (auto& done : m_overlapped_done)
 		{
-			DWORD ec = GetLastError();
-			if (ec == ERROR_IO_INCOMPLETE || ec == ERROR_IO_PENDING)
+			if (rv || m_state != state_e::ST_RUNNING)
 			{
-				DBG("EndpointIn::_expire() ... fail but event is PENDING or INCOMPLETE");
-				break;
+				m_overlapped_free.push_back(done.first);
 			}
-			DBG("EndpointIn::_expire() ... BAD FAIL");
-			m_overlapped_pending.pop_front(); // reassigns ov here ? TODO
-			m_overlapped_free.push_back(ov);
-			string msg = string_format("EndpointIn WinUsb_GetOverlappedResult fatal: %08x", ec);
+			else
+			{
+				rv = _recycle(done.first);
+				if (m_stats != nullptr)
+				{
+					m_stats->resubmit_delay.record(chrono::steady_clock::now() - now);
+				}
+			}
+		}
+		if (failed != nullptr)
+		{
+			m_overlapped_free.push_back(failed);
+			string msg = string_format("EndpointIn get_overlapped_result fatal: %08x", ec);
 			LOG(msg);
 			rv = true;
 			DBG("EndpointIn::_expire() ... calling halt....");
 			_halt(DeviceEvent::COMMUNICATION_ERROR, msg);
+			break;
 		}
-	} // end overlapped pending drain while()
+		if (!rv)
+		{
+			rv = _deliver();
+		}
+	}
 	if (count > m_transfer_expire_max)
 	{
 		m_transfer_expire_max = count;
+		if (m_stats != nullptr)
+		{
+			m_stats->expire_max = count;
+		}
+	}
+	if (count > 0)
+	{
+		chrono::steady_clock::time_point now = chrono::steady_clock::now();
+		double gap = chrono::duration<double, milli>(now - m_last_service).count();
+		m_window_gap_ms = max(m_window_gap_ms, gap);
+		m_last_service = now;
 	}
 	m_process_transfers += count;
 	return rv;
 }
 
+// Hand finished reads to the RawBuffer in issue order. true = stop
+bool
+EndpointIn::_deliver(void)
+{
+	bool rv(false);
+	map<uint64_t, vector<UCHAR>>::iterator itr = m_completed.begin();
+	while (!rv && itr != m_completed.end() && itr->first == m_deliver_seq)
+	{
+		++m_deliver_seq;
+		if (m_raw_buffer != nullptr)
+		{
+			chrono::steady_clock::time_point a = chrono::steady_clock::now();
+			{
+				TimelineSpan span("add_data", "bytes", itr->second.size());
+				rv = m_raw_buffer->add_data(itr->second);
+			}
+			if (m_stats != nullptr)
+			{
+				m_stats->add_data.record(chrono::steady_clock::now() - a);
+			}
+			if (!rv && m_per_completion)
+			{
+				rv = _process_data();
+			}
+		}
+		m_spare.push_back(move(itr->second));
+		itr = m_completed.erase(itr);
+	}
+	if (rv)
+	{
+		string msg = string_format("EndpointIn %02x terminated by data_fn", m_pipe_id);
+		_halt(DeviceEvent::ENDPOINT_CALLBACK_STOP, msg);
+	}
+	return rv;
+}
+
 void
 EndpointIn::_cancel(void)
 {
 	DBG("EndpointIn::_cancel()");
 	ULONG length_transferred = 0;
-	if (!WinUsb_AbortPipe(m_winusb, m_pipe_id))
+	if (!m_transport->abort_pipe(m_pipe_id))
 	{
-		LOG("WinUsb_AbortPipe pipe_id " << (int)m_pipe_id << ": " << GetLastErrorText());
+		LOG("abort_pipe pipe_id " << (int)m_pipe_id << ": " << GetLastErrorText());
 	}
 	while (m_overlapped_pending.size() > 0)
 	{
 		TransferOverlapped *ov = m_overlapped_pending.front();
 		m_overlapped_pending.pop_front();
-		if (!WinUsb_GetOverlappedResult(m_winusb, ov->ov_ptr(), &length_transferred, TRUE))
+		if (!m_transport->get_overlapped_result(ov, &length_transferred, TRUE))
 		{
 			if (GetLastError() != ERROR_OPERATION_ABORTED)
 			{
@@ -321,24 +432,131 @@ EndpointIn::process_signal(void)
 	if (m_process_transfers > 0)
 	{
 		m_process_transfers = 0;
-		if (m_raw_buffer != nullptr)
+		// Otherwise it was done as each read was delivered
+		if (!m_per_completion)
 		{
-#ifdef ENDPOINT_PERFSTATS
-			std::chrono::high_resolution_clock::time_point a = std::chrono::high_resolution_clock::now();
-			bool rv = m_process_fn();
-			std::chrono::high_resolution_clock::time_point b = std::chrono::high_resolution_clock::now();
-			auto delta = b - a;
-			float nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(delta).count() / 1e9;
-			m_perf_stats.process_fn_time.push_back(nsec);
-			return rv;
-#else
-			return m_raw_buffer->process_data();
-#endif
+			return _process_data();
 		}
 	}
 	return false;
 }
 
+// Run the RawBuffer over everything delivered so far. true = stop
+bool
+EndpointIn::_process_data(void)
+{
+	if (m_raw_buffer == nullptr)
+	{
+		return false;
+	}
+	chrono::steady_clock::time_point a = chrono::steady_clock::now();
+	bool rv;
+	{
+		TimelineSpan span("process_data");
+		rv = m_raw_buffer->process_data();
+	}
+	chrono::steady_clock::duration took = chrono::steady_clock::now() - a;
+	m_window_process_ms += chrono::duration<double, milli>(took).count();
+	if (m_stats != nullptr)
+	{
+		m_stats->process_data.record(took);
+	}
+	if (m_adaptive && m_state == state_e::ST_RUNNING)
+	{
+		_tune();
+	}
+	return rv;
+}
+
+// Put a completed transfer back in the queue, at the current size, unless
+// the queue is now meant to be shallower. true = error, false = ok
+bool
+EndpointIn::_recycle(TransferOverlapped* ov)
+{
+	if (m_overlapped_count > m_transfers)
+	{
+		--m_overlapped_count;
+		delete ov;
+		return false;
+	}
+	ov->m_size = m_transfer_size;
+	return _issue(ov);
+}
+
+void
+EndpointIn::_tune_reset(void)
+{
+	m_window_start = chrono::steady_clock::now();
+	m_last_service = m_window_start;
+	m_window_transfers = 0;
+	m_window_packets = 0;
+	m_window_dropped = (m_raw_buffer != nullptr) ? m_raw_buffer->m_total_dropped_pkts : 0;
+	m_window_latency_ms = 0;
+	m_window_process_ms = 0;
+	m_window_gap_ms = 0;
+}
+
+/**
+ * Once per window (about a second of data), compare how much data the
+ * queued reads cover with the longest stretch the host went without
+ * servicing a completion. Reads only get re-queued when we service them,
+ * so if that gap approaches the queue depth (or packets were dropped) the
+ * queue is deepened, and once it's as deep as allowed the reads get
+ * larger, which also cuts per-read overhead. With plenty of slack and
+ * cheap processing, the reads are halved and doubled in number: the same
+ * amount stays queued, but data arrives in smaller, steadier pieces.
+ * Every change is reported; the next window starts from scratch.
+ */
+void
+EndpointIn::_tune(void)
+{
+	if (m_window_packets < USB_TUNE_WINDOW_PACKETS || m_window_transfers == 0)
+	{
+		return;
+	}
+	double window_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - m_window_start).count();
+	double transfer_ms = window_ms / m_window_transfers;
+	double queued_ms = transfer_ms * m_transfers;
+	double latency_ms = m_window_latency_ms / m_window_transfers;
+	double process_ms = m_window_process_ms / m_window_transfers;
+	size_t dropped = (m_raw_buffer != nullptr) ? m_raw_buffer->m_total_dropped_pkts - m_window_dropped : 0;
+	double drop_rate = (double)dropped / (double)(m_window_packets + dropped);
+	UINT transfers = m_transfers;
+	UINT packets = m_transfer_size / BULK_IN_LENGTH;
+	if (dropped > 0 || m_window_gap_ms > queued_ms / 2)
+	{
+		if (transfers * 2 <= USB_TRANSFERS_MAX && transfers * 2 * packets <= USB_QUEUED_PACKETS_MAX)
+		{
+			transfers *= 2;
+		}
+		else if (packets * 2 <= USB_PACKETS_MAX && transfers * packets * 2 <= USB_QUEUED_PACKETS_MAX)
+		{
+			packets *= 2;
+		}
+	}
+	else if (m_window_gap_ms < queued_ms / 8 && process_ms < transfer_ms / 4 &&
+		packets / 2 >= USB_PACKETS_MIN && transfers * 2 <= USB_TRANSFERS_MAX)
+	{
+		packets /= 2;
+		transfers *= 2;
+	}
+	if (transfers != m_transfers || packets * BULK_IN_LENGTH != m_transfer_size)
+	{
+		m_transfers = transfers;
+		m_transfer_size = packets * BULK_IN_LENGTH;
+		streamsize precision = m_notify->precision();
+		*m_notify << setprecision(4)
+			<< "m-usb-tune-transfers[" << transfers
+			<< "]-packets[" << packets
+			<< "]-latency-ms[" << latency_ms
+			<< "]-process-ms[" << process_ms
+			<< "]-gap-ms[" << m_window_gap_ms
+			<< "]-drop-rate[" << drop_rate
+			<< "]" << setprecision(precision) << endl;
+	}
+	_tune_reset();
+}
+
 void
 EndpointIn::start(void)
 {
@@ -388,9 +606,9 @@ EndpointIn::stop(void)
 	}
 }
 
-ControlTransferAsync::ControlTransferAsync(HANDLE _winusb)
+ControlTransferAsync::ControlTransferAsync(UsbTransport *_transport)
 {
-	m_winusb = _winusb;
+	m_transport = _transport;
 	m_overlapped = nullptr;
 	m_event = NULL;
 	m_commands.clear();
@@ -422,8 +640,8 @@ void
 ControlTransferAsync::close(void)
 {
 	DBG("ControlTransferAsync::close()");
-	deque<ControlTransferAsync_Command> commands(m_commands);
-	m_commands.clear();
+	deque<ControlTransferAsync_Command> commands;
+	commands.swap(m_commands);
 	size_t commands_len = commands.size(); //sic
 	if (!commands.empty())
 	{
@@ -434,17 +652,16 @@ ControlTransferAsync::close(void)
 		 * remainder immediately by calling the callback (without issuing to WinUSB)."
 		 */
 		DBG("ControlTransferAsync::close() ... clearing FIRST command in queue");
-		ControlTransferAsync_Command command(commands.front());
+		ControlTransferAsync_Command command(std::move(commands.front()));
 		commands.pop_front();
 		_finish(command);
 	}
 	while (!commands.empty())
 	{
 		DBG("ControlTransferAsync::close() ... clearing NEXT command in queue");
-		ControlTransferAsync_cbk_fn cbk_fn = commands.front().cbk_fn;
-		WINUSB_SETUP_PACKET setup_packet = commands.front().setup_packet;
+		ControlTransferAsync_Command command(std::move(commands.front()));
 		commands.pop_front();
-		cbk_fn(ControlTransferResponse(setup_packet, DeviceEvent::UNDEFINED, vector<UCHAR>()));
+		command.cbk_fn(ControlTransferResponse(command.setup_packet, DeviceEvent::UNDEFINED, vector<UCHAR>()));
 	}
 	/**
 	 * Q: Why aren't we finishing?
@@ -506,10 +723,9 @@ ControlTransferAsync::pend(
 		return false;
 	}
 	DBG("ControlTransferAsync::pend() ... no stop code, proceed...");
-	ControlTransferAsync_Command command(cbk_fn, setup_packet, buffer);
 	bool was_empty = m_commands.empty();
 	DBG("ControlTransferAsync::pend() ... adding new command to queue...");
-	m_commands.push_back(command);
+	m_commands.emplace_back(std::move(cbk_fn), setup_packet, std::move(buffer));
 	if (was_empty)
 	{
 		DBG("ControlTransferAsync::pend() ... que was empty so calling ::_issue()");
@@ -529,9 +745,9 @@ ControlTransferAsync::_issue(void)
 		return true;
 	}
 	DBG("ControlTransferAsync::_issue() ... there are " << m_commands.size() << " commands in the queue");
-	ControlTransferAsync_cbk_fn cbk_fn = m_commands.front().cbk_fn;
+	const ControlTransferAsync_cbk_fn& cbk_fn = m_commands.front().cbk_fn;
 	WINUSB_SETUP_PACKET         setup_packet = m_commands.front().setup_packet;
-	vector<UCHAR>          buffer = m_commands.front().buffer;
+	const vector<UCHAR>&        buffer = m_commands.front().buffer;
 	m_overlapped->reset();
 	if (USB_ENDPOINT_DIRECTION_OUT(setup_packet.RequestType))
 	{
@@ -541,15 +757,8 @@ ControlTransferAsync::_issue(void)
 			m_overlapped->m_buffer = buffer;
 		}
 	}
-	DBG("ControlTransferAsync::_issue() ... calling WinUsb_ControlTransfer(event=" << m_overlapped->m_event << ")");
-	BOOL winres = WinUsb_ControlTransfer(
-		m_winusb,
-		setup_packet,
-		m_overlapped->m_buffer.data(),
-		setup_packet.Length,
-		NULL,
-		m_overlapped->ov_ptr()
-	);
+	DBG("ControlTransferAsync::_issue() ... calling control_transfer(event=" << m_overlapped->m_event << ")");
+	BOOL winres = m_transport->control_transfer(setup_packet, m_overlapped);
 	DWORD dwResult;
 	// sanitize_boolean_return_code() only used once here, and overrides enum for stop_code
 	if (winres == TRUE)
@@ -589,18 +798,17 @@ ControlTransferAsync::_issue(void)
 }
 
 void
-ControlTransferAsync::_finish(ControlTransferAsync_Command command)
+ControlTransferAsync::_finish(const ControlTransferAsync_Command& command)
 {
 	DBG("ControlTransferAsync::_finish()");
-	ControlTransferAsync_cbk_fn cbk_fn = command.cbk_fn;
+	const ControlTransferAsync_cbk_fn& cbk_fn = command.cbk_fn;
 	WINUSB_SETUP_PACKET         setup_packet = command.setup_packet;
 	vector<UCHAR>          buffer; // it is None in python, but we just use an empty one here
 	ULONG                       length_transferred;
 
-	DBG("ControlTransferAsync::_finish() ... calling WinUsb_GetOverlappedResults()");
-	BOOL rc = WinUsb_GetOverlappedResult(
-		m_winusb,
-		m_overlapped->ov_ptr(),
+	DBG("ControlTransferAsync::_finish() ... calling get_overlapped_result()");
+	BOOL rc = m_transport->get_overlapped_result(
+		m_overlapped,
 		&length_transferred,
 		TRUE
 	);
@@ -630,10 +838,12 @@ ControlTransferAsync::_finish(ControlTransferAsync_Command command)
 				throw runtime_error("ControlTransferAsync::_finish() transferred size exceeds buffer!");
 			}
 			DBG("ControlTransferAsync::_finish() ... INCOMING setup_packet.Length=" << setup_packet.Length << ", length_transferred=" << length_transferred << " B");
-			buffer = m_overlapped->m_buffer;
+			// Only what was asked for; the overlapped buffer is always 4 KB
+			size_t length = min((size_t)setup_packet.Length, m_overlapped->m_buffer.size());
+			buffer.assign(m_overlapped->m_buffer.begin(), m_overlapped->m_buffer.begin() + length);
 		}
 	}
-	ControlTransferResponse response(setup_packet, DeviceEvent::FORCE_CAST_FROM_GETLASTERROR_BUG, buffer);
+	ControlTransferResponse response(setup_packet, DeviceEvent::FORCE_CAST_FROM_GETLASTERROR_BUG, std::move(buffer));
 	DBG("ControlTransferAsync::_finish() ... calling cbk_fn");
 	cbk_fn(response);
 }
@@ -652,7 +862,7 @@ ControlTransferAsync::process(void)
 	if (rc == WAIT_OBJECT_0) // transfer done
 	{
 		DBG("ControlTransferAsync::process() ... transfer finished (WAIT_OBJECT_0)");
-		ControlTransferAsync_Command command = m_commands.front();
+		ControlTransferAsync_Command command(std::move(m_commands.front()));
 		m_commands.pop_front();
 		DBG("ControlTransferAsync::process() ... finish command");
 		_finish(command);
@@ -694,6 +904,7 @@ WinUsbDevice::_update_event_list(void)
 	DBG("WinUsbDevice::_update_event_list()");
 	m_event_list_count = 0;
 	//_event_append(m_event);
+	_event_append(m_post_event);
 	if (m_control_transfer != nullptr)
 	{
 		_event_append(m_control_transfer->event())
@@ -714,28 +925,14 @@ WinUsbDevice::open(wstring _path, event_callback_fn_t* event_callback_fn)
 	close();
 	DBG("WinUsbDevice::open() - main open");
 	m_event_callback_fn = event_callback_fn;
+	m_abort_msg.clear();
 
-	m_file = CreateFile(
-		m_path.c_str(),
-		GENERIC_WRITE | GENERIC_READ,
-		FILE_SHARE_WRITE | FILE_SHARE_READ,
-		NULL,
-		OPEN_EXISTING,
-		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED,
-		NULL);
-	if (m_file == INVALID_HANDLE_VALUE)
-	{
-		throw runtime_error("Open failed on invalid handle");
-	}
-	if (!WinUsb_Initialize(m_file, &m_winusb))
-	{
-		throw runtime_error("Open failed"); // get last error
-	}
-	m_control_transfer = new ControlTransferAsync(m_winusb);
+	m_transport->open(m_path);
+	m_transport_open = true;
+	m_control_transfer = new ControlTransferAsync(m_transport);
 	m_control_transfer->open();
 	DWORD timeout = CONTROL_TIMEOUT * 1000;
-	BOOL result = WinUsb_SetPipePolicy(
-		m_winusb,
+	BOOL result = m_transport->set_pipe_policy(
 		0,
 		PIPE_TRANSFER_TIMEOUT,
 		sizeof(timeout),
@@ -743,7 +940,7 @@ WinUsbDevice::open(wstring _path, event_callback_fn_t* event_callback_fn)
 	);
 	if (!result)
 	{
-		LOG("WinUsb_SetPipePolicy: " << GetLastErrorText());
+		LOG("set_pipe_policy: " << GetLastErrorText());
 	}
 	_update_event_list();
 }
@@ -764,12 +961,10 @@ WinUsbDevice::close(void)
 		delete m_control_transfer;
 		m_control_transfer = nullptr;
 	}
-	if (m_file != NULL)
+	if (m_transport_open)
 	{
-		WinUsb_Free(m_winusb);
-		m_winusb = NULL;
-		CloseHandle(m_file);
-		m_file = NULL;
+		m_transport->close();
+		m_transport_open = false;
 	}
 	m_interface = 0;
 	/*
@@ -782,48 +977,110 @@ WinUsbDevice::close(void)
 	m_event_callback_fn = nullptr;
 }
 
-class ControlTransferSynchronizer
+/**
+ * Queue a job to run on whichever thread is in process() next, and wake
+ * it. This is how other threads get at the control pipe: ControlTransferAsync
+ * itself is only ever touched from inside process().
+ */
+void
+WinUsbDevice::_post(function<void(void)> job)
+{
+	{
+		lock_guard<mutex> guard(m_post_lock);
+		m_posted.push_back(job);
+	}
+	SetEvent(m_post_event);
+}
+
+// Must hold m_process_lock
+void
+WinUsbDevice::_run_posted(void)
 {
-public:
-	ControlTransferSynchronizer(time_t _timeout)
+	deque<function<void(void)>> jobs;
+	{
+		lock_guard<mutex> guard(m_post_lock);
+		jobs.swap(m_posted);
+	}
+	for (auto& job : jobs)
 	{
-		m_timeout = _timeout;
-		m_done = false;
-		m_time_start = time(nullptr);
+		job();
 	}
-	bool isDone(void)
+}
+
+future<vector<UCHAR>>
+WinUsbDevice::control_transfer_in_future(
+	UCHAR Recipient,
+	UCHAR Type,
+	UCHAR Request,
+	UINT Value,
+	UINT Index,
+	USHORT Length)
+{
+	shared_ptr<promise<vector<UCHAR>>> result = make_shared<promise<vector<UCHAR>>>();
+	future<vector<UCHAR>> f = result->get_future();
+	_post([=]()
 	{
-		if (m_done)
+		try
 		{
-			return true;
+			control_transfer_in([result](const ControlTransferResponse& ctr)
+			{
+				vector<UCHAR> data;
+				if (ctr.setup_packet.Length <= ctr.data.size())
+				{
+					data.assign(ctr.data.begin(), ctr.data.begin() + ctr.setup_packet.Length);
+				}
+				try
+				{
+					result->set_value(data);
+				}
+				catch (const future_error&)
+				{
+					// A command that failed to issue is finished again on close
+				}
+			}, Recipient, Type, Request, Value, Index, Length);
 		}
-		time_t time_delta(time(nullptr) - m_time_start);
-		if (time_delta > m_timeout)
+		catch (...)
 		{
-			throw runtime_error("ControlTransferSynchronizer() ... timeout");
+			result->set_exception(current_exception());
 		}
-		return false;
-	}
-	void callback(ControlTransferResponse ctr)
+	});
+	return f;
+}
+
+future<bool>
+WinUsbDevice::control_transfer_out_future(
+	UCHAR Recipient,
+	UCHAR Type,
+	UCHAR Request,
+	UINT Value,
+	UINT Index,
+	vector<UCHAR> data)
+{
+	shared_ptr<promise<bool>> result = make_shared<promise<bool>>();
+	future<bool> f = result->get_future();
+	_post([=]() mutable
 	{
-		if (ctr.setup_packet.Length <= ctr.data.size())
+		try
 		{
-			m_data = vector<UCHAR>(ctr.data.begin(), ctr.data.begin() + ctr.setup_packet.Length);
+			control_transfer_out([result](const ControlTransferResponse& ctr)
+			{
+				try
+				{
+					result->set_value(true);
+				}
+				catch (const future_error&)
+				{
+				}
+			}, Recipient, Type, Request, Value, Index, std::move(data));
 		}
-		m_done = true;
-	}
-	vector<UCHAR> response(void)
-	{
-		return m_data;
-	}
-private:
-	bool          m_done;
-	vector<UCHAR> m_data;
-	time_t        m_time_start;
-	time_t        m_timeout;
-};
+		catch (...)
+		{
+			result->set_exception(current_exception());
+		}
+	});
+	return f;
+}
 
-// TODO: WinUsb has a synchronous control transfer function
 bool
 WinUsbDevice::control_transfer_out_sync(
 	UCHAR Recipient,
@@ -834,20 +1091,11 @@ WinUsbDevice::control_transfer_out_sync(
 	vector<UCHAR> data)
 {
 	DBG("WinUsbDevice::control_transfer_out_sync()");
-	ControlTransferSynchronizer sync(1);
-	ControlTransferAsync_cbk_fn lambda = [&](ControlTransferResponse ctr)
-	{
-		sync.callback(ctr);
-	};
-	this->control_transfer_out(lambda, Recipient, Type, Request, Value, Index, data);
-	while (!sync.isDone())
-	{
-		process(10);
-	}
+	future<bool> f = control_transfer_out_future(Recipient, Type, Request, Value, Index, move(data));
+	wait(f);
 	return false;
 }
 
-// TODO: WinUsb has a synchronous control transfer function
 vector<UCHAR>
 WinUsbDevice::control_transfer_in_sync(
 	UCHAR Recipient,
@@ -858,17 +1106,8 @@ WinUsbDevice::control_transfer_in_sync(
 	USHORT Length)
 {
 	DBG("WinUsbDevice::control_transfer_in_sync()");
-	ControlTransferSynchronizer sync(1);
-	ControlTransferAsync_cbk_fn lambda = [&](ControlTransferResponse ctr)
-	{
-		sync.callback(ctr);
-	};
-	this->control_transfer_in(lambda, Recipient, Type, Request, Value, Index, Length);
-	while (!sync.isDone())
-	{
-		process(10);
-	}
-	return sync.response();
+	future<vector<UCHAR>> f = control_transfer_in_future(Recipient, Type, Request, Value, Index, Length);
+	return wait(f);
 }
 
 bool
@@ -897,7 +1136,7 @@ WinUsbDevice::control_transfer_out(
 	{
 		throw runtime_error("WinUsbDevice::control_transfer_out() ... WinUsbDevice is not open");
 	}
-	return m_control_transfer->pend(cbk_fn, pkt, data);
+	return m_control_transfer->pend(std::move(cbk_fn), pkt, std::move(data));
 }
 
 bool
@@ -927,7 +1166,7 @@ WinUsbDevice::control_transfer_in(
 	{
 		throw runtime_error("WinUsbDevice::control_transfer_in() ... WinUsbDevice is not open");
 	}
-	return m_control_transfer->pend(cbk_fn, pkt);
+	return m_control_transfer->pend(std::move(cbk_fn), pkt);
 }
 
 void
@@ -935,7 +1174,9 @@ WinUsbDevice::read_stream_start(
 	UCHAR endpoint_id,
 	UINT transfers,
 	UINT block_size,
-	RawBuffer *raw_buffer
+	RawBuffer *raw_buffer,
+	bool adaptive,
+	bool per_completion
 )
 {
 	DBG("WinUsbDevice::read_stream_start(endpoint_id=" << (int)endpoint_id << ")");
@@ -949,7 +1190,8 @@ WinUsbDevice::read_stream_start(
 		m_endpoints.erase(itr);
 	}
 	DBG("WinUsbDevice::read_stream_start() ... creating & inserting endpoint");
-	EndpointIn endpoint(m_winusb, pipe_id, transfers, block_size, raw_buffer);
+	m_stats.reset();
+	EndpointIn endpoint(m_transport, pipe_id, transfers, block_size, raw_buffer, &m_stats, adaptive, per_completion, m_notify);
 	m_endpoints.insert(make_pair(pipe_id, endpoint));
 	//BUGBUG: the pair above is a COPY!
 	//endpoint.start(); <- so we can't do this. heh.
@@ -977,10 +1219,26 @@ WinUsbDevice::read_stream_stop(UCHAR endpoint_id)
 	}
 }
 
+// Where an endpoint's read queue is now, e.g. after tuning
+bool
+WinUsbDevice::read_stream_tuning(UCHAR endpoint_id, UINT& transfers, UINT& block_size)
+{
+	UCHAR pipe_id = (endpoint_id & 0x7f) | 0x80;
+	EndpointInMap::iterator itr = m_endpoints.find(pipe_id);
+	if (itr == m_endpoints.end())
+	{
+		return false;
+	}
+	transfers = itr->second.transfers();
+	block_size = itr->second.block_size();
+	return true;
+}
+
 void
 WinUsbDevice::_abort(int stop_code, string msg)
 {
 	DBG("WinUsbDevice::_abort(stop_code=" << stop_code << ", msg=" << msg << ")");
+	m_abort_msg = msg;
 	EndpointInMap::iterator it;
 	for (it = m_endpoints.begin(); it != m_endpoints.end(); it++)
 	{
@@ -1002,9 +1260,19 @@ WinUsbDevice::_abort(int stop_code, string msg)
 
 void
 WinUsbDevice::process(DWORD msec)
+{
+	lock_guard<mutex> guard(m_process_lock);
+	_process(msec);
+}
+
+// Must hold m_process_lock
+void
+WinUsbDevice::_process(DWORD msec)
 {
 	DBG("WinUsbDevice::process(" << timeout << ")");
+	_run_posted();
 	DWORD rv = WaitForMultipleObjects(m_event_list_count, m_event_list.data(), FALSE, msec);
+	_run_posted();
 	DBG("WinUsbDevice::process() rv = " << rv);
 	if (rv < MAXIMUM_WAIT_OBJECTS)
 	{
@@ -23,6 +23,9 @@
 #include <map>
 #include <vector>
 #include <functional>
+#include <future>
+#include <stdexcept>
+#include <mutex>
 #include <ctime>
 #include <iomanip>
 
@@ -35,16 +38,29 @@
 
 template<typename ... Args> std::string string_format(const std::string& format, Args ... args);
 
-//#define ENDPOINT_PERFSTATS
 #include <chrono>
-#include <numeric>
 #include <algorithm>
 
 #include "raw_buffer.hpp"
+#include "usb_transport.hpp"
+#include "latency_histogram.hpp"
 
 // Is this a USB thing or a Joulescope thing
 #define BULK_IN_LENGTH 512u // see usb/__init__.py
 
+// Limits for the adaptive read queue, see EndpointIn::_tune()
+#define USB_TRANSFERS_MIN      2u
+#define USB_TRANSFERS_MAX      64u
+#define USB_PACKETS_MIN        32u    // packets per read
+#define USB_PACKETS_MAX        1024u
+#define USB_QUEUED_PACKETS_MAX 16384u // about 1 s of data, well inside RawBuffer
+#define USB_TUNE_WINDOW_PACKETS 16384u // re-evaluate about once a second
+// The low-latency read queue: a read every ~1 ms, 64 ms queued in all
+#define USB_LOW_LATENCY_TRANSFERS 64u
+#define USB_LOW_LATENCY_PACKETS   16u
+
+#define CONTROL_SYNC_TIMEOUT_MS 2000u
+
 /**
  * This is mixed up with DWORD GetLastError and Python NONE.
  */
@@ -63,42 +79,6 @@ typedef bool (*EndpointIn_data_fn_t)(std::vector<UCHAR>&);
 typedef bool (*EndpointIn_process_fn_t)(void);
 typedef void (*EndpointIn_stop_fn_t)(int, std::string);
 
-/**
- * This is a wrapper around Windows OVERLAPPED object that contains
- * its own STL buffer container. Each overlapped transfer has an
- * event associated with it, and is used either by ReadPipe or
- * ControlTransfer. Note that before using each OVERLAPPED, the
- * event handle needs to be reset and the structure zeroed.
- */
-struct TransferOverlapped
-{
-	TransferOverlapped(HANDLE _event, size_t _size) : m_event(_event)
-	{
-		m_size = _size;
-		m_buffer.resize(m_size);
-		reset();
-	};
-	LPOVERLAPPED ov_ptr(void) {
-		return &m_ov;
-	}
-	void reset(void)
-	{
-		ZeroMemory(&m_ov, sizeof(m_ov));
-		m_ov.hEvent = m_event;
-		/**
-		 * TODO: This should be sized according to the request.
-		 * Revisit the Python, it properly resizes this buffer duringcontrol transfers
-		 * It is unlikely we will have a bug here since there are limited ctrl transfers
-		 * but if we exceed 4096B it might fail.
-		 */
-		m_buffer.resize(m_size);
-	};
-	OVERLAPPED         m_ov;
-	std::vector<UCHAR> m_buffer;
-	HANDLE             m_event;
-	size_t             m_size;
-};
-
 /**
  * This was the sole conversion problem between Python and C++. Using
  * pass-by-reference and creating copies of the in-flight OVERLAPPED
@@ -114,20 +94,51 @@ struct TransferOverlapped
  */
 typedef std::deque<TransferOverlapped*> TransferOverlappedDeque;
 
+/**
+ * Where the streaming time goes, recorded on every read. WinUsbDevice owns
+ * these so they outlive the endpoint, and they are reset on each stream
+ * start; the `stats` command reads them at any time.
+ */
+struct DeviceStats
+{
+	LatencyHistogram completion_interval; // between successive finished reads
+	LatencyHistogram add_data;            // RawBuffer::add_data(), per read
+	LatencyHistogram process_data;        // RawBuffer::process_data(), per pass
+	LatencyHistogram resubmit_delay;      // finished read seen to re-issued
+	ULONG            expire_max = 0;      // most reads finished in one pass
+	void reset(void)
+	{
+		completion_interval.reset();
+		add_data.reset();
+		process_data.reset();
+		resubmit_delay.reset();
+		expire_max = 0;
+	}
+};
+
 class EndpointIn
 {
 public:
 	EndpointIn(
-		HANDLE _winusb,
+		UsbTransport *_transport,
 		UCHAR _pipe_id,
 		UINT _transfers,
 		UINT _block_size,
-		RawBuffer *raw_buffer
+		RawBuffer *raw_buffer,
+		DeviceStats *_stats = nullptr,
+		bool _adaptive = false,
+		bool _per_completion = false,
+		std::ostream *_notify = &std::cout
 	);
 private:
 	void _open(void);
 	void _close(void);
 	bool _issue(TransferOverlapped*);
+	bool _recycle(TransferOverlapped*);
+	bool _deliver(void);
+	bool _process_data(void);
+	void _tune(void);
+	void _tune_reset(void);
 	bool _pend(void);
 	bool _expire(void);
 	void _cancel(void);
@@ -139,18 +150,29 @@ public:
 	void stop(void);
 	// needed by WinUsbDevice event updater
 	HANDLE event(void) { return m_event; }
+	UINT transfers(void) { return m_transfers; }
+	UINT block_size(void) { return m_transfer_size; }
 	// needed public in WinUsbDevice::process()
 	UCHAR m_pipe_id;
 	// needed public in WinUsbDevice::process()
 	DeviceEvent m_stop_code;
 private:
-	HANDLE m_winusb;
+	UsbTransport *m_transport;
 	HANDLE m_event;
 	TransferOverlappedDeque m_overlapped_free;
 	TransferOverlappedDeque m_overlapped_pending;
+	// Finished this pass, with their lengths
+	std::vector<std::pair<TransferOverlapped*, ULONG>> m_overlapped_done;
+	// Data from finished reads by issue order, waiting for earlier ones
+	std::map<uint64_t, std::vector<UCHAR>> m_completed;
+	std::vector<std::vector<UCHAR>> m_spare;
+	uint64_t m_issue_seq;
+	uint64_t m_deliver_seq;
 	UINT m_transfers;
 	UINT m_transfer_size;
 	RawBuffer *m_raw_buffer;
+	DeviceStats *m_stats;
+	std::chrono::steady_clock::time_point m_last_completion;
 	UINT m_process_transfers;
 	enum class state_e { ST_IDLE = 0, ST_RUNNING, ST_STOPPING };
 	state_e m_state;
@@ -159,60 +181,24 @@ private:
 	ULONG m_byte_count_total;
 	ULONG m_transfer_count;
 	ULONG m_transfer_expire_max;
-
-#ifdef ENDPOINT_PERFSTATS
-	struct PerfStats
-	{
-		PerfStats()
-		{
-			data_fn_time.reserve(100'000);
-			process_fn_time.reserve(100'000);
-		}
-		// Arrays of deltas so we can do max/min/avg on close
-		std::vector<float> data_fn_time;
-		std::vector<float> process_fn_time;
-	} m_perf_stats;
-	void print_stats_to_console(void)
-	{
-		double avg, max, min;
-		size_t n;
-		
-		std::cout << std::setprecision(3);
-
-		n = m_perf_stats.data_fn_time.size();
-		min = *std::min_element(
-			m_perf_stats.data_fn_time.begin(),
-			m_perf_stats.data_fn_time.end());
-		avg = std::accumulate(
-			m_perf_stats.data_fn_time.begin(),
-			m_perf_stats.data_fn_time.end(), 0.0) / n;
-		max = *std::max_element(
-			m_perf_stats.data_fn_time.begin(),
-			m_perf_stats.data_fn_time.end());
-		avg *= 1e6;
-		min *= 1e6;
-		max *= 1e6;
-		std::cout << "   data_fn [" << min << ", " << avg << ", " << max << "] n=" << n << std::endl;
-
-		n = m_perf_stats.process_fn_time.size();
-		min = *std::min_element(
-			m_perf_stats.process_fn_time.begin(),
-			m_perf_stats.process_fn_time.end());
-		avg = std::accumulate(
-			m_perf_stats.process_fn_time.begin(),
-			m_perf_stats.process_fn_time.end(), 0.0) / n;
-		max = *std::max_element(
-			m_perf_stats.process_fn_time.begin(),
-			m_perf_stats.process_fn_time.end());
-		avg *= 1e6;
-		min *= 1e6;
-		max *= 1e6;
-		std::cout << "process_fn [" << min << ", " << avg << ", " << max << "] n=" << n << std::endl;
-
-		std::cout << std::defaultfloat;
-
-	}
-#endif
+	/**
+	 * With `m_adaptive`, the number of reads kept queued (m_transfers) and
+	 * their size (m_transfer_size) follow what was measured over the last
+	 * window; see _tune(). Buffers are resized or freed as they come back.
+	 */
+	bool m_adaptive;
+	// Process each read as it is delivered, rather than once per pass
+	bool m_per_completion;
+	std::ostream *m_notify;
+	UINT m_overlapped_count;
+	std::chrono::steady_clock::time_point m_window_start;
+	std::chrono::steady_clock::time_point m_last_service;
+	ULONG m_window_transfers;
+	ULONG m_window_packets;
+	size_t m_window_dropped;
+	double m_window_latency_ms; // sum, issue to completion seen
+	double m_window_process_ms; // sum, RawBuffer::process_data()
+	double m_window_gap_ms;     // max time between servicing completions
 };
 
 // pipe_id -> EndpointIn
@@ -225,10 +211,10 @@ struct ControlTransferResponse
 	ControlTransferResponse(
 		WINUSB_SETUP_PACKET _setup_packet,
 		DeviceEvent         _result,
-		std::vector<UCHAR>  _data // TODO is this a time-wasting deep-copy?
+		std::vector<UCHAR>  _data
 	) : setup_packet(_setup_packet),
 		result(_result),
-		data(_data)
+		data(std::move(_data))
 	{};
 	WINUSB_SETUP_PACKET setup_packet;
 	DeviceEvent         result;
@@ -243,20 +229,22 @@ struct ControlTransferResponse
  * callback function to be defined as a type `std::function`.
  *
  * N.B.: I've never used `std::function` before, so this code is suspect.
+ *
+ * Responses are passed by reference and buffers are moved, not copied,
+ * through the command queue.
  */
 //typedef void (*ControlTransferAsync_cbk_fn)(ControlTransferResponse);
-// TODO: Pass a reference to avoid large (failed!) copies of m_data
-typedef std::function<void(ControlTransferResponse)> ControlTransferAsync_cbk_fn;
+typedef std::function<void(const ControlTransferResponse&)> ControlTransferAsync_cbk_fn;
 
 struct ControlTransferAsync_Command
 {
 	ControlTransferAsync_Command(
 		ControlTransferAsync_cbk_fn _cbk_fn,
 		WINUSB_SETUP_PACKET         _setup_packet,
-		std::vector<UCHAR>          _buffer // TODO: is this a time-wasting deep-copy?
-	) : cbk_fn(_cbk_fn),
+		std::vector<UCHAR>          _buffer
+	) : cbk_fn(std::move(_cbk_fn)),
 		setup_packet(_setup_packet),
-		buffer(_buffer)
+		buffer(std::move(_buffer))
 	{};
 	ControlTransferAsync_cbk_fn cbk_fn;
 	WINUSB_SETUP_PACKET         setup_packet;
@@ -265,7 +253,7 @@ struct ControlTransferAsync_Command
 
 class ControlTransferAsync {
 public:
-	ControlTransferAsync(HANDLE _winusb);
+	ControlTransferAsync(UsbTransport *_transport);
 	HANDLE event(void);
 	void open(void);
 	void close(void);
@@ -276,9 +264,9 @@ public:
 private:
 	void _close_event(void);
 	bool _issue(void);
-	void _finish(ControlTransferAsync_Command);
+	void _finish(const ControlTransferAsync_Command&);
 
-	HANDLE m_winusb;
+	UsbTransport *m_transport;
 	HANDLE m_event;
 	TransferOverlapped *m_overlapped;
 	std::deque<ControlTransferAsync_Command> m_commands;
@@ -289,21 +277,54 @@ class WinUsbDevice {
 public:
 	WinUsbDevice(void)
 	{
-		m_file = NULL;
-		m_winusb = NULL;
+		m_transport = &m_winusb_transport;
 		m_interface = 0;
 		m_endpoints.clear();
 		m_event_list.resize(MAXIMUM_WAIT_OBJECTS);
 		m_event_callback_fn = nullptr;
 		m_control_transfer = nullptr;
 		m_event_list_count = 0; // not in the python constructor
+		m_post_event = CreateEvent(NULL, FALSE, FALSE, NULL);
 		_update_event_list();
 	};
+	~WinUsbDevice()
+	{
+		if (m_post_event != NULL)
+		{
+			CloseHandle(m_post_event);
+		}
+	}
 	void open(std::wstring _path, event_callback_fn_t* event_callback_fn = nullptr);
 	void close(void);
+	/**
+	 * Swap in another backend (e.g. a FakeTransport) before open();
+	 * nullptr goes back to WinUSB. The transport is not owned.
+	 */
+	void transport(UsbTransport *ptr)
+	{
+		m_transport = (ptr == nullptr) ? &m_winusb_transport : ptr;
+	}
 	void _update_event_list(void);
+	/**
+	 * Copy out the events process() waits on, for a caller that waits on
+	 * them itself (alongside others) and then calls process(0).
+	 */
+	DWORD events(HANDLE *out, DWORD max)
+	{
+		DWORD n = (m_event_list_count < max) ? m_event_list_count : max;
+		std::copy(m_event_list.begin(), m_event_list.begin() + n, out);
+		return n;
+	}
 	std::wstring path(void) { return m_path; };
 	std::wstring serial_number(void) { return m_path; };
+	/**
+	 * The callback versions may only be called from the thread running
+	 * process() (or before anyone is). Everything else goes through the
+	 * _future and _sync versions, which are safe from any thread, including
+	 * while streaming: the request is queued, the thread in process() is
+	 * woken to issue it, and the result comes back through the future. The
+	 * _sync versions run process() themselves if no other thread is.
+	 */
 	bool control_transfer_out(
 		ControlTransferAsync_cbk_fn cbk_fn,
 		UCHAR Recipient,
@@ -320,6 +341,31 @@ public:
 		UINT Value,
 		UINT Index,
 		USHORT Length);
+	std::future<bool> control_transfer_out_future(
+		UCHAR Recipient,
+		UCHAR Type,
+		UCHAR Request,
+		UINT Value,
+		UINT Index,
+		std::vector<UCHAR> data);
+	std::future<std::vector<UCHAR>> control_transfer_in_future(
+		UCHAR Recipient,
+		UCHAR Type,
+		UCHAR Request,
+		UINT Value,
+		UINT Index,
+		USHORT Length);
+	/**
+	 * Wait for a _future request, running process() meanwhile if no other
+	 * thread is, and return its result (or rethrow its error). Queue a
+	 * batch of _future requests first and they go out back to back.
+	 */
+	template <typename T>
+	T wait(std::future<T>& f)
+	{
+		_wait(f);
+		return f.get();
+	}
 	bool control_transfer_out_sync(
 		UCHAR Recipient,
 		UCHAR Type,
@@ -338,20 +384,67 @@ public:
 		UCHAR endpoint_id,
 		UINT transfers,
 		UINT block_size,
-		RawBuffer *raw_buffer);
+		RawBuffer *raw_buffer,
+		bool adaptive = false,
+		bool per_completion = false);
 		/*
 		EndpointIn_data_fn_t data_fn,
 		EndpointIn_process_fn_t process_fn,
 		EndpointIn_stop_fn_t stop_fn);
 		*/
 	void read_stream_stop(UCHAR endpoint_id);
+	bool read_stream_tuning(UCHAR endpoint_id, UINT& transfers, UINT& block_size);
+	/**
+	 * False once the endpoint has been torn down, which is how a stream
+	 * killed by a USB error shows up: _abort() removes every endpoint and
+	 * leaves its reason in m_abort_msg.
+	 */
+	bool is_streaming(UCHAR endpoint_id)
+	{
+		return m_endpoints.find((endpoint_id & 0x7f) | 0x80) != m_endpoints.end();
+	}
+	std::string m_abort_msg;
 
 	void _abort(int stop_code, std::string msg);
 	void process(DWORD msec);
+	DeviceStats m_stats;
+	// Where endpoints report retuning; it can happen mid-command
+	std::ostream *m_notify = &std::cout;
 private:
+	void _process(DWORD msec);
+	void _post(std::function<void(void)> job);
+	void _run_posted(void);
+	template <typename T>
+	void _wait(std::future<T>& f)
+	{
+		std::chrono::steady_clock::time_point deadline =
+			std::chrono::steady_clock::now() + std::chrono::milliseconds(CONTROL_SYNC_TIMEOUT_MS);
+		while (f.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+		{
+			if (std::chrono::steady_clock::now() > deadline)
+			{
+				throw std::runtime_error("WinUsbDevice control transfer timeout");
+			}
+			std::unique_lock<std::mutex> lock(m_process_lock, std::try_to_lock);
+			if (lock.owns_lock())
+			{
+				_process(10);
+			}
+			else
+			{
+				// Someone else is in process() and will service the request
+				f.wait_for(std::chrono::milliseconds(10));
+			}
+		}
+	}
+	std::mutex m_process_lock;
+	std::mutex m_post_lock;
+	std::deque<std::function<void(void)>> m_posted;
+	HANDLE m_post_event;
 	std::wstring m_path;
-	HANDLE m_file;
-	HANDLE m_winusb;
+	WinUsbTransport m_winusb_transport;
+	UsbTransport *m_transport;
+	bool m_transport_open = false;
 	UINT m_interface; //type?
 	EndpointInMap m_endpoints;
 	std::vector<HANDLE> m_event_list;
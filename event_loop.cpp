@@ -0,0 +1,180 @@
+/**
+ * Copyright 2021 Peter Torelli
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "event_loop.hpp"
+#include "timeline.hpp"
+
+#include <iterator>
+#include <stdexcept>
+
+using namespace std;
+
+/**
+ * Wait on every source, the wake event and the next timer at once, so the
+ * thread only wakes when there is something to do. WaitForMultipleObjects
+ * reports just the lowest signaled handle, so after dispatching that one's
+ * source the others are polled too, and a busy source cannot starve the
+ * ones behind it.
+ */
+void
+EventLoop::run(void)
+{
+	m_thread_id = GetCurrentThreadId();
+	g_timeline.name_thread("event-loop");
+	HANDLE handles[MAXIMUM_WAIT_OBJECTS];
+	EventSource *owners[MAXIMUM_WAIT_OBJECTS];
+	vector<pair<DWORD, DWORD>> ranges(m_sources.size());
+	while (!m_stop)
+	{
+		DWORD n = 0;
+		handles[n] = m_wake;
+		owners[n++] = nullptr;
+		for (size_t i(0); i < m_sources.size(); ++i)
+		{
+			DWORD k = m_sources[i]->handles(&handles[n], MAXIMUM_WAIT_OBJECTS - n);
+			ranges[i] = make_pair(n, k);
+			for (DWORD j(0); j < k; ++j)
+			{
+				owners[n + j] = m_sources[i];
+			}
+			n += k;
+		}
+		DWORD rv = WaitForMultipleObjects(n, handles, FALSE, _timeout());
+		if (rv < WAIT_OBJECT_0 + n)
+		{
+			EventSource *fired = owners[rv - WAIT_OBJECT_0];
+			if (fired != nullptr)
+			{
+				fired->signaled();
+			}
+			for (size_t i(0); i < m_sources.size(); ++i)
+			{
+				if (m_sources[i] != fired && ranges[i].second > 0 &&
+					WaitForMultipleObjects(ranges[i].second, &handles[ranges[i].first], FALSE, 0) < WAIT_OBJECT_0 + ranges[i].second)
+				{
+					m_sources[i]->signaled();
+				}
+			}
+		}
+		else if (rv != WAIT_TIMEOUT)
+		{
+			throw runtime_error("EventLoop wait failed");
+		}
+		_run_posted();
+		_run_timers();
+	}
+	m_stop = false;
+}
+
+void
+EventLoop::stop(void)
+{
+	m_stop = true;
+	SetEvent(m_wake);
+}
+
+void
+EventLoop::post(job_t job)
+{
+	{
+		lock_guard<mutex> guard(m_post_lock);
+		m_posted.push_back(move(job));
+	}
+	SetEvent(m_wake);
+}
+
+uint64_t
+EventLoop::timer(DWORD msec, job_t job)
+{
+	Timer t;
+	t.id = ++m_timer_id;
+	t.job = move(job);
+	m_timers.insert(make_pair(clock_t::now() + chrono::milliseconds(msec), move(t)));
+	return m_timer_id;
+}
+
+void
+EventLoop::cancel(uint64_t id)
+{
+	for (auto itr = m_timers.begin(); itr != m_timers.end(); ++itr)
+	{
+		if (itr->second.id == id)
+		{
+			m_timers.erase(itr);
+			return;
+		}
+	}
+}
+
+// Milliseconds until the next timer, rounded up so it is due when we wake
+DWORD
+EventLoop::_timeout(void)
+{
+	if (m_timers.empty())
+	{
+		return INFINITE;
+	}
+	clock_t::duration left = m_timers.begin()->first - clock_t::now();
+	if (left <= clock_t::duration::zero())
+	{
+		return 0;
+	}
+	return (DWORD)chrono::ceil<chrono::milliseconds>(left).count();
+}
+
+/**
+ * A job that throws ends this run() (the caller reports it and runs the
+ * loop again), but the jobs queued behind it go back on the front of the
+ * queue rather than being lost: one may be a command somebody waits on.
+ */
+void
+EventLoop::_run_posted(void)
+{
+	deque<job_t> jobs;
+	{
+		lock_guard<mutex> guard(m_post_lock);
+		jobs.swap(m_posted);
+	}
+	for (size_t i(0); i < jobs.size(); ++i)
+	{
+		try
+		{
+			jobs[i]();
+		}
+		catch (...)
+		{
+			{
+				lock_guard<mutex> guard(m_post_lock);
+				m_posted.insert(m_posted.begin(), make_move_iterator(jobs.begin() + i + 1), make_move_iterator(jobs.end()));
+			}
+			SetEvent(m_wake);
+			throw;
+		}
+	}
+}
+
+// A timer may add or cancel timers, so take each one off before running it
+void
+EventLoop::_run_timers(void)
+{
+	clock_t::time_point now = clock_t::now();
+	while (!m_timers.empty() && m_timers.begin()->first <= now)
+	{
+		job_t job = move(m_timers.begin()->second.job);
+		m_timers.erase(m_timers.begin());
+		job();
+	}
+}
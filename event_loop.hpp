@@ -0,0 +1,102 @@
+/**
+ * Copyright 2021 Peter Torelli
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <Windows.h>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <vector>
+
+/**
+ * Something the loop waits on: a USB device, a file writer. The handles
+ * may change from one wait to the next (a streaming endpoint adds one), so
+ * the loop asks for them again every time. `signaled()` is called when any
+ * of them fires and must not block; all of the handles are manual-reset,
+ * except that an auto-reset handle is fine if `signaled()` does its work
+ * without needing to see it set.
+ */
+class EventSource
+{
+public:
+	virtual ~EventSource() {}
+	virtual DWORD handles(HANDLE *out, DWORD max) = 0;
+	virtual void signaled(void) = 0;
+};
+
+/**
+ * One thread that does everything time-critical: USB completions, file
+ * write completions, commands and timers. Other threads hand work to it
+ * with post(), which is the only way in; nothing the loop owns needs a
+ * lock. Sources, timers and posted jobs all run on the loop thread, one at
+ * a time, in the order they become ready.
+ */
+class EventLoop
+{
+public:
+	typedef std::function<void(void)> job_t;
+	EventLoop()
+	{
+		m_wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+	}
+	~EventLoop()
+	{
+		if (m_wake != NULL)
+		{
+			CloseHandle(m_wake);
+		}
+	}
+	// Before run()
+	void add(EventSource *source)
+	{
+		m_sources.push_back(source);
+	}
+	void run(void);
+	// Any thread
+	void stop(void);
+	void post(job_t job);
+	// Loop thread only; a timer runs once, `msec` from now
+	uint64_t timer(DWORD msec, job_t job);
+	void cancel(uint64_t id);
+	bool in_loop(void)
+	{
+		return GetCurrentThreadId() == m_thread_id;
+	}
+private:
+	typedef std::chrono::steady_clock clock_t;
+	struct Timer
+	{
+		uint64_t id;
+		job_t    job;
+	};
+	DWORD _timeout(void);
+	void _run_posted(void);
+	void _run_timers(void);
+
+	HANDLE                            m_wake;
+	std::atomic<bool>                 m_stop{ false };
+	std::atomic<DWORD>                m_thread_id{ 0 };
+	std::vector<EventSource*>         m_sources;
+	std::mutex                        m_post_lock;
+	std::deque<job_t>                 m_posted;
+	std::multimap<clock_t::time_point, Timer> m_timers;
+	uint64_t                          m_timer_id = 0;
+};
@@ -0,0 +1,301 @@
+/**
+ * Copyright 2021 Peter Torelli
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fake_transport.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+
+using namespace std;
+
+// Our own marker in OVERLAPPED::Internal; completed transfers hold a Win32
+// error code there (0 = success), not an NTSTATUS.
+#define FAKE_PENDING STATUS_PENDING
+
+void
+FakeTransport::open(wstring path)
+{
+	close();
+	m_rng.seed(m_config.seed);
+	m_seq = 0;
+	m_completed = 0;
+	m_failed = 0;
+	m_wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (m_wake == NULL)
+	{
+		throw runtime_error("FakeTransport could not create event");
+	}
+	m_running = true;
+	m_thread = CreateThread(NULL, 0, _thread, this, 0, NULL);
+	if (m_thread == NULL)
+	{
+		m_running = false;
+		CloseHandle(m_wake);
+		m_wake = NULL;
+		throw runtime_error("FakeTransport could not create thread");
+	}
+}
+
+void
+FakeTransport::close(void)
+{
+	if (!m_running)
+	{
+		return;
+	}
+	m_running = false;
+	SetEvent(m_wake);
+	WaitForSingleObject(m_thread, 5000);
+	CloseHandle(m_thread);
+	CloseHandle(m_wake);
+	m_thread = NULL;
+	m_wake = NULL;
+	// Anything still queued is abandoned, as when a device goes away
+	lock_guard<mutex> guard(m_lock);
+	for (Pending& p : m_pending)
+	{
+		p.ov->m_ov.Internal = ERROR_DEVICE_NOT_CONNECTED;
+		SetEvent(p.ov->m_event);
+	}
+	m_pending.clear();
+}
+
+BOOL
+FakeTransport::read_pipe(UCHAR pipe_id, TransferOverlapped *ov)
+{
+	Pending p = {};
+	p.ov = ov;
+	p.pipe_id = pipe_id;
+	p.control = false;
+	unsigned latency = m_config.latency_us;
+	{
+		lock_guard<mutex> guard(m_lock);
+		if (m_config.jitter_us)
+		{
+			latency += m_rng() % m_config.jitter_us;
+		}
+		if (m_config.error_rate > 0.0 &&
+			uniform_real_distribution<double>(0.0, 1.0)(m_rng) < m_config.error_rate)
+		{
+			p.status = m_config.error_code;
+		}
+	}
+	return _submit(p, latency);
+}
+
+BOOL
+FakeTransport::control_transfer(WINUSB_SETUP_PACKET setup_packet, TransferOverlapped *ov)
+{
+	Pending p = {};
+	p.ov = ov;
+	p.control = true;
+	p.setup_packet = setup_packet;
+	return _submit(p, m_config.control_latency_us);
+}
+
+BOOL
+FakeTransport::_submit(Pending p, unsigned latency_us)
+{
+	if (!m_running)
+	{
+		SetLastError(ERROR_DEVICE_NOT_CONNECTED);
+		return FALSE;
+	}
+	// Like the real driver: the event is reset when the transfer starts
+	ResetEvent(p.ov->m_event);
+	p.due_us = _now_us() + latency_us;
+	{
+		lock_guard<mutex> guard(m_lock);
+		p.ov->m_ov.Internal = FAKE_PENDING;
+		p.ov->m_ov.InternalHigh = 0;
+		p.seq = m_seq++;
+		m_pending.push_back(p);
+	}
+	SetEvent(m_wake);
+	SetLastError(ERROR_IO_PENDING);
+	return FALSE;
+}
+
+BOOL
+FakeTransport::get_overlapped_result(TransferOverlapped *ov, ULONG *length, BOOL wait)
+{
+	for (;;)
+	{
+		{
+			lock_guard<mutex> guard(m_lock);
+			DWORD status = (DWORD)ov->m_ov.Internal;
+			if (status != FAKE_PENDING)
+			{
+				*length = (ULONG)ov->m_ov.InternalHigh;
+				if (status != 0)
+				{
+					SetLastError(status);
+					return FALSE;
+				}
+				return TRUE;
+			}
+		}
+		if (!wait)
+		{
+			SetLastError(ERROR_IO_INCOMPLETE);
+			return FALSE;
+		}
+		// The event may be shared with other transfers, so just re-check
+		WaitForSingleObject(ov->m_event, 1);
+	}
+}
+
+BOOL
+FakeTransport::abort_pipe(UCHAR pipe_id)
+{
+	vector<TransferOverlapped*> aborted;
+	{
+		lock_guard<mutex> guard(m_lock);
+		for (auto itr = m_pending.begin(); itr != m_pending.end();)
+		{
+			if (!itr->control && itr->pipe_id == pipe_id)
+			{
+				itr->ov->m_ov.Internal = ERROR_OPERATION_ABORTED;
+				aborted.push_back(itr->ov);
+				itr = m_pending.erase(itr);
+			}
+			else
+			{
+				++itr;
+			}
+		}
+	}
+	for (TransferOverlapped *ov : aborted)
+	{
+		SetEvent(ov->m_event);
+	}
+	return TRUE;
+}
+
+DWORD WINAPI
+FakeTransport::_thread(LPVOID arg)
+{
+	((FakeTransport*)arg)->_loop();
+	return 0;
+}
+
+void
+FakeTransport::_loop(void)
+{
+	while (m_running)
+	{
+		DWORD wait_ms = INFINITE;
+		vector<Pending> due;
+		{
+			lock_guard<mutex> guard(m_lock);
+			uint64_t now = _now_us();
+			sort(m_pending.begin(), m_pending.end(),
+				[](const Pending& a, const Pending& b) { return a.seq < b.seq; });
+			for (auto itr = m_pending.begin(); itr != m_pending.end();)
+			{
+				if (itr->due_us <= now)
+				{
+					// Everything queued before this one has its data by now
+					for (auto prior = m_pending.begin(); prior <= itr; ++prior)
+					{
+						if (!prior->control && prior->pipe_id == itr->pipe_id)
+						{
+							_fill(*prior);
+						}
+					}
+					_fill(*itr);
+					due.push_back(*itr);
+					itr = m_pending.erase(itr);
+				}
+				else
+				{
+					DWORD ms = (DWORD)((itr->due_us - now + 999) / 1000);
+					wait_ms = ms < wait_ms ? ms : wait_ms;
+					++itr;
+				}
+			}
+		}
+		sort(due.begin(), due.end(),
+			[](const Pending& a, const Pending& b) { return a.due_us < b.due_us; });
+		for (Pending& p : due)
+		{
+			_complete(p);
+		}
+		if (due.empty())
+		{
+			WaitForSingleObject(m_wake, wait_ms);
+		}
+	}
+}
+
+// Must hold m_lock
+void
+FakeTransport::_fill(Pending& p)
+{
+	if (p.filled)
+	{
+		return;
+	}
+	p.filled = true;
+	p.length = 0;
+	if (p.control)
+	{
+		if (USB_ENDPOINT_DIRECTION_OUT(p.setup_packet.RequestType))
+		{
+			p.length = p.setup_packet.Length;
+		}
+		if (m_control_fn && !m_control_fn(p.setup_packet, p.ov->m_buffer, p.length))
+		{
+			p.status = ERROR_GEN_FAILURE;
+		}
+		if (p.length > p.setup_packet.Length)
+		{
+			p.length = p.setup_packet.Length;
+		}
+	}
+	else
+	{
+		p.length = (ULONG)p.ov->m_buffer.size();
+		if (m_bulk_fn)
+		{
+			m_bulk_fn(p.pipe_id, p.ov->m_buffer, p.length);
+		}
+	}
+}
+
+void
+FakeTransport::_complete(Pending& p)
+{
+	{
+		lock_guard<mutex> guard(m_lock);
+		p.ov->m_ov.InternalHigh = p.status ? 0 : p.length;
+		p.ov->m_ov.Internal = p.status;
+		++m_completed;
+		if (p.status)
+		{
+			++m_failed;
+		}
+	}
+	SetEvent(p.ov->m_event);
+}
+
+uint64_t
+FakeTransport::_now_us(void)
+{
+	return chrono::duration_cast<chrono::microseconds>(
+		chrono::steady_clock::now().time_since_epoch()).count();
+}
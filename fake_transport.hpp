@@ -0,0 +1,123 @@
+/**
+ * Copyright 2021 Peter Torelli
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cinttypes>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <vector>
+
+#include "usb_transport.hpp"
+
+struct FakeTransportConfig
+{
+	unsigned latency_us = 1000;        // every bulk read takes at least this long
+	unsigned jitter_us = 0;            // plus a uniform random [0, jitter_us)
+	unsigned control_latency_us = 100;
+	double   error_rate = 0.0;         // chance a bulk read fails
+	DWORD    error_code = ERROR_GEN_FAILURE;
+	uint32_t seed = 1;
+};
+
+/**
+ * An in-process stand-in for WinUSB. A worker thread completes queued
+ * transfers after a configurable latency, signaling the same events and
+ * reporting through get_overlapped_result() the way WinUSB does, so the
+ * endpoint and control code runs unchanged without a device.
+ *
+ * With jitter, reads complete out of the order they were queued in. Data
+ * is still assigned in queue order (whatever is queued first is filled
+ * first, as on the wire), so only the notifications are reordered. A
+ * failed read consumes its data and reports `error_code`, which makes
+ * EndpointIn halt the stream exactly as a real USB error would; with
+ * `reconnect on` the trace then resumes with the outage filled in. Latency
+ * and error choices come from a seeded generator, so a run is repeatable
+ * up to the resolution of the Windows timer.
+ *
+ * The bulk and control callbacks supply the content; see
+ * FakeJoulescope for one that looks like a JS110.
+ */
+class FakeTransport : public UsbTransport
+{
+public:
+	// Fill `buffer` with the next read for `pipe_id`; set `length`.
+	typedef std::function<void(UCHAR pipe_id, std::vector<UCHAR>& buffer, ULONG& length)> BulkFn;
+	// Handle one control transfer. For IN, fill `data` and set `length`;
+	// for OUT, `data` holds what was sent. Return false to fail (STALL).
+	typedef std::function<bool(const WINUSB_SETUP_PACKET& setup_packet, std::vector<UCHAR>& data, ULONG& length)> ControlFn;
+
+	~FakeTransport()
+	{
+		close();
+	}
+	void config(const FakeTransportConfig& config)
+	{
+		m_config = config;
+	}
+	void on_bulk(BulkFn fn)
+	{
+		m_bulk_fn = fn;
+	}
+	void on_control(ControlFn fn)
+	{
+		m_control_fn = fn;
+	}
+	void open(std::wstring path);
+	void close(void);
+	BOOL read_pipe(UCHAR pipe_id, TransferOverlapped *ov);
+	BOOL control_transfer(WINUSB_SETUP_PACKET setup_packet, TransferOverlapped *ov);
+	BOOL get_overlapped_result(TransferOverlapped *ov, ULONG *length, BOOL wait);
+	BOOL abort_pipe(UCHAR pipe_id);
+	BOOL set_pipe_policy(UCHAR pipe_id, ULONG policy, ULONG length, PVOID value)
+	{
+		return TRUE;
+	}
+	uint64_t m_completed = 0;
+	uint64_t m_failed = 0;
+private:
+	struct Pending
+	{
+		TransferOverlapped *ov;
+		UCHAR               pipe_id;
+		bool                control;
+		WINUSB_SETUP_PACKET setup_packet;
+		uint64_t            seq;
+		uint64_t            due_us;
+		DWORD               status;
+		ULONG               length;
+		bool                filled;
+	};
+	static DWORD WINAPI _thread(LPVOID arg);
+	void _loop(void);
+	void _fill(Pending& p);
+	void _complete(Pending& p);
+	BOOL _submit(Pending p, unsigned latency_us);
+	uint64_t _now_us(void);
+
+	FakeTransportConfig  m_config;
+	BulkFn               m_bulk_fn;
+	ControlFn            m_control_fn;
+	std::mutex           m_lock;
+	std::vector<Pending> m_pending;
+	std::mt19937         m_rng;
+	uint64_t             m_seq = 0;
+	HANDLE               m_wake = NULL;
+	HANDLE               m_thread = NULL;
+	std::atomic<bool>    m_running{ false };
+};
@@ -17,8 +17,57 @@
  */
 void
 FileWriter::add(float i, float v, uint8_t bits)
+{
+	if (m_live_iv != nullptr)
+	{
+		m_live_iv->put(i, v);
+	}
+	if (m_stream_iv != nullptr)
+	{
+		m_stream_iv->put(i, v);
+	}
+	accumulate(i, v, bits);
+}
+
+/**
+ * Everything add() does except feed the i/v live ring and stream, so
+ * gap() can pad a partial energy sample without them.
+ */
+void
+FileWriter::accumulate(float i, float v, uint8_t bits)
 {
 	float e = (float)((double)i * (double)v / 2.0f);
+	++m_full_samples;
+	if (m_trigger.enabled())
+	{
+		// Rising edge only, so a long burst is one trigger; and the power
+		// must drop clearly below the threshold before it can fire again
+		float p = i * v;
+		if (!m_above && p >= m_trigger.threshold())
+		{
+			m_trigger.trigger(m_total_samples, TRIGGER_THRESHOLD);
+			m_above = true;
+		}
+		else if (m_above && p < m_trigger.threshold() * (1.0f - TRIGGER_HYSTERESIS))
+		{
+			m_above = false;
+		}
+	}
+	if (m_observe_timestamps)
+	{
+		double p = (double)i * (double)v;
+		++m_lap.samples;
+		if (isnan(p))
+		{
+			++m_lap.nan;
+		}
+		else
+		{
+			m_lap.energy += p;
+			m_lap.charge += i;
+			m_lap.peak = p > m_lap.peak ? p : m_lap.peak;
+		}
+	}
 	m_acc += e;
 	++m_total_accumulated;
 	if (m_total_accumulated == m_samples_per_downsample)
@@ -31,21 +80,133 @@ FileWriter::add(float i, float v, uint8_t bits)
 	gpi0_check(m_last_gpi0, ((bits >> 4) & 1) == 1);
 }
 
+/**
+ * Stand in for `samples` full-rate samples the device never sent (the
+ * stream was down while we reconnected) with NaN, so everything after the
+ * outage stays at its true time in the file. GPI0 is held at its last
+ * level so the gap cannot end a lap. With `more`, this adds to the last
+ * gap instead of starting a new one.
+ *
+ * Only the energy sample in progress at each end is made of accumulate()
+ * calls; the whole ones in between go in at the output rate, a page at a time
+ * where nothing else needs to see them (see fill_nan()). The i/v live
+ * ring and stream get nothing for the outage.
+ */
+void
+FileWriter::gap(uint64_t samples, string reason, bool more)
+{
+	if (!more || m_gaps.empty())
+	{
+		m_gaps.push_back(Gap{ m_total_samples, 0, 0, reason });
+	}
+	size_t first = m_total_samples;
+	m_gaps.back().full_samples += samples;
+	if (m_laps != nullptr)
+	{
+		m_laps->skipped(samples);
+	}
+	uint8_t bits = m_last_gpi0 ? 0x10 : 0x00;
+	while (samples > 0 && m_total_accumulated != 0)
+	{
+		accumulate(NAN, NAN, bits);
+		--samples;
+	}
+	uint64_t whole = samples / m_samples_per_downsample;
+	samples -= whole * m_samples_per_downsample;
+	m_full_samples += whole * m_samples_per_downsample;
+	if (m_observe_timestamps)
+	{
+		m_lap.samples += whole * m_samples_per_downsample;
+		m_lap.nan += whole * m_samples_per_downsample;
+	}
+	m_above = false;
+	fill_nan(whole);
+	while (samples > 0)
+	{
+		accumulate(NAN, NAN, bits);
+		--samples;
+	}
+	m_gaps.back().samples += m_total_samples - first;
+}
+
+/**
+ * `count` whole energy samples of NaN, as save_acc() would store them.
+ * Nothing retires pages while this runs on the loop thread, so it does
+ * that itself with reap() before the ring can fill.
+ */
+void
+FileWriter::fill_nan(uint64_t count)
+{
+	bool plain = m_live_energy == nullptr && m_stream_energy == nullptr
+		&& !m_interpolator.enabled() && !m_trigger.enabled() && !m_direct;
+	if (!plain)
+	{
+		for (; count > 0; --count)
+		{
+			if (pages_in_flight() >= MAX_OVERLAPPED_WRITES / 2)
+			{
+				reap();
+			}
+			++m_total_samples;
+			m_acc = NAN;
+			save_acc();
+			m_acc = 0;
+		}
+		return;
+	}
+	m_total_samples += count;
+	m_total_nan += count;
+	while (count > 0)
+	{
+		unsigned n = (unsigned)min<uint64_t>(count, MAX_PAGE_SIZE - m_buffer_pos);
+		fill_n(&m_pages[m_head][m_buffer_pos], n, NAN);
+		m_buffer_pos += n;
+		count -= n;
+		if (m_buffer_pos == MAX_PAGE_SIZE)
+		{
+			reap();
+			m_buffer_pos = 0;
+			next_page();
+		}
+	}
+}
+
 /**
  * If the GPIO IN0 generated a falling edge, capture the approximate time.
- * The vector is written out on close.
+ * The vector is written out on close. An edge also ends the current lap
+ * (if one started) and begins the next one. Unlike the timestamps, the
+ * lap totals are exact to the 2 MS/s sample the edge was seen in; NaN
+ * samples (dropped data) are left out of the sums and counted instead.
+ * Both are handed to the lap notifier, never printed from here.
  */
 void
 FileWriter::gpi0_check(bool& last, bool current)
 {
-	float timestamp;
 	// packed bits : 7 : 6 = 0, 5 = voltage_lsb, 4 = current_lsb, 3 : 0 = i_range
 	if (last && !current)
 	{
+		m_trigger.trigger(m_total_samples, TRIGGER_GPI0);
 		if (m_observe_timestamps == true) {
-			timestamp = (float)m_total_samples / m_sample_rate;
-			m_timestamps.push_back(timestamp);
-			cout << "m-lap-us-" << (unsigned int)(timestamp * 1e6) << endl;
+			LapEvent e;
+			e.timestamp = (float)m_total_samples / m_sample_rate;
+			e.full_sample = m_full_samples;
+			m_timestamps.push_back(e.timestamp);
+			if (m_lap_open)
+			{
+				const double dt = 1.0 / FULL_SAMPLE_RATE;
+				e.lap = true;
+				e.energy_j = m_lap.energy * dt;
+				e.charge_c = m_lap.charge * dt;
+				e.duration_us = m_lap.samples * dt * 1e6;
+				e.peak_w = m_lap.peak;
+				e.nan = m_lap.nan;
+			}
+			if (m_laps != nullptr)
+			{
+				m_laps->push(e);
+			}
+			m_lap = LapStats();
+			m_lap_open = true;
 		}
 	}
 	last = current;
@@ -53,18 +214,34 @@ FileWriter::gpi0_check(bool& last, bool current)
 
 /**
  * Create a new file and write out the prologue. Also, act like a constructor
- * and reset some key variables.
+ * and reset some key variables. If segmenting, `fn` names the first segment
+ * with a "-0000" suffix and the second segment is prepared in the
+ * background right away.
  */
 void
 FileWriter::open(string fn)
 {
+	m_fn = fn;
+	m_segment_samples = 0;
+	if (segmented())
+	{
+		m_segment_samples = segment_length();
+		m_manifest_fn = fn.substr(0, fn.rfind('.')) + "-segments.json";
+		fn = segment_fn(0);
+	}
+	m_direct = m_direct_cfg;
+	if (m_direct && m_segment_samples)
+	{
+		DBG("Direct mode cannot be segmented");
+		throw runtime_error("Direct mode cannot be segmented");
+	}
 	m_file_handle = CreateFileA(
 		fn.c_str(),
 		GENERIC_WRITE,
 		0,
 		NULL,
 		CREATE_ALWAYS,
-		FILE_FLAG_OVERLAPPED,
+		FILE_FLAG_OVERLAPPED | (m_direct ? FILE_FLAG_NO_BUFFERING : 0),
 		NULL);
 	if (m_file_handle == INVALID_HANDLE_VALUE)
 	{
@@ -73,79 +250,292 @@ FileWriter::open(string fn)
 	}
 	m_file_offset = 0;
 	m_total_samples = 0;
+	m_full_samples = 0;
 	m_total_nan = 0;
+	m_gaps.clear();
 	m_total_accumulated = 0;
 	m_acc = 0;
 	m_buffer_pos = 0;
 	m_head = 0;
 	m_tail = 0;
+	m_peak_pages = 0;
+	m_segment_extended = 0;
+	m_byte_pos = 0;
+	m_direct_written = 0;
 	//assert(2'000'000 % m_sample_rate == 0);
 	m_samples_per_downsample = 2'000'000u / m_sample_rate;
 	m_timestamps.clear();
+	m_interpolator.reset();
+	m_trigger.reset(m_sample_rate);
+	m_above = false;
+	m_lap = LapStats();
+	m_lap_open = false;
+	m_segment_stored = 0;
+	m_segment_first = 0;
+	m_segment_index = 0;
+	m_segments.clear();
+	m_retiring.clear();
+	m_checksums.clear();
+	m_checksums.push_back(FileChecksums{ fn });
 	// Write the file header
-	uint8_t bytes[5];
-	union {
-		float f;
-		uint32_t dw;
-	} pun;
-	pun.f = (float)m_sample_rate;
-	bytes[0] = 0xf1; // Version byte TODO: sync with framework
-	CopyMemory(&bytes[1], &pun.dw, sizeof(uint32_t));
-	queue_bytes(&bytes, sizeof(bytes));
-	wait(5000);
+	uint8_t bytes[FILE_HEADER_BYTES];
+	header(bytes);
+	if (m_direct)
+	{
+		// Goes out with the first page
+		CopyMemory(m_pages[0], bytes, sizeof(bytes));
+		m_byte_pos = sizeof(bytes);
+		m_allocated = DIRECT_PREALLOC_BYTES;
+		preallocate(m_file_handle, m_allocated);
+	}
+	else
+	{
+		queue_bytes(&bytes, sizeof(bytes));
+		wait(5000);
+	}
+	if (m_segment_samples)
+	{
+		m_prealloc_exit = false;
+		m_next_handle = NULL;
+		m_next_index = 1;
+		m_prealloc_request = CreateEvent(NULL, FALSE, TRUE, NULL);
+		m_prealloc_ready = CreateEvent(NULL, FALSE, FALSE, NULL);
+		m_prealloc_thread = CreateThread(NULL, 0, prealloc_thread, this, 0, NULL);
+		if (m_prealloc_thread == NULL)
+		{
+			DBG("Failed to create segment thread");
+			throw runtime_error("Failed to create segment thread");
+		}
+	}
 }
 
 /**
- * Write out partial data if any, and close the file.
+ * Write out partial data if any, and close the file. Nothing else may be
+ * calling wait() by now, so we reap the page completions ourselves.
  */
 void
 FileWriter::close(void)
 {
-	// Write partial buffer and set signal to exit on completion w/timeout.
+	if (m_interpolator.enabled())
+	{
+		m_interpolator.flush();
+	}
+	m_trigger.flush();
+	if (m_stream_iv != nullptr)
+	{
+		m_stream_iv->flush();
+	}
+	if (m_stream_energy != nullptr)
+	{
+		m_stream_energy->flush();
+	}
+	drain(5000);
+	if (m_direct)
+	{
+		close_direct();
+		return;
+	}
+	// Write partial buffer and wait for it to land.
 	if (m_buffer_pos)
 	{
+		DWORD written;
 		queue_page(m_head, m_buffer_pos);
-		wait(5000);
+		if (!GetOverlappedResult(m_file_handle, &m_ov[m_head], &written, TRUE))
+		{
+			DBG("Failed to write final page");
+			throw runtime_error("Failed to write final page");
+		}
+		m_segment_stored += m_buffer_pos;
+		m_buffer_pos = 0;
 	}
 	CloseHandle(m_file_handle);
+	if (m_segment_samples)
+	{
+		m_prealloc_exit = true;
+		SetEvent(m_prealloc_request);
+		WaitForSingleObject(m_prealloc_thread, 10000);
+		CloseHandle(m_prealloc_thread);
+		CloseHandle(m_prealloc_request);
+		CloseHandle(m_prealloc_ready);
+		m_prealloc_thread = NULL;
+		// The segment we prepared but never needed
+		if (m_next_handle != NULL && m_next_handle != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(m_next_handle);
+			DeleteFileA(segment_fn(m_next_index).c_str());
+		}
+		m_next_handle = NULL;
+		{
+			lock_guard<mutex> guard(m_segment_lock);
+			for (Retiring& r : m_retiring)
+			{
+				CloseHandle(r.handle);
+			}
+			m_retiring.clear();
+			m_segments.push_back(Segment{ segment_fn(m_segment_index), m_segment_first, m_segment_stored });
+		}
+		write_manifest();
+	}
 }
 
 /**
- * Store the current accumulator in the correct page / offset. If we've filled
- * a page, queue it for a write and move to a new one.
+ * Publish the current accumulator to the live ring and stream server (if
+ * any), then hand it to the NaN interpolator if it is enabled, otherwise
+ * store it directly.
  */
 void
 FileWriter::save_acc(void)
 {
-	unsigned saved_head;
-	unsigned saved_len;
-	m_pages[m_head][m_buffer_pos] = m_acc;
-	if (isnan(m_acc))
+	if (m_live_energy != nullptr)
+	{
+		m_live_energy->put(m_acc);
+	}
+	if (m_stream_energy != nullptr)
+	{
+		m_stream_energy->put(m_acc);
+	}
+	if (m_interpolator.enabled())
+	{
+		m_interpolator.add(m_acc);
+	}
+	else
+	{
+		store(m_acc);
+	}
+}
+
+/**
+ * Where every finished energy sample ends up: straight to the pages, or
+ * through the trigger gate if that is on.
+ */
+void
+FileWriter::store(float e)
+{
+	if (m_trigger.enabled())
+	{
+		m_trigger.add(e);
+	}
+	else
+	{
+		commit(e);
+	}
+}
+
+/**
+ * Store a sample in the correct page / offset. If we've filled a page, queue
+ * it for a write and move to a new one.
+ */
+void
+FileWriter::commit(float e)
+{
+	if (isnan(e))
 	{
 		++m_total_nan;
 	}
+	if (m_direct)
+	{
+		store_direct(e);
+		return;
+	}
+	m_pages[m_head][m_buffer_pos] = e;
 	++m_buffer_pos;
 	if (m_buffer_pos == MAX_PAGE_SIZE)
 	{
-		// Using 'saved' so we can update m_head ASAP before queue_page
-		saved_head = m_head;
-		m_head = (m_head + 1) & 0x7;
-		saved_len = m_buffer_pos;
 		m_buffer_pos = 0;
-		if (m_head == m_tail)
+		next_page();
+	}
+}
+
+/**
+ * Direct mode fills the pages byte-wise. The 5-byte header in page 0 means
+ * samples are not float-aligned in the file, so one sample straddles every
+ * page boundary.
+ */
+void
+FileWriter::store_direct(float e)
+{
+	uint8_t *page = (uint8_t*)m_pages[m_head];
+	if (m_byte_pos + sizeof(float) < PAGE_BYTES)
+	{
+		CopyMemory(page + m_byte_pos, &e, sizeof(float));
+		m_byte_pos += sizeof(float);
+		return;
+	}
+	const uint8_t *src = (const uint8_t*)&e;
+	for (size_t i(0); i < sizeof(float); ++i)
+	{
+		page[m_byte_pos++] = src[i];
+		if (m_byte_pos == PAGE_BYTES)
 		{
-			DBG("Ring-buffer exhausted");
-			throw runtime_error("Ring-buffer exhausted");
+			m_byte_pos = 0;
+			next_page();
+			page = (uint8_t*)m_pages[m_head];
 		}
-		queue_page(saved_head, saved_len);
 	}
 }
 
+/**
+ * The page at m_head is full: queue it and move to the next one. m_head
+ * only moves once the page's OVERLAPPED is reissued; before that,
+ * complete_pages() would see the last lap's completed write in it and
+ * retire the page early.
+ */
+void
+FileWriter::next_page(void)
+{
+	unsigned next = (m_head + 1) & 0x7;
+	if (next == m_tail)
+	{
+		DBG("Ring-buffer exhausted");
+		throw runtime_error("Ring-buffer exhausted");
+	}
+	queue_page(m_head, MAX_PAGE_SIZE);
+	m_head = next;
+	if (pages_in_flight() > m_peak_pages)
+	{
+		m_peak_pages = pages_in_flight();
+	}
+	if (m_segment_samples)
+	{
+		m_segment_stored += MAX_PAGE_SIZE;
+		if (m_segment_stored >= m_segment_samples)
+		{
+			rotate();
+		}
+	}
+}
+
+/**
+ * Every file starts with this.
+ */
+void
+FileWriter::header(uint8_t bytes[FILE_HEADER_BYTES])
+{
+	union {
+		float f;
+		uint32_t dw;
+	} pun;
+	pun.f = (float)m_sample_rate;
+	bytes[0] = 0xf1; // Version byte TODO: sync with framework
+	CopyMemory(&bytes[1], &pun.dw, sizeof(uint32_t));
+}
+
+/**
+ * Record the CRC-32C of a write about to be queued at m_file_offset.
+ */
+void
+FileWriter::checksum(LPCVOID bytes, unsigned len)
+{
+	m_checksums.back().blocks.push_back(Checksum{ m_file_offset, len, crc32c(bytes, len) });
+}
+
 void
 FileWriter::queue_page(unsigned page, unsigned len)
 {
 	ZeroMemory(&m_ov[page], sizeof(OVERLAPPED));
 	m_ov[page].hEvent = m_events[QUEUE_PAGE_EVENT];
+	m_page_handle[page] = m_file_handle;
+	checksum(m_pages[page], len * sizeof(float));
 	m_ov[page].OffsetHigh = (m_file_offset >> 32) & 0xFFFF'FFFF;
 	m_ov[page].Offset = m_file_offset & 0xFFFF'FFFF;
 	if (!WriteFile(
@@ -163,6 +553,7 @@ FileWriter::queue_page(unsigned page, unsigned len)
 		}
 	}
 	m_file_offset += len * sizeof(float);
+	g_timeline.instant("page-queued", "page", page);
 }
 
 void
@@ -170,6 +561,7 @@ FileWriter::queue_bytes(LPCVOID bytes, unsigned len)
 {
 	ZeroMemory(&m_overlapped, sizeof(OVERLAPPED));
 	m_overlapped.hEvent = m_events[QUEUE_BYTES_EVENT];
+	checksum(bytes, len);
 	m_overlapped.OffsetHigh = (m_file_offset >> 32) & 0xFFFF'FFFF;
 	m_overlapped.Offset = m_file_offset & 0xFFFF'FFFF;
 	if (!WriteFile(
@@ -198,8 +590,9 @@ FileWriter::wait(DWORD msec)
 		DWORD event = ret - WAIT_OBJECT_0;
 		switch (event) {
 		case QUEUE_PAGE_EVENT:
-			m_tail = (m_tail + 1) & 0x7;
+			// Reset first: a page that lands after the reset re-signals
 			ResetEvent(m_events[event]);
+			complete_pages();
 			break;
 		case QUEUE_BYTES_EVENT:
 			ResetEvent(m_events[event]);
@@ -216,3 +609,313 @@ FileWriter::wait(DWORD msec)
 		throw runtime_error("Wait failed");
 	}
 }
+
+/**
+ * All pages share one event, so one wake-up can stand for several finished
+ * writes (or none, for a page that is still in flight). Walk the ring from
+ * the tail and retire every page that has actually completed, closing a
+ * rotated-out segment once its last page is done.
+ */
+void
+FileWriter::complete_pages(void)
+{
+	DWORD written;
+	while (m_tail != m_head && HasOverlappedIoCompleted(&m_ov[m_tail]))
+	{
+		if (!GetOverlappedResult(m_page_handle[m_tail], &m_ov[m_tail], &written, FALSE))
+		{
+			DBG("Page write failed");
+			throw runtime_error("Page write failed");
+		}
+		g_timeline.instant("write-completed", "page", m_tail);
+		if (m_segment_samples)
+		{
+			lock_guard<mutex> guard(m_segment_lock);
+			if (!m_retiring.empty() && m_retiring.front().last_page == m_tail)
+			{
+				CloseHandle(m_retiring.front().handle);
+				m_retiring.pop_front();
+			}
+		}
+		if (m_direct)
+		{
+			// Stay well ahead of the writes with the reserved extent
+			m_direct_written += PAGE_BYTES;
+			if (m_direct_written + DIRECT_PREALLOC_BYTES / 2 > m_allocated)
+			{
+				m_allocated += DIRECT_PREALLOC_BYTES;
+				preallocate(m_file_handle, m_allocated);
+			}
+		}
+		m_tail = (m_tail + 1) & 0x7;
+	}
+}
+
+/**
+ * Zero-pad the last page to a whole sector, write it, then reopen the file
+ * through the cache just to set the end of file back to the real length.
+ */
+void
+FileWriter::close_direct(void)
+{
+	uint64_t length = m_file_offset + m_byte_pos;
+	if (m_byte_pos)
+	{
+		unsigned padded = (m_byte_pos + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+		DWORD written;
+		ZeroMemory((uint8_t*)m_pages[m_head] + m_byte_pos, padded - m_byte_pos);
+		queue_page(m_head, padded / sizeof(float));
+		// The padding is trimmed off below, so it is not part of the checksum
+		m_checksums.back().blocks.back().length = m_byte_pos;
+		m_checksums.back().blocks.back().crc = crc32c(m_pages[m_head], m_byte_pos);
+		if (!GetOverlappedResult(m_file_handle, &m_ov[m_head], &written, TRUE))
+		{
+			DBG("Failed to write final page");
+			throw runtime_error("Failed to write final page");
+		}
+		m_byte_pos = 0;
+	}
+	CloseHandle(m_file_handle);
+	m_file_handle = CreateFileA(
+		m_fn.c_str(),
+		GENERIC_WRITE,
+		0,
+		NULL,
+		OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL,
+		NULL);
+	if (m_file_handle == INVALID_HANDLE_VALUE)
+	{
+		DBG("Unable to reopen file to set its length");
+		throw runtime_error("Unable to reopen file to set its length");
+	}
+	FILE_END_OF_FILE_INFO eof;
+	eof.EndOfFile.QuadPart = length;
+	BOOL ok = SetFileInformationByHandle(m_file_handle, FileEndOfFileInfo, &eof, sizeof(eof));
+	CloseHandle(m_file_handle);
+	if (!ok)
+	{
+		DBG("Unable to set file length");
+		throw runtime_error("Unable to set file length");
+	}
+}
+
+/**
+ * Reserve disk space without moving the end of file. Only a hint for the
+ * file system, so a failure is not fatal.
+ */
+void
+FileWriter::preallocate(HANDLE handle, uint64_t bytes)
+{
+	FILE_ALLOCATION_INFO alloc;
+	alloc.AllocationSize.QuadPart = bytes;
+	if (!SetFileInformationByHandle(handle, FileAllocationInfo, &alloc, sizeof(alloc)))
+	{
+		DBG("Unable to preallocate file space");
+	}
+}
+
+/**
+ * Wait until no more than half the ring is in flight.
+ */
+void
+FileWriter::reap(void)
+{
+	ULONGLONG deadline = GetTickCount64() + 5000;
+	complete_pages();
+	while (pages_in_flight() >= MAX_OVERLAPPED_WRITES / 2)
+	{
+		if (GetTickCount64() > deadline)
+		{
+			DBG("Timed out reaping pages");
+			throw runtime_error("Timed out reaping pages");
+		}
+		wait(10);
+		complete_pages();
+	}
+}
+
+/**
+ * Wait for every queued page to land.
+ */
+void
+FileWriter::drain(DWORD msec)
+{
+	ULONGLONG deadline = GetTickCount64() + msec;
+	complete_pages();
+	while (m_tail != m_head)
+	{
+		if (GetTickCount64() > deadline)
+		{
+			DBG("Timed out draining pages");
+			throw runtime_error("Timed out draining pages");
+		}
+		wait(10);
+	}
+}
+
+/**
+ * Called right after the last page of a segment is queued. Switch to the
+ * segment the background thread prepared (normally long done by now) and
+ * ask it for the next one. The old handle stays open until its last page
+ * completes, see complete_pages().
+ *
+ * This never waits on the background thread. If it is still busy, the
+ * current segment simply takes another page and this is tried again; the
+ * manifest has every segment's real length. If it failed, it is idle, and
+ * the segment is created here instead.
+ */
+void
+FileWriter::rotate(void)
+{
+	if (WaitForSingleObject(m_prealloc_ready, 0) != WAIT_OBJECT_0)
+	{
+		// Counted, not printed: this is the sample path
+		++m_segment_extended;
+		return;
+	}
+	if (m_next_handle == INVALID_HANDLE_VALUE)
+	{
+		HANDLE event = CreateEvent(NULL, TRUE, FALSE, NULL);
+		m_next_handle = create_segment(segment_fn(m_next_index), event);
+		CloseHandle(event);
+		if (m_next_handle == INVALID_HANDLE_VALUE)
+		{
+			DBG("Unable to create next segment");
+			throw runtime_error("Unable to create next segment");
+		}
+	}
+	{
+		lock_guard<mutex> guard(m_segment_lock);
+		m_retiring.push_back(Retiring{ m_file_handle, (m_head + MAX_OVERLAPPED_WRITES - 1) & 0x7 });
+		m_segments.push_back(Segment{ segment_fn(m_segment_index), m_segment_first, m_segment_stored });
+	}
+	m_file_handle = m_next_handle;
+	m_next_handle = NULL;
+	m_file_offset = FILE_HEADER_BYTES;
+	m_segment_first += m_segment_stored;
+	m_segment_stored = 0;
+	m_segment_index = m_next_index;
+	m_next_index = m_segment_index + 1;
+	// The helper thread wrote the header, record it as if we had
+	uint8_t bytes[FILE_HEADER_BYTES];
+	header(bytes);
+	m_checksums.push_back(FileChecksums{ segment_fn(m_segment_index) });
+	m_checksums.back().blocks.push_back(Checksum{ 0, FILE_HEADER_BYTES, crc32c(bytes, FILE_HEADER_BYTES) });
+	SetEvent(m_prealloc_request);
+}
+
+string
+FileWriter::segment_fn(unsigned index)
+{
+	char suffix[16];
+	snprintf(suffix, sizeof(suffix), "-%04u", index);
+	size_t dot = m_fn.rfind('.');
+	return m_fn.substr(0, dot) + suffix + m_fn.substr(dot);
+}
+
+/**
+ * The manifest lists the finished segments in order; a segment only appears
+ * once it is complete, so anything listed is safe to read during a trace.
+ */
+void
+FileWriter::write_manifest(void)
+{
+	vector<Segment> segs(segments());
+	fstream file;
+	file.open(m_manifest_fn, ios::out);
+	if (!file.is_open())
+	{
+		DBG("Unable to write segment manifest");
+		return;
+	}
+	file << "{" << endl;
+	file << "\t\"sample_rate\": " << m_sample_rate << "," << endl;
+	file << "\t\"segment_samples\": " << m_segment_samples << "," << endl;
+	file << "\t\"segments\": [" << endl;
+	for (size_t i(0); i < segs.size(); ++i)
+	{
+		size_t slash = segs[i].fn.find_last_of("\\/");
+		file
+			<< "\t\t{ \"file\": \"" << segs[i].fn.substr(slash == string::npos ? 0 : slash + 1)
+			<< "\", \"first_sample\": " << segs[i].first_sample
+			<< ", \"samples\": " << segs[i].samples << " }";
+		if (i < (segs.size() - 1))
+		{
+			file << ",";
+		}
+		file << endl;
+	}
+	file << "\t]" << endl;
+	file << "}" << endl;
+	file.close();
+}
+
+/**
+ * Create a segment file, write its header and reserve its full size, so
+ * the data writes extend a contiguous allocation instead of growing the
+ * file page by page. INVALID_HANDLE_VALUE if any of it fails.
+ */
+HANDLE
+FileWriter::create_segment(string fn, HANDLE event)
+{
+	HANDLE h = CreateFileA(
+		fn.c_str(),
+		GENERIC_WRITE,
+		0,
+		NULL,
+		CREATE_ALWAYS,
+		FILE_FLAG_OVERLAPPED,
+		NULL);
+	if (h == INVALID_HANDLE_VALUE)
+	{
+		return h;
+	}
+	uint8_t bytes[FILE_HEADER_BYTES];
+	header(bytes);
+	OVERLAPPED ov;
+	ZeroMemory(&ov, sizeof(ov));
+	ov.hEvent = event;
+	DWORD written;
+	if ((!WriteFile(h, bytes, sizeof(bytes), NULL, &ov) && GetLastError() != ERROR_IO_PENDING)
+		|| !GetOverlappedResult(h, &ov, &written, TRUE))
+	{
+		CloseHandle(h);
+		return INVALID_HANDLE_VALUE;
+	}
+	preallocate(h, FILE_HEADER_BYTES + (uint64_t)m_segment_samples * sizeof(float));
+	return h;
+}
+
+DWORD WINAPI
+FileWriter::prealloc_thread(LPVOID arg)
+{
+	((FileWriter*)arg)->prealloc_loop();
+	return 0;
+}
+
+/**
+ * Background segment preparation: create_segment() for the next file,
+ * ahead of time. Also refreshes the manifest after each rotation.
+ */
+void
+FileWriter::prealloc_loop(void)
+{
+	HANDLE event = CreateEvent(NULL, TRUE, FALSE, NULL);
+	for (;;)
+	{
+		WaitForSingleObject(m_prealloc_request, INFINITE);
+		if (m_prealloc_exit)
+		{
+			break;
+		}
+		m_next_handle = create_segment(segment_fn(m_next_index), event);
+		SetEvent(m_prealloc_ready);
+		// Every request after the first one follows a rotation
+		if (m_next_index > 1)
+		{
+			write_manifest();
+		}
+	}
+	CloseHandle(event);
+}
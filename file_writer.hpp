@@ -5,11 +5,25 @@
 #include <stdexcept>
 #include <iostream>
 #include <fstream>
+#include <iomanip>
+#include <deque>
+#include <mutex>
+#include "crc32c.hpp"
+#include "nan_interpolator.hpp"
+#include "trigger_capture.hpp"
+#include "live_ring.hpp"
+#include "stream_server.hpp"
+#include "lap_notifier.hpp"
 
 using namespace std;
 
 #define MAX_OVERLAPPED_WRITES 8 // don't change; using mask in save_acc()
 #define MAX_PAGE_SIZE (64 * 1024) // in floats
+#define FULL_SAMPLE_RATE 2e6 // calibrated i/v pairs per second into add()
+#define FILE_HEADER_BYTES 5 // version byte + Float32LE sample rate
+#define PAGE_BYTES (MAX_PAGE_SIZE * sizeof(float))
+#define DIRECT_ALIGN 4096 // covers 512e and 4Kn sectors
+#define DIRECT_PREALLOC_BYTES (64ull * 1024 * 1024)
 
 #define QUEUE_BYTES_EVENT 1
 #define QUEUE_PAGE_EVENT 0
@@ -21,14 +35,25 @@ public:
 	{
 		m_events[0] = CreateEvent(NULL, TRUE, FALSE, NULL);
 		m_events[1] = CreateEvent(NULL, TRUE, FALSE, NULL);
+		m_interpolator.set_writer(this);
+		m_trigger.set_writer(this);
 	}
 	bool m_observe_timestamps = false;
 	size_t m_total_samples = 0;
+	uint64_t m_full_samples = 0; // add() calls, i.e. at 2 MS/s
 	size_t m_total_nan = 0;
 	void add(float i, float v, uint8_t bits);
+	void gap(uint64_t samples, string reason, bool more = false);
 	void open(string fn);
 	void close(void);
 	void wait(DWORD msec);
+	// What wait() waits on, for an event loop that calls wait(0) when one fires
+	DWORD events(HANDLE *out, DWORD max)
+	{
+		DWORD n = (max < 2) ? max : 2;
+		CopyMemory(out, m_events, n * sizeof(HANDLE));
+		return n;
+	}
 	unsigned int samplerate(void)
 	{
 		return m_sample_rate;
@@ -38,6 +63,57 @@ public:
 		m_sample_rate = rate;
 		m_samples_per_downsample = max / m_sample_rate;
 	}
+	/**
+	 * Publish samples to a shared-memory ring as they are produced: either
+	 * every calibrated i/v pair, or every downsampled energy sample. The
+	 * ring never blocks, so this costs the same with or without readers.
+	 */
+	void set_live_ring(LiveRing *ptr)
+	{
+		m_live_iv = nullptr;
+		m_live_energy = nullptr;
+		if (ptr != nullptr)
+		{
+			if (ptr->kind() == LIVE_KIND_IV)
+			{
+				m_live_iv = ptr;
+			}
+			else
+			{
+				m_live_energy = ptr;
+			}
+		}
+	}
+	/**
+	 * Same idea as the live ring, but for remote clients over TCP. The
+	 * server queues whole blocks per client and drops for slow clients
+	 * rather than pushing back on us.
+	 */
+	void set_stream_server(StreamServer *ptr)
+	{
+		m_stream_iv = nullptr;
+		m_stream_energy = nullptr;
+		if (ptr != nullptr)
+		{
+			if (ptr->kind() == STREAM_KIND_IV)
+			{
+				m_stream_iv = ptr;
+			}
+			else
+			{
+				m_stream_energy = ptr;
+			}
+		}
+	}
+	/**
+	 * Where GPI0 edges and laps are reported. They are queued here and
+	 * printed by the notifier's thread; with none, they are only kept in
+	 * m_timestamps.
+	 */
+	void set_lap_notifier(LapNotifier *ptr)
+	{
+		m_laps = ptr;
+	}
 	float nanpct(void)
 	{
 		if (m_total_samples == 0)
@@ -46,8 +122,112 @@ public:
 		}
 		return m_total_nan / m_total_samples * 100.0f;
 	}
+	/**
+	 * Split the energy file into segments of `samples` samples, or of
+	 * `seconds` at the current sample rate (zero for both means one file).
+	 * Either is rounded up to a whole page, so rotation never splits a page
+	 * and every sample lands in exactly one segment.
+	 */
+	void segment(size_t samples, unsigned seconds)
+	{
+		m_segment_samples_cfg = samples;
+		m_segment_seconds_cfg = seconds;
+	}
+	size_t segment_samples(void)
+	{
+		return m_segment_samples_cfg;
+	}
+	unsigned segment_seconds(void)
+	{
+		return m_segment_seconds_cfg;
+	}
+	// The length in samples the next trace will really use, at the current rate
+	size_t segment_length(void)
+	{
+		size_t samples = m_segment_seconds_cfg ?
+			(size_t)m_segment_seconds_cfg * m_sample_rate : m_segment_samples_cfg;
+		return (samples + MAX_PAGE_SIZE - 1) / MAX_PAGE_SIZE * MAX_PAGE_SIZE;
+	}
+	bool segmented(void)
+	{
+		return m_segment_samples_cfg > 0 || m_segment_seconds_cfg > 0;
+	}
+	struct Segment
+	{
+		string   fn;
+		uint64_t first_sample;
+		uint64_t samples;
+	};
+	vector<Segment> segments(void)
+	{
+		lock_guard<mutex> guard(m_segment_lock);
+		return m_segments;
+	}
+	string manifest_fn(void)
+	{
+		return m_manifest_fn;
+	}
+	/**
+	 * Direct mode bypasses the OS file cache (FILE_FLAG_NO_BUFFERING): the
+	 * pages go straight from the ring to the disk, so there is no second
+	 * copy in memory and no lazy write-back burst competing with us later.
+	 * Every write must then be a whole number of sectors at a sector-aligned
+	 * offset, so the header shares page 0 with the first samples and the
+	 * ring is filled byte-wise; the final page is zero-padded and the file
+	 * is trimmed to its true length at close(). Not compatible with
+	 * segmenting.
+	 */
+	void direct(bool on)
+	{
+		m_direct_cfg = on;
+	}
+	bool direct(void)
+	{
+		return m_direct_cfg;
+	}
+	// Pages queued but not yet written, and the most seen since open()
+	unsigned pages_in_flight(void)
+	{
+		return (m_head - m_tail) & 0x7;
+	}
+	unsigned m_peak_pages = 0;
+	// Pages added to a segment because the next one was not ready yet
+	uint64_t m_segment_extended = 0;
+	/**
+	 * CRC-32C of every write, in file order (the header, then each page),
+	 * so a reader can tell exactly which part of a file went bad. One entry
+	 * per file written, more than one when segmenting.
+	 */
+	struct Checksum
+	{
+		uint64_t offset;
+		uint32_t length;
+		uint32_t crc;
+	};
+	struct FileChecksums
+	{
+		string           fn;
+		vector<Checksum> blocks;
+	};
+	vector<FileChecksums> m_checksums;
+	/**
+	 * Outages filled in by gap(): where each starts in the energy file,
+	 * how many energy samples (and full-rate samples) it covers, and why.
+	 */
+	struct Gap
+	{
+		uint64_t first_sample;
+		uint64_t samples;
+		uint64_t full_samples;
+		string   reason;
+	};
+	vector<Gap> m_gaps;
 	vector<float> m_timestamps;
+	NanInterpolator m_interpolator;
+	TriggerCapture m_trigger;
 private:
+	friend class NanInterpolator;
+	friend class TriggerCapture;
 	HANDLE        m_events[2];
 	HANDLE        m_file_handle = NULL;
 	float         m_acc = 0;
@@ -55,16 +235,82 @@ private:
 	size_t        m_samples_per_downsample = 2'000'000 / 1000;
 	unsigned int  m_sample_rate = 1000;
 	OVERLAPPED    m_ov[MAX_OVERLAPPED_WRITES];
+	HANDLE        m_page_handle[MAX_OVERLAPPED_WRITES]; // file each page went to
 	OVERLAPPED    m_overlapped; // For queue_bytes
-	float         m_pages[MAX_OVERLAPPED_WRITES][MAX_PAGE_SIZE];
+	alignas(DIRECT_ALIGN) float m_pages[MAX_OVERLAPPED_WRITES][MAX_PAGE_SIZE];
 	unsigned      m_head = 0;
 	unsigned      m_tail = 0;
 	unsigned      m_buffer_pos = 0;
 	uint64_t      m_file_offset = 0;
 	bool          m_last_gpi0 = false;
+	bool          m_above = false; // power above the trigger threshold
+	// Running totals for the current lap, in full-rate samples
+	struct LapStats
+	{
+		double   energy = 0.0; // sum of i * v
+		double   charge = 0.0; // sum of i
+		double   peak = 0.0;   // W
+		uint64_t samples = 0;
+		uint64_t nan = 0;
+	};
+	LapStats      m_lap;
+	bool          m_lap_open = false;
+	LapNotifier  *m_laps = nullptr;
+	LiveRing     *m_live_iv = nullptr;
+	LiveRing     *m_live_energy = nullptr;
+	StreamServer *m_stream_iv = nullptr;
+	StreamServer *m_stream_energy = nullptr;
+	// Segment rotation; see segment()
+	struct Retiring
+	{
+		HANDLE   handle;
+		unsigned last_page;
+	};
+	size_t          m_segment_samples_cfg = 0;
+	unsigned        m_segment_seconds_cfg = 0;
+	size_t          m_segment_samples = 0; // 0 = not segmenting this trace
+	size_t          m_segment_stored = 0;  // samples in the current segment
+	uint64_t        m_segment_first = 0;   // first sample of the current segment
+	unsigned        m_segment_index = 0;
+	string          m_fn;
+	string          m_manifest_fn;
+	vector<Segment> m_segments;            // completed segments
+	deque<Retiring> m_retiring;            // handles with writes in flight
+	mutex           m_segment_lock;
+	HANDLE          m_prealloc_thread = NULL;
+	HANDLE          m_prealloc_request = NULL;
+	HANDLE          m_prealloc_ready = NULL;
+	HANDLE          m_next_handle = NULL;
+	unsigned        m_next_index = 0;
+	bool            m_prealloc_exit = false;
+	// Direct mode; see direct()
+	bool            m_direct_cfg = false;
+	bool            m_direct = false;      // this trace
+	unsigned        m_byte_pos = 0;        // in m_pages[m_head]
+	uint64_t        m_direct_written = 0;  // bytes known to be on disk
+	uint64_t        m_allocated = 0;
 
+	void accumulate(float i, float v, uint8_t bits);
 	void gpi0_check(bool& last, bool current);
 	void save_acc(void);
+	void store(float e);
+	void commit(float e);
+	void store_direct(float e);
+	void next_page(void);
+	void fill_nan(uint64_t count);
+	void reap(void);
+	void close_direct(void);
+	void preallocate(HANDLE handle, uint64_t bytes);
+	void header(uint8_t bytes[FILE_HEADER_BYTES]);
+	void checksum(LPCVOID bytes, unsigned len);
 	void queue_page(unsigned page, unsigned len);
 	void queue_bytes(LPCVOID bytes, unsigned length);
+	void complete_pages(void);
+	void drain(DWORD msec);
+	void rotate(void);
+	HANDLE create_segment(string fn, HANDLE event);
+	string segment_fn(unsigned index);
+	void write_manifest(void);
+	static DWORD WINAPI prealloc_thread(LPVOID arg);
+	void prealloc_loop(void);
 };
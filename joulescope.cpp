@@ -38,13 +38,104 @@ Joulescope::open(wstring path)
 	else
 	{
 		m_device.open(m_path);
-		update_extio();
-		update_settings();
-		m_calibration = calibration_read_raw();
+		// Queue the whole bring-up before waiting on any of it, so the
+		// requests go out back to back instead of one per round-trip
+		auto extio = m_device.control_transfer_out_future(
+			BMREQUEST_TO_DEVICE,
+			BMREQUEST_VENDOR,
+			(UCHAR)JoulescopeRequest::EXTIO,
+			0,
+			0,
+			extio_packet());
+		auto settings = m_device.control_transfer_out_future(
+			BMREQUEST_TO_DEVICE,
+			BMREQUEST_VENDOR,
+			(UCHAR)JoulescopeRequest::SETTINGS,
+			0,
+			0,
+			settings_packet());
+		// The header and the first chunk tell us whether the cached
+		// calibration still applies
+		auto header = m_device.control_transfer_in_future(
+			BMREQUEST_TO_DEVICE,
+			BMREQUEST_VENDOR,
+			(UCHAR)JoulescopeRequest::CALIBRATION,
+			1, // 1:active, 0:factory
+			0,
+			32); // datafile.HEADER_LENGTH
+		auto first = m_device.control_transfer_in_future(
+			BMREQUEST_TO_DEVICE,
+			BMREQUEST_VENDOR,
+			(UCHAR)JoulescopeRequest::CALIBRATION,
+			1,
+			0,
+			4096);
+		m_device.wait(extio);
+		m_device.wait(settings);
+		CalibrationHeader hdr = calibration_header(m_device.wait(header));
+		vector<UCHAR> first_chunk = m_device.wait(first);
+		uint32_t first_crc = crc32c(first_chunk.data(), first_chunk.size());
+		m_calibration_cached = m_calibration_cache && calibration_cache_load(hdr, first_crc);
+		if (!m_calibration_cached)
+		{
+			m_calibration = calibration_read_raw(hdr, first_chunk);
+			if (m_calibration_cache)
+			{
+				calibration_cache_save(hdr, first_crc);
+			}
+		}
 		m_open = true;
 	}
 }
 
+/**
+ * Bring the same device back after a communication error: find it again
+ * by serial number (its path can change when it re-enumerates), reopen it,
+ * which restores the power and I/O settings from m_state and reloads the
+ * calibration (normally from the cache), then restart streaming if it was
+ * on. `resume` runs just before that, while no data can arrive. Throws if
+ * the device is not back yet; m_state is left as it was so the caller can
+ * simply try again.
+ */
+void
+Joulescope::reopen(function<void(void)> resume)
+{
+	bool streaming = is_tracing();
+	wstring path = m_path;
+	if (m_path != L"fake")
+	{
+		string serial = serial_number();
+		// An empty serial would match any Joulescope
+		path = serial.empty() ? L"" : find_joulescope_by_serial_number(serial);
+		if (path.empty())
+		{
+			throw runtime_error("Joulescope " + serial + " is not connected");
+		}
+	}
+	m_open = false;
+	m_device.close();
+	// Streaming is turned back on below, once the endpoint is ready for it
+	m_state.settings.streaming = JoulescopeState::Streaming::OFF;
+	try
+	{
+		open(path);
+		if (resume)
+		{
+			resume();
+		}
+		if (streaming)
+		{
+			streaming_on(true);
+		}
+	}
+	catch (...)
+	{
+		m_state.settings.streaming = streaming ?
+			JoulescopeState::Streaming::NORMAL : JoulescopeState::Streaming::OFF;
+		throw;
+	}
+}
+
 void
 Joulescope::close(void)
 {
@@ -125,17 +216,36 @@ Joulescope::streaming_on(bool on)
 		}
 		m_state.settings.streaming = JoulescopeState::Streaming::NORMAL;
 		update_settings();
-		UINT transfers_outstanding =    8; // the maximum number of USB transfers issued simultaneously [8]
-		UINT transfer_length       =  256; // the USB transfer length in packets [256]
-		m_device.read_stream_start(
-			STREAMING_ENDPOINT_ID,
-			transfers_outstanding,
-			transfer_length * BULK_IN_LENGTH,
-			m_raw_buffer_ptr
-		);
+		if (m_low_latency)
+		{
+			m_device.read_stream_start(
+				STREAMING_ENDPOINT_ID,
+				USB_LOW_LATENCY_TRANSFERS,
+				USB_LOW_LATENCY_PACKETS * BULK_IN_LENGTH,
+				m_raw_buffer_ptr,
+				false,
+				true
+			);
+		}
+		else
+		{
+			m_device.read_stream_start(
+				STREAMING_ENDPOINT_ID,
+				m_transfers_outstanding,
+				m_transfer_length * BULK_IN_LENGTH,
+				m_raw_buffer_ptr,
+				m_transfer_adaptive
+			);
+		}
 	}
 	else
 	{
+		UINT transfers, block_size;
+		if (m_transfer_adaptive && !m_low_latency && m_device.read_stream_tuning(STREAMING_ENDPOINT_ID, transfers, block_size))
+		{
+			m_transfers_outstanding = transfers;
+			m_transfer_length = block_size / BULK_IN_LENGTH;
+		}
 		m_device.read_stream_stop(STREAMING_ENDPOINT_ID);
 		m_state.settings.streaming = JoulescopeState::Streaming::OFF;
 		update_settings();
@@ -144,6 +254,32 @@ Joulescope::streaming_on(bool on)
 
 void
 Joulescope::update_extio(void)
+{
+	m_device.control_transfer_out_sync(
+		BMREQUEST_TO_DEVICE,
+		BMREQUEST_VENDOR,
+		(UCHAR)JoulescopeRequest::EXTIO,
+		0,
+		0,
+		extio_packet()
+	);
+}
+
+void
+Joulescope::update_settings(void)
+{
+	m_device.control_transfer_out_sync(
+		BMREQUEST_TO_DEVICE,
+		BMREQUEST_VENDOR,
+		(UCHAR)JoulescopeRequest::SETTINGS,
+		0,
+		0,
+		settings_packet()
+	);
+}
+
+vector<UCHAR>
+Joulescope::extio_packet(void)
 {
 	vector<UCHAR> buffer(24);
 
@@ -179,18 +315,11 @@ Joulescope::update_extio(void)
 	buffer[22] = 0x00;
 	buffer[23] = 0x00;
 
-	m_device.control_transfer_out_sync(
-		BMREQUEST_TO_DEVICE,
-		BMREQUEST_VENDOR,
-		(UCHAR)JoulescopeRequest::EXTIO,
-		0,
-		0,
-		buffer
-	);
+	return buffer;
 }
 
-void
-Joulescope::update_settings(void)
+vector<UCHAR>
+Joulescope::settings_packet(void)
 {
 	vector<UCHAR> buffer(16);
 
@@ -214,28 +343,15 @@ Joulescope::update_settings(void)
 	buffer[14] = 0;
 	buffer[15] = 0;
 
-	m_device.control_transfer_out_sync(
-		BMREQUEST_TO_DEVICE,
-		BMREQUEST_VENDOR,
-		(UCHAR)JoulescopeRequest::SETTINGS,
-		0,
-		0,
-		buffer
-	);
+	return buffer;
 }
 
-js_stream_buffer_calibration_s
-Joulescope::calibration_read_raw(void)
+/**
+ * Check the 32B calibration header that starts every calibration read.
+ */
+CalibrationHeader
+Joulescope::calibration_header(const vector<UCHAR>& data)
 {
-	vector<UCHAR> data;
-	data = m_device.control_transfer_in_sync(
-		BMREQUEST_TO_DEVICE,
-		BMREQUEST_VENDOR,
-		(UCHAR)JoulescopeRequest::CALIBRATION,
-		1, // 1:active, 0:factory
-		0,
-		32 // datafile.HEADER_LENGTH
-	);
 	if (data.size() < 32)
 	{
 		throw runtime_error(
@@ -245,10 +361,43 @@ Joulescope::calibration_read_raw(void)
 	CalibrationHeader *hdr = (CalibrationHeader*)data.data();
 	//cout << "Calibration Length : " << hdr->length << endl;
 	//cout << "Version : " << (int)hdr->file_version << endl;
-	// TODO: Check CRC32
 	//cout << "CRC32 : 0x" << hex << hdr->crc32 << dec << endl;
-	uint64_t length = hdr->length;
-	string cal_raw;
+	// Same check as pyjoulescope's datafile: zlib CRC-32 of the first 28B
+	if (crc32(hdr, offsetof(CalibrationHeader, crc32)) != hdr->crc32)
+	{
+		throw runtime_error("Calibration header CRC32 mismatch");
+	}
+	return *hdr;
+}
+
+/**
+ * Read the rest of the calibration after `first`, the chunk that followed
+ * the header. The length is known up front, so every remaining 4 KB chunk
+ * is queued at once and the results are joined in order; the loop only
+ * runs if the device answered short.
+ */
+js_stream_buffer_calibration_s
+Joulescope::calibration_read_raw(const CalibrationHeader& hdr, const vector<UCHAR>& first)
+{
+	vector<UCHAR> data;
+	uint64_t length = hdr.length;
+	string cal_raw(first.begin(), first.end());
+	vector<future<vector<UCHAR>>> chunks;
+	for (uint64_t i(cal_raw.size()); i < length; i += 4096)
+	{
+		chunks.push_back(m_device.control_transfer_in_future(
+			BMREQUEST_TO_DEVICE,
+			BMREQUEST_VENDOR,
+			(UCHAR)JoulescopeRequest::CALIBRATION,
+			1, // 1:active, 0:factory
+			0,
+			4096));
+	}
+	for (auto& chunk : chunks)
+	{
+		data = m_device.wait(chunk);
+		cal_raw.insert(cal_raw.end(), data.begin(), data.end());
+	}
 	while (cal_raw.size() < length) {
 		data = m_device.control_transfer_in_sync(
 			BMREQUEST_TO_DEVICE,
@@ -261,6 +410,8 @@ Joulescope::calibration_read_raw(void)
 		//cout << "Bytes read during JSON scan " << data.size() << endl;
 		cal_raw.insert(cal_raw.end(), data.begin(), data.end());
 	}
+	// Fingerprint of what we parsed, to tell calibrations apart later
+	m_calibration_crc = crc32c(cal_raw.data(), cal_raw.size());
 	//cout << cal_raw << endl;
 	size_t ajs_pos = cal_raw.find("AJS");
 	if (ajs_pos == string::npos)
@@ -304,6 +455,195 @@ Joulescope::calibration_read_raw(void)
 	return cal;
 }
 
+void
+FakeJoulescope::attach(FakeTransport& transport)
+{
+	m_calibration_pos = 0;
+	m_pkt_index = 0;
+	m_samples = 0;
+	transport.on_control([this](const WINUSB_SETUP_PACKET& setup_packet, vector<UCHAR>& data, ULONG& length)
+	{
+		return control(setup_packet, data, length);
+	});
+	transport.on_bulk([this](UCHAR pipe_id, vector<UCHAR>& buffer, ULONG& length)
+	{
+		bulk(pipe_id, buffer, length);
+	});
+}
+
+bool
+FakeJoulescope::control(const WINUSB_SETUP_PACKET& setup_packet, vector<UCHAR>& data, ULONG& length)
+{
+	if (USB_ENDPOINT_DIRECTION_OUT(setup_packet.RequestType))
+	{
+		// SETTINGS, EXTIO, ... : nothing to keep
+		return true;
+	}
+	fill(data.begin(), data.end(), (UCHAR)0);
+	length = setup_packet.Length;
+	switch ((JoulescopeRequest)setup_packet.Request)
+	{
+	case JoulescopeRequest::STATUS:
+	{
+		// Voltage in mV, fixed point with 17 fractional bits, at offset 80
+		uint32_t mv = (uint32_t)((3300ull << 17) / 1000);
+		CopyMemory(data.data() + 80, &mv, sizeof(mv));
+		break;
+	}
+	case JoulescopeRequest::CALIBRATION:
+		if (setup_packet.Length == sizeof(CalibrationHeader))
+		{
+			// Same layout as the device: an AJS tag wrapping the JSON
+			string json =
+				"{\"current\": {\"offset\": [0, 0, 0, 0, 0, 0, 0, 0], "
+				"\"gain\": [5e-07, 5e-06, 5e-05, 5e-04, 5e-03, 5e-02, 5e-01, 5]}, "
+				"\"voltage\": {\"offset\": [0, 0], \"gain\": [0.0004, 0.0008]}}";
+			uint32_t tag_length = (uint32_t)json.size();
+			m_calibration = string("AJS\0", 4) + string((char*)&tag_length, 4) + json;
+			m_calibration_pos = 0;
+			CalibrationHeader hdr = {};
+			CopyMemory(hdr.magic, "\xd3tagfmt \r\n \n  \x1a\x1c", sizeof(hdr.magic));
+			hdr.length = m_calibration.size();
+			hdr.file_version = 1;
+			hdr.crc32 = crc32(&hdr, offsetof(CalibrationHeader, crc32));
+			CopyMemory(data.data(), &hdr, sizeof(hdr));
+		}
+		else
+		{
+			size_t n = min((size_t)setup_packet.Length, m_calibration.size() - m_calibration_pos);
+			CopyMemory(data.data(), m_calibration.data() + m_calibration_pos, n);
+			m_calibration_pos += n;
+		}
+		break;
+	default:
+		break;
+	}
+	return true;
+}
+
+void
+FakeJoulescope::bulk(UCHAR pipe_id, vector<UCHAR>& buffer, ULONG& length)
+{
+	// 2000 counts * 5e-7 = 1 mA, 8250 counts * 0.0004 = 3.3 V
+	const uint32_t i_code = 2000;
+	const uint32_t v_code = 8250;
+	size_t num_pkts = buffer.size() / BULK_IN_LENGTH;
+	JoulescopePacket *pkt = (JoulescopePacket*)buffer.data();
+	for (size_t n(0); n < num_pkts; ++n, ++pkt)
+	{
+		pkt->buffer_type = 1;
+		pkt->status = 0;
+		pkt->length = (uint16_t)BULK_IN_LENGTH;
+		pkt->pkt_index = m_pkt_index++;
+		pkt->usb_frame_index = 0;
+		for (size_t j(0); j < JS110_SAMPLES_PER_PACKET; ++j, ++m_samples)
+		{
+			uint32_t gpi0 = (uint32_t)((m_samples / m_gpi0_samples) & 1);
+			uint32_t toggle = (uint32_t)(m_samples & 1);
+			uint32_t raw_i = ((i_code & ~1u) | gpi0) << 2; // range 0
+			uint32_t raw_v = (v_code << 2) | (toggle << 1);
+			pkt->samples[j] = (raw_v << 16) | raw_i;
+		}
+	}
+	length = (ULONG)(num_pkts * BULK_IN_LENGTH);
+}
+
+/**
+ * The third '#'-separated field of the device path, as is; "fake" for the
+ * simulated device, and empty if the path has no such field.
+ */
+string
+Joulescope::serial_number(void)
+{
+	if (m_path == L"fake")
+	{
+		return "fake";
+	}
+	vector<wstring> tokens;
+	boost::split(tokens, m_path, boost::is_any_of("#"));
+	string serial;
+	for (wchar_t c : (tokens.size() > 2) ? tokens[2] : wstring())
+	{
+		serial += (char)c;
+	}
+	return serial;
+}
+
+filesystem::path
+Joulescope::calibration_cache_path(const CalibrationHeader& hdr)
+{
+	char tmp[MAX_PATH + 1];
+	DWORD n = GetTempPathA(sizeof(tmp), tmp);
+	filesystem::path dir = (n > 0 && n < sizeof(tmp)) ? filesystem::path(tmp) : filesystem::path(".");
+	char name[64];
+	snprintf(name, sizeof(name), "-%08x.bin", hdr.crc32);
+	// Only safe characters in the file name
+	string key;
+	for (char c : serial_number())
+	{
+		key += isalnum((unsigned char)c) ? c : '_';
+	}
+	return dir / "joulescope-win32" / ("calibration-" + key + name);
+}
+
+/**
+ * Use the cached calibration if there is one for this device, this exact
+ * header and this first chunk. Any problem with the file just means a
+ * cache miss.
+ */
+bool
+Joulescope::calibration_cache_load(const CalibrationHeader& hdr, uint32_t first_crc)
+{
+	CalibrationCacheRecord rec;
+	ifstream file(calibration_cache_path(hdr), ios::binary);
+	if (!file.read((char*)&rec, sizeof(rec)))
+	{
+		return false;
+	}
+	if (rec.magic != CALIBRATION_CACHE_MAGIC ||
+		rec.version != CALIBRATION_CACHE_VERSION ||
+		rec.crc != crc32c(&rec, offsetof(CalibrationCacheRecord, crc)) ||
+		memcmp(&rec.header, &hdr, sizeof(hdr)) != 0 ||
+		rec.first_crc != first_crc)
+	{
+		return false;
+	}
+	m_calibration = rec.calibration;
+	m_calibration_crc = rec.raw_crc;
+	return true;
+}
+
+/**
+ * Best effort: write to a temporary name and rename, so a reader never
+ * sees half a record. Failing to save only costs the next init time.
+ */
+void
+Joulescope::calibration_cache_save(const CalibrationHeader& hdr, uint32_t first_crc)
+{
+	CalibrationCacheRecord rec;
+	ZeroMemory(&rec, sizeof(rec));
+	rec.magic = CALIBRATION_CACHE_MAGIC;
+	rec.version = CALIBRATION_CACHE_VERSION;
+	rec.header = hdr;
+	rec.first_crc = first_crc;
+	rec.raw_crc = m_calibration_crc;
+	rec.calibration = m_calibration;
+	rec.crc = crc32c(&rec, offsetof(CalibrationCacheRecord, crc));
+	filesystem::path fn = calibration_cache_path(hdr);
+	filesystem::path tmp = fn;
+	tmp += ".tmp";
+	error_code ec;
+	filesystem::create_directories(fn.parent_path(), ec);
+	{
+		ofstream file(tmp, ios::binary | ios::trunc);
+		if (!file.write((const char*)&rec, sizeof(rec)))
+		{
+			return;
+		}
+	}
+	MoveFileExA(tmp.string().c_str(), fn.string().c_str(), MOVEFILE_REPLACE_EXISTING);
+}
+
 vector<wstring>
 Joulescope::guid_to_paths(GUID* pGuid)
 {
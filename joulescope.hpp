@@ -22,6 +22,10 @@
 #include "raw_buffer.hpp"
 #include "dist/json/json.h"
 #include "joulescope_packet.hpp"
+#include "crc32c.hpp"
+#include "fake_transport.hpp"
+#include <filesystem>
+#include <fstream>
 #include <boost\algorithm\string.hpp>
 #include <boost\lexical_cast.hpp>
 
@@ -60,6 +64,31 @@ struct CalibrationHeader
 };
 
 
+#define CALIBRATION_CACHE_MAGIC   0x4343534au // "JSCC"
+#define CALIBRATION_CACHE_VERSION 2u
+
+/**
+ * What `init` saves per device so the next one can skip the calibration
+ * download: the parsed calibration, keyed by the device's 32-byte
+ * calibration header and the CRC of the first 4 KB of the calibration
+ * itself. The header's own CRC only covers its magic, length and version,
+ * so a recalibration of the same length has the same header; the start of
+ * the content tells the two apart. `crc` covers the whole record so a
+ * damaged file is never used.
+ */
+#pragma pack(push, 1)
+struct CalibrationCacheRecord
+{
+	uint32_t                       magic;
+	uint32_t                       version;
+	CalibrationHeader              header;
+	uint32_t                       first_crc; // CRC-32C of the first chunk read
+	uint32_t                       raw_crc;   // Joulescope::m_calibration_crc
+	js_stream_buffer_calibration_s calibration;
+	uint32_t                       crc;     // CRC-32C of everything above
+};
+#pragma pack(pop)
+
 // Obviously this is an incomplete list of all settings
 // TODO: Fill this out to match the Python driver
 struct JoulescopeState
@@ -110,6 +139,7 @@ class Joulescope
 public:
 	// Initialization
 	void open(std::wstring path);
+	void reopen(std::function<void(void)> resume = nullptr);
 	void close(void);
 	bool is_open(void);
 	bool is_powered(void);
@@ -123,25 +153,47 @@ public:
 	// 2-second stat update voltage, in mV
 	unsigned int get_voltage(void);
 private:
-	js_stream_buffer_calibration_s calibration_read_raw(void);
+	CalibrationHeader calibration_header(const std::vector<UCHAR>& data);
+	js_stream_buffer_calibration_s calibration_read_raw(const CalibrationHeader& hdr, const std::vector<UCHAR>& first);
+	std::filesystem::path calibration_cache_path(const CalibrationHeader& hdr);
+	bool calibration_cache_load(const CalibrationHeader& hdr, uint32_t first_crc);
+	void calibration_cache_save(const CalibrationHeader& hdr, uint32_t first_crc);
 	std::vector<std::wstring> guid_to_paths(GUID* pGuid);
 	/**
-	 * IMPORTANT NOTE: These functions are not thread safe.
-	 *
-	 * Calling an update_* function with streaming on (e.g., an endpoint is
-	 * instantiated and pending) will cause a race condition if there is another
-	 * thread calling the WinUsbDevice::process() function. That's because the
-	 * update_* functions are synchronous and call process() as well, which causes
-	 * a race and invalid memory conditions. Stopping the read stream removes
-	 * the endpoint and all of its pending transactions by calling the WinUsb
-	 * functions to abort the pipe and drain the pending requests. It is a
-	 * synchronous cleanup which needs to happen before calling update_*.
+	 * These (and get_voltage) use the synchronous control transfers, which
+	 * queue the request for whichever thread is running
+	 * WinUsbDevice::process(), so they are safe to call while streaming.
+	 * Two threads must not change m_state at once, though: commands come
+	 * from one thread.
 	 */
 	void update_extio(void);
 	void update_settings(void);
+	std::vector<UCHAR> extio_packet(void);
+	std::vector<UCHAR> settings_packet(void);
 public:
 	WinUsbDevice m_device;
 	js_stream_buffer_calibration_s m_calibration;
+	uint32_t m_calibration_crc = 0; // CRC-32C of the raw calibration read
+	bool m_calibration_cache = true;   // use/refresh the on-disk cache
+	bool m_calibration_cached = false; // the last open() used it
+	// "fake", or the serial number from the device path (empty if none)
+	std::string serial_number(void);
+	/**
+	 * The streaming read queue: how many USB transfers are kept outstanding
+	 * and how many 512-byte packets each carries. With `m_transfer_adaptive`
+	 * these are only the starting point; the endpoint retunes them while
+	 * streaming, and the tuned values are kept for the next trace.
+	 */
+	UINT m_transfers_outstanding = 8;
+	UINT m_transfer_length = 256;
+	bool m_transfer_adaptive = true;
+	/**
+	 * Stream in small reads and process each one as it arrives, so GPI0
+	 * edges are seen within a millisecond or so instead of a read's worth
+	 * of data later. Costs more wakeups per second; the queue above is
+	 * left alone for the next throughput trace.
+	 */
+	bool m_low_latency = false;
 private:
 	JoulescopeState m_state;
 	std::wstring m_path;
@@ -153,3 +205,26 @@ public:
 		m_raw_buffer_ptr = ptr;
 	}
 };
+
+/**
+ * The device side of a JS110, for running with FakeTransport. It answers
+ * the control requests Joulescope::open() makes (with a small, valid
+ * calibration) and streams packets of a steady 1 mA at 3.3 V on range 0.
+ * The sample toggle alternates as on real hardware, so nothing is counted
+ * as a skip, and GPI0 (in the current LSB) flips every `m_gpi0_samples`
+ * to give the lap code something to do. Lost packets come from the
+ * transport's error rate.
+ */
+class FakeJoulescope
+{
+public:
+	void attach(FakeTransport& transport);
+	bool control(const WINUSB_SETUP_PACKET& setup_packet, std::vector<UCHAR>& data, ULONG& length);
+	void bulk(UCHAR pipe_id, std::vector<UCHAR>& buffer, ULONG& length);
+	uint64_t m_gpi0_samples = MAX_SAMPLE_RATE;
+private:
+	std::string m_calibration;
+	size_t      m_calibration_pos = 0;
+	uint16_t    m_pkt_index = 0;
+	uint64_t    m_samples = 0;
+};
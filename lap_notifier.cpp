@@ -0,0 +1,127 @@
+/**
+ * Copyright 2021 Peter Torelli
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "lap_notifier.hpp"
+
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+using namespace std;
+
+/**
+ * Start the notifier thread with empty statistics. Call while nothing is
+ * pushing, i.e. before the trace starts.
+ */
+void
+LapNotifier::start(ostream *out, int priority)
+{
+	stop();
+	m_out = out;
+	m_head = 0;
+	m_tail = 0;
+	m_max_depth = 0;
+	m_dropped = 0;
+	m_latency.reset();
+	m_edge_latency.reset();
+	m_delivered = 0;
+	m_skipped = 0;
+	m_delivered_at = chrono::steady_clock::now();
+	m_exit = false;
+	m_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+	m_thread = CreateThread(NULL, 0, _thread, this, 0, NULL);
+	if (m_thread == NULL)
+	{
+		CloseHandle(m_event);
+		m_event = NULL;
+		throw runtime_error("Failed to create lap notifier thread");
+	}
+	SetThreadPriority(m_thread, priority);
+}
+
+void
+LapNotifier::stop(void)
+{
+	if (m_thread == NULL)
+	{
+		return;
+	}
+	m_exit = true;
+	SetEvent(m_event);
+	WaitForSingleObject(m_thread, 5000);
+	CloseHandle(m_thread);
+	CloseHandle(m_event);
+	m_thread = NULL;
+	m_event = NULL;
+}
+
+DWORD WINAPI
+LapNotifier::_thread(LPVOID arg)
+{
+	((LapNotifier*)arg)->_loop();
+	return 0;
+}
+
+void
+LapNotifier::_loop(void)
+{
+	g_timeline.name_thread("lap-notifier");
+	for (;;)
+	{
+		WaitForSingleObject(m_event, INFINITE);
+		_drain();
+		if (m_exit)
+		{
+			return;
+		}
+	}
+}
+
+/**
+ * Each message is formatted first and written in one piece, so it cannot
+ * be split by a line another thread is printing.
+ */
+void
+LapNotifier::_drain(void)
+{
+	uint32_t tail = m_tail.load(std::memory_order_relaxed);
+	while (tail != m_head.load(std::memory_order_acquire))
+	{
+		const LapEvent& e = m_ring[tail & (LAP_QUEUE_DEPTH - 1)];
+		ostringstream text;
+		text << "m-lap-us-" << (unsigned int)(e.timestamp * 1e6) << "\n";
+		if (e.lap)
+		{
+			text
+				<< "m-lap-energy-j[" << setprecision(9) << e.energy_j
+				<< "]-charge-c[" << e.charge_c
+				<< "]-duration-us[" << setprecision(12) << e.duration_us
+				<< "]-peak-w[" << setprecision(6) << e.peak_w
+				<< "]-nan[" << e.nan
+				<< "]\n";
+		}
+		chrono::steady_clock::time_point queued = e.queued;
+		chrono::steady_clock::time_point sampled = e.sampled;
+		m_tail.store(++tail, std::memory_order_release);
+		{
+			TimelineSpan span("lap-notify");
+			*m_out << text.str() << flush;
+		}
+		chrono::steady_clock::time_point now = chrono::steady_clock::now();
+		m_latency.record(now - queued);
+		m_edge_latency.record(now - sampled);
+	}
+}
@@ -0,0 +1,136 @@
+/**
+ * Copyright 2021 Peter Torelli
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <Windows.h>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <iostream>
+#include "latency_histogram.hpp"
+#include "timeline.hpp"
+
+#define LAP_QUEUE_DEPTH 1024 // power of two
+#define LAP_FULL_RATE   2e6  // samples per second into delivered()
+
+/**
+ * One GPI0 falling edge, and the lap it ended if there was one open.
+ */
+struct LapEvent
+{
+	float    timestamp = 0.0f; // s, at the output sample rate
+	uint64_t full_sample = 0;  // at 2 MS/s, from the start of the trace
+	bool     lap = false;      // the fields below are valid
+	double   energy_j = 0.0;
+	double   charge_c = 0.0;
+	double   duration_us = 0.0;
+	double   peak_w = 0.0;
+	uint64_t nan = 0;
+	std::chrono::steady_clock::time_point queued;
+	std::chrono::steady_clock::time_point sampled; // estimated; see delivered()
+};
+
+/**
+ * Prints laps on a thread of its own, so a burst of GPI0 edges costs the
+ * sample path a copy into a ring and a SetEvent each, instead of a console
+ * write. The ring has a single producer (the event loop, in
+ * FileWriter::add()) and a single consumer (the notifier thread) and takes
+ * no lock; if it ever fills, edges are counted as dropped rather than
+ * waited for. The timestamps file still gets every edge.
+ *
+ * The depth the ring reached, the time each edge waited in it, and the
+ * time from the edge happening to its print are measured for the report
+ * at the end of the trace.
+ */
+class LapNotifier
+{
+public:
+	~LapNotifier()
+	{
+		stop();
+	}
+	void start(std::ostream *out, int priority = THREAD_PRIORITY_NORMAL);
+	// Prints whatever is still queued first
+	void stop(void);
+	/**
+	 * Producer only: the USB data up to full-rate sample `samples` has just
+	 * arrived. The newest sample in it was taken moments ago, so an edge
+	 * found in it is dated by counting back from now; the time it spent
+	 * in the read before the read completed is then part of its latency.
+	 */
+	void delivered(uint64_t samples)
+	{
+		m_delivered = samples + m_skipped;
+		m_delivered_at = std::chrono::steady_clock::now();
+	}
+	/**
+	 * Producer only: `samples` full-rate samples were filled in without
+	 * being delivered (FileWriter::gap()), so the edges' sample numbers
+	 * are that much ahead of what delivered() is told from now on.
+	 */
+	void skipped(uint64_t samples)
+	{
+		m_skipped += samples;
+	}
+	// Producer only
+	void push(const LapEvent& e)
+	{
+		uint32_t head = m_head.load(std::memory_order_relaxed);
+		uint32_t depth = head - m_tail.load(std::memory_order_acquire);
+		if (depth >= LAP_QUEUE_DEPTH)
+		{
+			m_dropped.store(m_dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			return;
+		}
+		LapEvent& slot = m_ring[head & (LAP_QUEUE_DEPTH - 1)];
+		slot = e;
+		slot.queued = std::chrono::steady_clock::now();
+		uint64_t behind = (m_delivered > e.full_sample) ? m_delivered - e.full_sample : 0;
+		slot.sampled = m_delivered_at - std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>((double)behind / LAP_FULL_RATE));
+		m_head.store(head + 1, std::memory_order_release);
+		g_timeline.instant("lap-queued", "depth", depth + 1);
+		if (depth + 1 > m_max_depth.load(std::memory_order_relaxed))
+		{
+			m_max_depth.store(depth + 1, std::memory_order_relaxed);
+		}
+		SetEvent(m_event);
+	}
+	bool running(void)
+	{
+		return m_thread != NULL;
+	}
+	// Queued to printed, and edge to printed; recorded by the notifier thread
+	LatencyHistogram m_latency;
+	LatencyHistogram m_edge_latency;
+	std::atomic<uint32_t> m_max_depth{ 0 };
+	std::atomic<uint64_t> m_dropped{ 0 };
+private:
+	static DWORD WINAPI _thread(LPVOID arg);
+	void _loop(void);
+	void _drain(void);
+	LapEvent              m_ring[LAP_QUEUE_DEPTH];
+	std::atomic<uint32_t> m_head{ 0 }; // written by push()
+	std::atomic<uint32_t> m_tail{ 0 }; // written by the notifier
+	uint64_t              m_delivered = 0;
+	uint64_t              m_skipped = 0;
+	std::chrono::steady_clock::time_point m_delivered_at;
+	std::ostream         *m_out = &std::cout;
+	HANDLE                m_thread = NULL;
+	HANDLE                m_event = NULL;
+	std::atomic<bool>     m_exit{ false };
+};
@@ -0,0 +1,164 @@
+/**
+ * Copyright 2021 Peter Torelli
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <intrin.h>
+
+#define LATENCY_SUB_BITS   4u  // 16 buckets per power of two: within 6.25%
+#define LATENCY_MAGNITUDES 40u // up to 2^40 ns (about 18 minutes)
+#define LATENCY_SUB        (1u << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS    ((LATENCY_MAGNITUDES - LATENCY_SUB_BITS + 1) * LATENCY_SUB)
+
+struct LatencySummary
+{
+	uint64_t count;
+	double   mean_us;
+	double   p50_us;
+	double   p99_us;
+	double   p999_us;
+	double   max_us;
+};
+
+/**
+ * A fixed-size, log-bucketed histogram of durations in nanoseconds, in the
+ * style of HdrHistogram: each power of two is split into 16 linear buckets,
+ * so any percentile read back is within 6.25% of the real value, from 1 ns
+ * up to minutes, in a couple of KB.
+ *
+ * Recording is an index computation and a few relaxed stores, cheap enough
+ * to leave on. There must be a single writer (the event loop); any
+ * thread may call summary() at any time and gets a near-consistent view
+ * without stopping it. reset() should only be called while nothing is
+ * recording.
+ */
+class LatencyHistogram
+{
+public:
+	LatencyHistogram()
+	{
+		reset();
+	}
+	void reset(void)
+	{
+		for (auto& c : m_counts)
+		{
+			c.store(0, std::memory_order_relaxed);
+		}
+		m_count.store(0, std::memory_order_relaxed);
+		m_sum.store(0, std::memory_order_relaxed);
+		m_max.store(0, std::memory_order_relaxed);
+	}
+	void record(uint64_t ns)
+	{
+		bump(m_counts[index(ns)], 1);
+		bump(m_count, 1);
+		bump(m_sum, ns);
+		if (ns > m_max.load(std::memory_order_relaxed))
+		{
+			m_max.store(ns, std::memory_order_relaxed);
+		}
+	}
+	void record(std::chrono::steady_clock::duration d)
+	{
+		int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+		record(ns < 0 ? 0 : (uint64_t)ns);
+	}
+	LatencySummary summary(void) const
+	{
+		LatencySummary s = {};
+		uint32_t counts[LATENCY_BUCKETS];
+		uint64_t total = 0;
+		for (size_t i(0); i < LATENCY_BUCKETS; ++i)
+		{
+			counts[i] = m_counts[i].load(std::memory_order_relaxed);
+			total += counts[i];
+		}
+		s.count = total;
+		if (total == 0)
+		{
+			return s;
+		}
+		double max_ns = (double)m_max.load(std::memory_order_relaxed);
+		s.mean_us = (double)m_sum.load(std::memory_order_relaxed) / (double)m_count.load(std::memory_order_relaxed) / 1e3;
+		s.p50_us = percentile(counts, total, 0.5, max_ns) / 1e3;
+		s.p99_us = percentile(counts, total, 0.99, max_ns) / 1e3;
+		s.p999_us = percentile(counts, total, 0.999, max_ns) / 1e3;
+		s.max_us = max_ns / 1e3;
+		return s;
+	}
+	static size_t index(uint64_t v)
+	{
+		if (v < LATENCY_SUB)
+		{
+			return (size_t)v;
+		}
+		unsigned shift = msb(v) - LATENCY_SUB_BITS;
+		size_t i = (size_t)shift * LATENCY_SUB + (size_t)(v >> shift);
+		return (i < LATENCY_BUCKETS) ? i : LATENCY_BUCKETS - 1;
+	}
+	// The largest value that lands in bucket i
+	static uint64_t highest(size_t i)
+	{
+		if (i < LATENCY_SUB)
+		{
+			return i;
+		}
+		unsigned shift = (unsigned)(i / LATENCY_SUB) - 1;
+		uint64_t low = (uint64_t)(i - (size_t)shift * LATENCY_SUB) << shift;
+		return low + (1ull << shift) - 1;
+	}
+private:
+	template <typename T>
+	static void bump(std::atomic<T>& a, uint64_t n)
+	{
+		// Single writer: a plain load and store, no locked instruction
+		a.store((T)(a.load(std::memory_order_relaxed) + n), std::memory_order_relaxed);
+	}
+	static unsigned msb(uint64_t v)
+	{
+		unsigned long i;
+		if (_BitScanReverse(&i, (unsigned long)(v >> 32)))
+		{
+			return (unsigned)i + 32;
+		}
+		_BitScanReverse(&i, (unsigned long)v);
+		return (unsigned)i;
+	}
+	static double percentile(const uint32_t *counts, uint64_t total, double p, double max_ns)
+	{
+		uint64_t target = (uint64_t)(p * (double)total + 0.5);
+		target = (target < 1) ? 1 : target;
+		uint64_t seen = 0;
+		for (size_t i(0); i < LATENCY_BUCKETS; ++i)
+		{
+			seen += counts[i];
+			if (seen >= target)
+			{
+				double v = (double)highest(i);
+				return (v < max_ns) ? v : max_ns;
+			}
+		}
+		return max_ns;
+	}
+	std::atomic<uint32_t> m_counts[LATENCY_BUCKETS];
+	std::atomic<uint64_t> m_count;
+	std::atomic<uint64_t> m_sum;
+	std::atomic<uint64_t> m_max;
+};
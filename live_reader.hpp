@@ -0,0 +1,157 @@
+/**
+ * Copyright 2021 Peter Torelli
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+/**
+ * Header-only reader for the live ring published by `live on`. Copy this
+ * file, `live_ring.hpp` and `live_ring_index.hpp` into a consumer; nothing
+ * else is needed.
+ *
+ *     LiveReader reader;
+ *     reader.open();                  // LIVE_RING_DEFAULT_NAME
+ *     uint64_t cursor = reader.tail();
+ *     for (;;)
+ *     {
+ *         size_t n;
+ *         const float* p = reader.peek(cursor, n);
+ *         ... use p[0 .. n * info.record_floats) in place ...
+ *         if (!reader.valid(cursor)) { cursor = reader.tail(); continue; }
+ *         cursor += n;
+ *     }
+ *
+ * Reads never block or slow the producer. `valid()` must be called after
+ * the records returned by `peek()` are consumed: if it returns false the
+ * producer lapped the reader while it was looking, and the data is suspect.
+ */
+
+#include "live_ring.hpp"
+#include "live_ring_index.hpp"
+#include <stdexcept>
+
+struct LiveRingInfo
+{
+	uint32_t kind;
+	uint32_t record_floats;
+	uint32_t capacity;
+	float    sample_rate;
+	uint32_t session;
+	uint64_t session_start;
+};
+
+class LiveReader
+{
+public:
+	~LiveReader()
+	{
+		close();
+	}
+	void open(std::string name = LIVE_RING_DEFAULT_NAME)
+	{
+		close();
+		m_mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, name.c_str());
+		if (m_mapping == NULL)
+		{
+			throw std::runtime_error("No live ring named " + name);
+		}
+		m_header = (const LiveRingHeader*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+		if (m_header == nullptr)
+		{
+			close();
+			throw std::runtime_error("Unable to map live ring " + name);
+		}
+		if (m_header->magic != LIVE_RING_MAGIC || m_header->version != LIVE_RING_VERSION)
+		{
+			close();
+			throw std::runtime_error("Live ring " + name + " has an unknown layout");
+		}
+		m_data = (const float*)((const uint8_t*)m_header + LIVE_RING_DATA_OFFSET);
+		info(m_info);
+	}
+	void close(void)
+	{
+		if (m_header != nullptr)
+		{
+			UnmapViewOfFile(m_header);
+			m_header = nullptr;
+		}
+		if (m_mapping != NULL)
+		{
+			CloseHandle(m_mapping);
+			m_mapping = NULL;
+		}
+	}
+	/**
+	 * Take a consistent copy of the header fields (seqlock read side).
+	 */
+	void info(LiveRingInfo& out)
+	{
+		uint32_t s0, s1;
+		do
+		{
+			s0 = m_header->seq.load(std::memory_order_acquire);
+			out.kind = m_header->kind;
+			out.record_floats = m_header->record_floats;
+			out.capacity = m_header->capacity;
+			out.sample_rate = m_header->sample_rate;
+			out.session = m_header->session;
+			out.session_start = m_header->session_start;
+			std::atomic_thread_fence(std::memory_order_acquire);
+			s1 = m_header->seq.load(std::memory_order_relaxed);
+		} while ((s0 & 1) || (s0 != s1));
+		m_info = out;
+	}
+	// One past the newest record.
+	uint64_t head(void)
+	{
+		return m_header->write_count.load(std::memory_order_acquire);
+	}
+	// The oldest record that cannot be in the middle of being overwritten.
+	uint64_t tail(void)
+	{
+		return live_ring_tail(head(), m_info.capacity);
+	}
+	/**
+	 * Return a pointer to the records starting at `cursor`, and how many are
+	 * contiguous in memory (the ring may wrap, so call again for the rest).
+	 * Returns nullptr with n = 0 if nothing new is available.
+	 */
+	const float* peek(uint64_t cursor, size_t& n)
+	{
+		uint64_t h = head();
+		if (cursor >= h)
+		{
+			n = 0;
+			return nullptr;
+		}
+		uint64_t slot = cursor & ((uint64_t)m_info.capacity - 1);
+		uint64_t avail = h - cursor;
+		uint64_t to_end = (uint64_t)m_info.capacity - slot;
+		n = (size_t)(avail < to_end ? avail : to_end);
+		return &m_data[slot * m_info.record_floats];
+	}
+	// True if the record at `cursor` has not been overwritten yet.
+	bool valid(uint64_t cursor)
+	{
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return live_ring_valid(cursor, head(), m_info.capacity);
+	}
+	LiveRingInfo m_info = {};
+private:
+	HANDLE                m_mapping = NULL;
+	const LiveRingHeader *m_header = nullptr;
+	const float          *m_data = nullptr;
+};
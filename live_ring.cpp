@@ -0,0 +1,111 @@
+/**
+ * Copyright 2021 Peter Torelli
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "live_ring.hpp"
+
+#include <stdexcept>
+
+using namespace std;
+
+/**
+ * Create (or re-use) the named section and initialize the header. The
+ * section is a pagefile-backed mapping, so it lives as long as any process
+ * holds a handle to it; readers that outlive us keep their data.
+ */
+void
+LiveRing::open(string name, uint32_t kind, uint32_t capacity)
+{
+	close();
+	if ((capacity == 0) || (capacity & (capacity - 1)))
+	{
+		throw runtime_error("LiveRing capacity must be a power of two");
+	}
+	uint32_t record_floats = (kind == LIVE_KIND_IV) ? 2 : 1;
+	uint64_t bytes = LIVE_RING_DATA_OFFSET + (uint64_t)capacity * record_floats * sizeof(float);
+	m_mapping = CreateFileMappingA(
+		INVALID_HANDLE_VALUE,
+		NULL,
+		PAGE_READWRITE,
+		(DWORD)(bytes >> 32),
+		(DWORD)(bytes & 0xFFFF'FFFF),
+		name.c_str());
+	if (m_mapping == NULL)
+	{
+		throw runtime_error("Unable to create live ring mapping");
+	}
+	void* view = MapViewOfFile(m_mapping, FILE_MAP_ALL_ACCESS, 0, 0, (size_t)bytes);
+	if (view == NULL)
+	{
+		CloseHandle(m_mapping);
+		m_mapping = NULL;
+		throw runtime_error("Unable to map live ring view");
+	}
+	m_header = (LiveRingHeader*)view;
+	m_data = (float*)((uint8_t*)view + LIVE_RING_DATA_OFFSET);
+	m_kind = kind;
+	m_mask = (uint64_t)capacity - 1;
+	m_name = name;
+	// Keep counting from wherever an existing section left off
+	if ((m_header->magic == LIVE_RING_MAGIC) && (m_header->capacity == capacity) && (m_header->kind == kind))
+	{
+		m_count = m_header->write_count.load(memory_order_relaxed);
+	}
+	else
+	{
+		m_count = 0;
+	}
+	m_header->seq.store(m_header->seq.load(memory_order_relaxed) | 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	m_header->magic = LIVE_RING_MAGIC;
+	m_header->version = LIVE_RING_VERSION;
+	m_header->kind = kind;
+	m_header->record_floats = record_floats;
+	m_header->capacity = capacity;
+	m_header->sample_rate = 0.0f;
+	m_header->session_start = m_count;
+	m_header->write_count.store(m_count, memory_order_relaxed);
+	m_header->seq.fetch_add(1, memory_order_release);
+}
+
+void
+LiveRing::close(void)
+{
+	if (m_header != nullptr)
+	{
+		UnmapViewOfFile(m_header);
+		m_header = nullptr;
+		m_data = nullptr;
+	}
+	if (m_mapping != NULL)
+	{
+		CloseHandle(m_mapping);
+		m_mapping = NULL;
+	}
+}
+
+/**
+ * Called at trace start, before the first `put()`, to tell readers that a
+ * new run begins at the current write count.
+ */
+void
+LiveRing::begin(float sample_rate)
+{
+	m_header->seq.fetch_add(1, memory_order_acq_rel);
+	m_header->sample_rate = sample_rate;
+	m_header->session += 1;
+	m_header->session_start = m_count;
+	m_header->seq.fetch_add(1, memory_order_release);
+}
@@ -0,0 +1,115 @@
+/**
+ * Copyright 2021 Peter Torelli
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <Windows.h>
+#include <atomic>
+#include <cinttypes>
+#include <string>
+
+#define LIVE_RING_MAGIC        0x524c534au // "JSLR"
+#define LIVE_RING_VERSION      1u
+#define LIVE_RING_DEFAULT_NAME "Local\\joulescope-win32-live"
+#define LIVE_RING_DATA_OFFSET  64u // records start on their own cache line
+#define LIVE_ENERGY_CAPACITY   (1u << 20) // 4 MB of energy samples
+#define LIVE_IV_CAPACITY       (1u << 22) // 32 MB, ~2 s of i/v at 2 MS/s
+
+#define LIVE_KIND_ENERGY 1u // one float per record: downsampled energy
+#define LIVE_KIND_IV     2u // two floats per record: calibrated i, v at 2 MS/s
+
+/**
+ * Layout of the start of the shared-memory section. Everything a reader
+ * needs to interpret the records is covered by `seq`, a seqlock: the
+ * producer makes it odd, updates the fields, then makes it even again.
+ * Readers retry until they see the same even value before and after
+ * copying the fields.
+ *
+ * `write_count` is the total number of records ever published to this
+ * section. Record n lives at slot (n % capacity). It is stored with release
+ * semantics after the record is written, so a reader that loads it with
+ * acquire semantics can read every record below it. The producer never
+ * waits on readers: a reader that falls `capacity` - 1 records behind
+ * simply loses data (record `write_count` - `capacity` may be half
+ * overwritten already), which it detects by re-reading `write_count` after
+ * it consumes the records; see live_ring_index.hpp.
+ */
+struct LiveRingHeader
+{
+	uint32_t              magic;
+	uint32_t              version;
+	std::atomic<uint32_t> seq;
+	uint32_t              kind;
+	uint32_t              record_floats;
+	uint32_t              capacity;       // in records, a power of two
+	float                 sample_rate;    // records per second
+	uint32_t              session;        // incremented on each trace start
+	uint64_t              session_start;  // write_count when the session began
+	std::atomic<uint64_t> write_count;
+};
+
+static_assert(sizeof(LiveRingHeader) <= LIVE_RING_DATA_OFFSET, "LiveRingHeader overlaps records");
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "seq must be lock-free to be shared");
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "write_count must be lock-free to be shared");
+
+/**
+ * Producer side. Owned by the capture process and written only by the
+ * event loop thread (via the FileWriter), so `put()` is a couple of stores and
+ * never blocks.
+ */
+class LiveRing
+{
+public:
+	~LiveRing()
+	{
+		close();
+	}
+	void open(std::string name, uint32_t kind, uint32_t capacity);
+	void close(void);
+	bool is_open(void)
+	{
+		return m_header != nullptr;
+	}
+	uint32_t kind(void)
+	{
+		return m_kind;
+	}
+	std::string name(void)
+	{
+		return m_name;
+	}
+	void begin(float sample_rate);
+	void put(float a)
+	{
+		m_data[m_count & m_mask] = a;
+		m_header->write_count.store(++m_count, std::memory_order_release);
+	}
+	void put(float a, float b)
+	{
+		float* rec = &m_data[(m_count & m_mask) * 2];
+		rec[0] = a;
+		rec[1] = b;
+		m_header->write_count.store(++m_count, std::memory_order_release);
+	}
+private:
+	HANDLE          m_mapping = NULL;
+	LiveRingHeader *m_header = nullptr;
+	float          *m_data = nullptr;
+	uint64_t        m_count = 0;
+	uint64_t        m_mask = 0;
+	uint32_t        m_kind = 0;
+	std::string     m_name;
+};
@@ -0,0 +1,42 @@
+/**
+ * Copyright 2021 Peter Torelli
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cinttypes>
+
+/**
+ * The live ring's index math, kept free of Windows so it can be tested
+ * anywhere (see tests/live_ring_index_test.cpp).
+ *
+ * LiveRing::put() writes record `head` into its slot before it publishes
+ * write_count = head + 1. So while write_count is `head`, the producer may
+ * be part way through record `head`, whose slot is also record
+ * `head - capacity`'s: only the capacity - 1 records below `head` are
+ * safe to read.
+ */
+inline uint64_t
+live_ring_tail(uint64_t head, uint32_t capacity)
+{
+	return (head >= capacity) ? head - capacity + 1 : 0;
+}
+
+// True if the record at `cursor` is still intact with write_count at `head`
+inline bool
+live_ring_valid(uint64_t cursor, uint64_t head, uint32_t capacity)
+{
+	return cursor + capacity > head;
+}
@@ -31,283 +31,582 @@ using namespace boost;
 
 const string EEMBC_EMON_SUFFIX("-energy.bin");
 const string EEMBC_TIMESTAMP_SUFFIX("-timestamps.json");
+const string REPAIRED_SUFFIX("-repaired.bin");
+const string CRC_SUFFIX("-crc.json");
+const string TRIGGERS_SUFFIX("-triggers.json");
+const string GAPS_SUFFIX("-gaps.json");
 
 float		 g_drop_thresh(0.1f);
+// Reopen the device and keep tracing if the stream dies; see device_reconnect()
+bool         g_reconnect(true);
+unsigned     g_reconnect_timeout(300); // seconds
+bool         g_reconnecting(false);
 
 // These are the primary "legos" that build the tracer.
 Joulescope   g_joulescope;
 RawProcessor g_raw_processor;
 FileWriter   g_file_writer;
+// Prints laps off the sample path
+LapNotifier  g_lap_notifier;
 RawBuffer    g_raw_buffer;
+// Optional shared-memory tap for local live viewers
+LiveRing     g_live_ring;
+// Optional TCP tap for remote viewers
+StreamServer g_stream_server;
+// Stand-in device for `init fake`
+FakeTransport  g_fake_transport;
+FakeJoulescope g_fake_joulescope;
 // Per the EEMBC framework, this is a file convention
 path         g_tmpdir(".");
 path         g_fp_energy(g_tmpdir / string("js110" + EEMBC_EMON_SUFFIX));
 path         g_fp_timestamps(g_tmpdir / string("js110" + EEMBC_TIMESTAMP_SUFFIX));
-// There are three spinning loops in this code:
-bool         g_device_spinning(false); // Device-driver process loop
-bool         g_writer_spinning(false); // Async file write tail-pointer incr.
-bool         g_userin_spinning(false); // Wait on user input.
-HANDLE       g_device_thread(NULL);
-HANDLE       g_writer_thread(NULL);
+path         g_fp_repaired(g_tmpdir / string("js110" + REPAIRED_SUFFIX));
+path         g_fp_crc(g_tmpdir / string("js110" + CRC_SUFFIX));
+path         g_fp_triggers(g_tmpdir / string("js110" + TRIGGERS_SUFFIX));
+path         g_fp_gaps(g_tmpdir / string("js110" + GAPS_SUFFIX));
+/**
+ * Everything but reading stdin runs on one event loop thread: USB and file
+ * write completions, commands (handed over by the stdin thread), and
+ * timers. Only the loop touches the pipeline, so none of this state needs
+ * a lock.
+ */
+EventLoop    g_loop;
+HANDLE       g_loop_thread(NULL);
+// Framed requests and notifications instead of text lines; see `--json`
+Protocol     g_protocol;
+// Every counter, read on the loop; see register_metrics()
+Metrics      g_metrics;
+path         g_metrics_fn;
+unsigned     g_metrics_seconds(0);
+uint64_t     g_metrics_timer(0);
+bool         g_tracing(false);
+// Placement of the loop thread while tracing; see `threads`
+ThreadConfig g_loop_thread_config;
+ThreadTuning g_loop_tuning;
+// Reconnect state; see device_lost()
+bool         g_stream_lost(false);
+uint64_t     g_reconnect_timer(0);
+string       g_lost_why;
+uint64_t     g_lost_filled(0); // full-rate samples of the outage in the file
+chrono::steady_clock::time_point g_lost_at;
 CommandTable g_commands = {
-	make_pair("init",    Command{ cmd_init,    "[serial] Find the first JS110 (or by serial #) and initialize it." }),
+	make_pair("init",    Command{ cmd_init,    "[serial|fake [latency_us] [jitter_us] [error_rate]] Find the first JS110 (or by serial #) and initialize it." }),
 	make_pair("deinit",  Command{ cmd_deinit,  "De-initialize the current JS110." }),
 	make_pair("power",   Command{ cmd_power,   "[on|off] Get/set output power state." }),
 	make_pair("timer",   Command{ cmd_timer,   "[on|off] Get/set timestamping state." }),
 	make_pair("trace",   Command{ cmd_trace,   "[on path prefix|off] Get/set tracing and save files in 'path/prefix' (quote if 'path' uses spaces)." }),
 	make_pair("rate",    Command{ cmd_rate,    "Set the sample rate to an integer multiple of 1e6." }),
 	make_pair("voltage", Command{ cmd_voltage, "Report the internal 2s voltage average in mv." }),
+	make_pair("live",    Command{ cmd_live,    "[off|energy|iv] [name] Get/set publishing samples to a shared-memory ring." }),
+	make_pair("stream",  Command{ cmd_stream,  "[off|on [port] [energy|iv]] Get/set serving samples to TCP clients." }),
+	make_pair("interp",  Command{ cmd_interp,  "[off|N] Get/set inline interpolation of NaN runs up to N samples long." }),
+	make_pair("segment", Command{ cmd_segment, "[off|size N|time S] Get/set splitting the energy file every N samples or S seconds." }),
+	make_pair("direct",  Command{ cmd_direct,  "[on|off] Get/set writing the energy file unbuffered." }),
+	make_pair("bench",   Command{ cmd_bench,   "[write [MB]|pipeline [save file] [compare file] [data file]|headroom [seconds]] Benchmark file writes, each stage of the sample path, or how far past 2 MS/s the whole path keeps up." }),
+	make_pair("trigger", Command{ cmd_trigger, "[off|on pre post [gpi0] [threshold W]] Get/set only saving windows of pre/post seconds around triggers." }),
+	make_pair("snapshot",Command{ cmd_snapshot,"Trigger a capture window now (see 'trigger')." }),
+	make_pair("metrics", Command{ cmd_metrics, "[dump file [seconds]|dump off] Report every counter, or also write them to 'file' in Prometheus text format every 'seconds' (default 10)." }),
+	make_pair("stats",   Command{ cmd_stats,   "[reset] Report USB completion, processing and resubmit latency percentiles." }),
+	make_pair("threads", Command{ cmd_threads, "[core|any] [normal|above|highest|critical] [mmcss] Get/set the core, priority and MMCSS use of the event loop thread while tracing." }),
+	make_pair("timeline",Command{ cmd_timeline,"[on|off|dump file] Get/set recording when each pipeline stage runs, or write what was recorded to 'file' as a Chrome trace." }),
+	make_pair("usb",     Command{ cmd_usb,     "[auto|fixed] [transfers packets] Get/set the USB read queue: transfers outstanding and packets per transfer." }),
+	make_pair("profile", Command{ cmd_profile, "[throughput|latency] Get/set streaming in large batches, or in ~1 ms reads processed as they arrive for prompt lap reports." }),
+	make_pair("reconnect",Command{ cmd_reconnect,"[off|on [timeout]] Get/set reopening the device and resuming the trace after a USB error, for up to 'timeout' seconds." }),
 	make_pair("exit",    Command{ cmd_exit,    "De-initialize (if necessary) and exit." }),
 	make_pair("help",    Command{ cmd_help,    "Print this help." }),
 };
 
+void device_retry(void);
+
 /**
- * This thread handles USB endpoint processing in the driver (1 Hz). The
- * function `process()` waits on an array of events and determines if an
- * endpoint returned data or of an asynchronous control transfer completed.
+ * The stream died under us: an endpoint halted on a USB error and
+ * WinUsbDevice::_abort() tore it down. Start reconnecting with a timer, so
+ * the loop keeps serving commands (and the file writes in flight) between
+ * attempts.
  */
 void
-device_spin(void)
+device_lost(string why)
 {
-	try
+	g_protocol.notify() << "e-[Stream lost (" << why << "), reconnecting]" << endl;
+	g_stream_lost = true;
+	g_reconnecting = true;
+	g_lost_why = why;
+	g_lost_at = chrono::steady_clock::now();
+	g_lost_filled = 0;
+	g_reconnect_timer = g_loop.timer(0, device_retry);
+}
+
+/**
+ * One attempt to reopen the device by serial number and restart streaming;
+ * on failure, try again in a second until `g_reconnect_timeout`. Once it is
+ * back, fill the outage with NaN so the rest of the energy file stays on
+ * time. That happens before streaming restarts, so the gap lands before
+ * the new data and the new stream is not left unserviced while it is
+ * written. If the restart then fails, the next attempt only fills the
+ * time since.
+ */
+static void
+device_resume(void)
+{
+	g_raw_processor.calibration_set(g_joulescope.m_calibration);
+	g_raw_buffer.resync();
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - g_lost_at).count();
+	uint64_t samples = (uint64_t)(seconds * MAX_SAMPLE_RATE);
+	if (samples > g_lost_filled)
 	{
-		while (g_device_spinning == true)
-		{
-			/**
-			 * By default the device is configured for eight outstsanding
-			 * endoint transfers, each with 256 bulk transfers of 
-			 * 512 bytes, or 8*256*512=1MB. The pending overlapped transfers
-			 * are stored in a deque<>. However, the RawBuffer used by the
-			 * device can overflow as these transfers are deposited into it
-			 * by the device `_expire` operation that puts them into the
-			 * RawBuffer via `add_slice`. We need to service this routine
-			 * at the rate of the RawBuffer, which is 16MB. Since the JS110
-			 * can send back 2M samples, or 8MB/sec, we should service this
-			 * at least 2x the theoretical max of the RawBuffer.
-			 */
-			g_joulescope.m_device.process(1000); // milliseconds
-		}
+		g_file_writer.gap(samples - g_lost_filled, g_lost_why, g_lost_filled > 0);
+		g_lost_filled = samples;
 	}
-	catch (runtime_error re)
+}
+
+void
+device_retry(void)
+{
+	g_reconnect_timer = 0;
+	try
 	{
-		cout << "e-[Device thread runtime error: " << re.what() << "]" << endl;
+		g_joulescope.reopen(device_resume);
 	}
-	catch (...)
+	catch (runtime_error re)
 	{
-		cout << "e-[Unknown exception in device thread]" << endl;
+		if ((chrono::steady_clock::now() - g_lost_at) > chrono::seconds(g_reconnect_timeout))
+		{
+			g_reconnecting = false;
+			g_protocol.notify() << "e-[Reconnect failed: " << re.what() << "]" << endl;
+		}
+		else
+		{
+			g_reconnect_timer = g_loop.timer(1000, device_retry);
+		}
+		return;
 	}
+	g_reconnecting = false;
+	g_stream_lost = false;
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - g_lost_at).count();
+	streamsize precision = g_protocol.notify().precision();
+	g_protocol.notify()
+		<< "m-[Reconnected after " << setprecision(3) << seconds
+		<< " s, filled " << g_file_writer.m_gaps.back().samples
+		<< " samples with NaN]" << setprecision(precision) << endl;
 }
 
 /**
- * This thread advances the tail pointer in the file writer ring-buffer. The
- * file writer downsamples raw data sent to it on the `process_signal`
- * endpoint callback (by way of a RawProcessor callback). Every time an entry
- * in the ring buffer fills, it is shipped of to an async WriteFile.
+ * The USB side of the loop: every event the device waits on (its control
+ * pipe, each streaming endpoint, and its post event), serviced with a
+ * zero-timeout process(). A runtime error stops servicing the device until
+ * the next trace, as the old device thread did by exiting.
  */
-void
-writer_spin(void)
+class DeviceSource : public EventSource
 {
-	try
+public:
+	DWORD handles(HANDLE *out, DWORD max)
+	{
+		return (g_joulescope.is_open() && !m_failed) ? g_joulescope.m_device.events(out, max) : 0;
+	}
+	void signaled(void)
 	{
-		while (g_writer_spinning == true)
+		try
+		{
+			g_joulescope.m_device.process(0);
+			if (g_tracing)
+			{
+				g_loop_tuning.sample();
+				if (g_reconnect && !g_stream_lost && !g_joulescope.m_device.is_streaming(STREAMING_ENDPOINT_ID))
+				{
+					device_lost(g_joulescope.m_device.m_abort_msg);
+				}
+			}
+		}
+		catch (runtime_error re)
 		{
-			/**
-			 * This polling rate must exceed the bandwidth of the FileWriter.
-			 * It has 8 pages of 64K floats, or 8*64*1024*4=2MBytes. Since
-			 * the speed at which this drains depends on the downsampling rate
-			 * and the speed of the storage media, we need to process quickly.
-			 * Worst case would be the full 2Msamples per second which would
-			 * be 8MB/sec, so the slowest polling rate is 250msec. Since this
-			 * isn't an RTOS, go aggressive, 10msec.
-			 */
-			g_file_writer.wait(10); // milliseconds
+			g_protocol.notify() << "e-[Device runtime error: " << re.what() << "]" << endl;
+			m_failed = true;
 		}
 	}
-	catch (runtime_error re)
+	bool m_failed = false;
+};
+
+/**
+ * The file side of the loop: retire page writes as they complete. This
+ * used to be a thread polling every 10 ms.
+ */
+class WriterSource : public EventSource
+{
+public:
+	DWORD handles(HANDLE *out, DWORD max)
 	{
-		cout << "e-[Writer thread runtime error: " << re.what() << "]" << endl;
+		return (g_tracing && !m_failed) ? g_file_writer.events(out, max) : 0;
 	}
-	catch (...)
+	void signaled(void)
+	{
+		try
+		{
+			g_file_writer.wait(0);
+		}
+		catch (runtime_error re)
+		{
+			g_protocol.notify() << "e-[Writer runtime error: " << re.what() << "]" << endl;
+			m_failed = true;
+		}
+	}
+	bool m_failed = false;
+};
+
+DeviceSource g_device_source;
+WriterSource g_writer_source;
+
+DWORD WINAPI
+loop_spin(LPVOID arg)
+{
+	for (;;)
 	{
-		cout << "e-[Unknown exception in writer thread]" << endl;
+		try
+		{
+			g_loop.run();
+			return 0;
+		}
+		catch (runtime_error re)
+		{
+			g_protocol.notify() << "e-[Event loop runtime error: " << re.what() << "]" << endl;
+		}
+		catch (...)
+		{
+			g_protocol.notify() << "e-[Unknown exception in event loop]" << endl;
+		}
 	}
 }
 
+/**
+ * Runs on the loop thread (as a command), so the device and writer are
+ * serviced by this thread from here on and the thread settings apply to it.
+ */
 void
 trace_start(void)
 {
 	g_raw_buffer.reset();
+	g_lap_notifier.start(&g_protocol.notify(),
+		g_joulescope.m_low_latency ? THREAD_PRIORITY_HIGHEST : THREAD_PRIORITY_NORMAL);
 	g_file_writer.open(g_fp_energy.string());
-	g_writer_spinning = true;
-	g_writer_thread = CreateThread(
-		NULL,
-		0,
-		(LPTHREAD_START_ROUTINE)writer_spin,
-		NULL,
-		0,
-		NULL);
-	if (g_writer_thread == NULL)
-	{
-		DBG("Failed to create writer thread");
-		throw runtime_error("Failed to create writer thread");
-	}
-	/**
-	 * NOTE:
-	 * We cannot call `streaming_on` after the device loop starts
-	 * because it calls into `process()` which is not re-entrant.
-	 * This can cause the deques to unexpectedly go to zero or
-	 * samples to be lost or worse.
-	 */
+	if (g_live_ring.is_open())
+	{
+		g_live_ring.begin(g_live_ring.kind() == LIVE_KIND_IV ?
+			(float)MAX_SAMPLE_RATE : (float)g_file_writer.samplerate());
+	}
+	if (g_stream_server.is_running())
+	{
+		g_stream_server.begin(g_stream_server.kind() == STREAM_KIND_IV ?
+			(float)MAX_SAMPLE_RATE : (float)g_file_writer.samplerate());
+	}
+	g_device_source.m_failed = false;
+	g_writer_source.m_failed = false;
+	g_stream_lost = false;
+	g_loop_tuning.begin("loop", g_loop_thread_config);
 	g_joulescope.streaming_on(true);
-	g_device_spinning = true;
-	g_device_thread = CreateThread(
-		NULL,
-		0,
-		(LPTHREAD_START_ROUTINE)device_spin,
-		NULL,
-		0,
-		NULL);
-	if (g_device_thread == NULL)
-	{
-		DBG("Failed to create device thread");
-		throw runtime_error("Failed to create device thread");
-	}
-}
-
-// WORK IN PROGRESS
-void
-interpolate_nans(void)
-{
-	// Need a C++ way to do this
-	FILE *fi = NULL;
-	FILE *fo = NULL;
-	errno_t err;
-	err = fopen_s(&fi, g_fp_energy.filename().string().c_str(), "rb");
-	if (err) throw runtime_error("Failed to open input file in nan flow");
-	err = fopen_s(&fo, g_fp_energy.filename().string().c_str(), "rb");
-	if (err) throw runtime_error("Failed to open output file in nan flow");
-	if (fi && fo)
-	{
-		float buf[1024];
-		float last_good_val = NAN;
-		float y0 = NAN, y1 = NAN, dy, inc;
-		size_t t0 = 0, t1 = 0, dt;
-		bool tracking = false;
-		size_t sample_idx = 0;
-		cout << "Removing tasty NaNs\n";
-		fseek(fi, 5, 0);
-		fseek(fo, 5, 0);
-		while (!feof(fi)) {
-			size_t numread = fread(buf, sizeof(float), 1024, fi);
-			cout << "Read " << numread << endl;
-			for (size_t i = 0; i < numread; ++i)
-			{
-				if (isnan(buf[i]))
-				{
-					if (!tracking)
-					{
-						y0 = last_good_val;
-						t0 = sample_idx;
-						tracking = true;
-					}
-				}
-				else
-				{
-					if (tracking)
-					{
-						tracking = false;
-						y1 = buf[i];
-						t1 = sample_idx;
-						if (isnan(y0))
-						{
-							throw runtime_error("Cannot interpolate if y0 is NAN");
-						}
-						dt = t1 - t0;
-						dy = t1 - y0;
-						inc = dt / dy;
-						if (dt == 0)
-						{
-							throw runtime_error("Cannot interpolate if dt is zero");
-						}
-					}
-					else
-					{
-						last_good_val = buf[i];
-					}
-				}
-				++sample_idx;
-			}
+	g_tracing = true;
+}
+
+/**
+ * Where each window in a triggered energy file came from. Sample numbers
+ * count from the start of the trace; `file_sample` is where the window
+ * starts in the energy file; `retriggers` counts threshold crossings that
+ * only extended a window. Returns the CRC-32C of what was written.
+ */
+uint32_t
+write_triggers(void)
+{
+	static const map<uint32_t, string> names = {
+		{ TRIGGER_GPI0, "gpi0" },
+		{ TRIGGER_THRESHOLD, "threshold" },
+		{ TRIGGER_SNAPSHOT, "snapshot" },
+	};
+	const vector<TriggerCapture::Window>& windows = g_file_writer.m_trigger.m_windows;
+	ostringstream text;
+	text << "{" << endl;
+	text << "\t\"sample_rate\": " << g_file_writer.samplerate() << "," << endl;
+	text << "\t\"pre_samples\": " << g_file_writer.m_trigger.m_pre << "," << endl;
+	text << "\t\"post_samples\": " << g_file_writer.m_trigger.m_post << "," << endl;
+	text << "\t\"windows\": [" << endl;
+	for (size_t i(0); i < windows.size(); ++i)
+	{
+		text
+			<< "\t\t{ \"first_sample\": " << windows[i].first_sample
+			<< ", \"samples\": " << windows[i].samples
+			<< ", \"file_sample\": " << windows[i].file_sample
+			<< ", \"retriggers\": " << windows[i].retriggers
+			<< ", \"triggers\": [";
+		for (size_t j(0); j < windows[i].triggers.size(); ++j)
+		{
+			text
+				<< (j ? ", " : "")
+				<< "[" << windows[i].triggers[j].sample
+				<< ", \"" << names.at(windows[i].triggers[j].source) << "\"]";
 		}
-		if (tracking)
+		text << "] }" << ((i < (windows.size() - 1)) ? "," : "") << endl;
+	}
+	text << "\t]" << endl;
+	text << "}" << endl;
+	fstream file;
+	file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+	file.open(g_fp_triggers, ios::out | ios::binary);
+	file << text.str();
+	file.close();
+	return crc32c(text.str().data(), text.str().size());
+}
+
+/**
+ * Every outage filled in after a reconnect. `first_sample` and `samples`
+ * are in energy-file samples; `full_samples` is the 2 MS/s count. Returns
+ * the CRC-32C of what was written.
+ */
+uint32_t
+write_gaps(void)
+{
+	const vector<FileWriter::Gap>& gaps = g_file_writer.m_gaps;
+	ostringstream text;
+	text << "{" << endl;
+	text << "\t\"sample_rate\": " << g_file_writer.samplerate() << "," << endl;
+	text << "\t\"gaps\": [" << endl;
+	for (size_t i(0); i < gaps.size(); ++i)
+	{
+		string reason(gaps[i].reason);
+		replace(reason.begin(), reason.end(), '"', '\'');
+		text
+			<< "\t\t{ \"first_sample\": " << gaps[i].first_sample
+			<< ", \"samples\": " << gaps[i].samples
+			<< ", \"full_samples\": " << gaps[i].full_samples
+			<< ", \"reason\": \"" << reason << "\" }"
+			<< ((i < (gaps.size() - 1)) ? "," : "") << endl;
+	}
+	text << "\t]" << endl;
+	text << "}" << endl;
+	fstream file;
+	file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+	file.open(g_fp_gaps, ios::out | ios::binary);
+	file << text.str();
+	file.close();
+	return crc32c(text.str().data(), text.str().size());
+}
+
+/**
+ * The checksum sidecar: CRC-32C per write for each energy file, and per
+ * file for the small ones written here.
+ */
+void
+write_checksums(vector<pair<path, uint32_t>> others)
+{
+	fstream file;
+	file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+	file.open(g_fp_crc, ios::out);
+	file << "{" << endl;
+	file << "\t\"algorithm\": \"crc32c\"," << endl;
+	file << "\t\"energy\": [" << endl;
+	for (size_t i(0); i < g_file_writer.m_checksums.size(); ++i)
+	{
+		const FileWriter::FileChecksums& fc = g_file_writer.m_checksums[i];
+		file << "\t\t{ \"file\": \"" << path(fc.fn).filename().string() << "\", \"blocks\": [" << endl;
+		for (size_t j(0); j < fc.blocks.size(); ++j)
 		{
-			throw runtime_error("Cannot interpolate when file ends with NAN");
+			file
+				<< "\t\t\t[" << fc.blocks[j].offset
+				<< ", " << fc.blocks[j].length
+				<< ", " << fc.blocks[j].crc << "]";
+			file << ((j < (fc.blocks.size() - 1)) ? "," : "") << endl;
 		}
+		file << "\t\t] }" << ((i < (g_file_writer.m_checksums.size() - 1)) ? "," : "") << endl;
 	}
-	if (fi)
+	file << "\t]," << endl;
+	file << "\t\"files\": [" << endl;
+	for (size_t i(0); i < others.size(); ++i)
 	{
-		fclose(fi);
+		file
+			<< "\t\t{ \"file\": \"" << others[i].first.filename().string()
+			<< "\", \"crc\": " << others[i].second << " }";
+		file << ((i < (others.size() - 1)) ? "," : "") << endl;
 	}
-	if (fo)
+	file << "\t]" << endl;
+	file << "}" << endl;
+	file.close();
+}
+
+/**
+ * Where the loop thread actually ran during the trace that just ended.
+ */
+static void
+print_thread(const ThreadTuning& tuning)
+{
+	streamsize precision = cout.precision();
+	cout
+		<< "m-thread-" << tuning.m_name
+		<< "-cores[" << tuning.cores()
+		<< "]-switches[" << tuning.m_context_switches
+		<< "]-kernel-s[" << setprecision(4) << tuning.m_kernel_s
+		<< "]-user-s[" << tuning.m_user_s
+		<< "]-mmcss[" << (tuning.m_mmcss ? "on" : "off")
+		<< "]" << setprecision(precision) << endl;
+	if (!tuning.m_error.empty())
 	{
-		fclose(fo);
+		cout << "e-[Could not set the " << tuning.m_name << " thread " << tuning.m_error << "]" << endl;
 	}
 }
 
+/**
+ * How deep the lap queue got, how long edges waited in it to be printed,
+ * and how long from each edge happening to its print.
+ */
+static void
+print_laps(const LapNotifier& laps)
+{
+	LatencySummary s = laps.m_latency.summary();
+	LatencySummary edge = laps.m_edge_latency.summary();
+	streamsize precision = cout.precision();
+	cout
+		<< "m-lap-queue-n[" << s.count
+		<< "]-max-depth[" << laps.m_max_depth
+		<< "]-dropped[" << laps.m_dropped
+		<< "]-mean-us[" << setprecision(4) << s.mean_us
+		<< "]-p99-us[" << s.p99_us
+		<< "]-max-us[" << s.max_us
+		<< "]" << endl;
+	cout
+		<< "m-lap-edge-n[" << edge.count
+		<< "]-mean-us[" << edge.mean_us
+		<< "]-p50-us[" << edge.p50_us
+		<< "]-p99-us[" << edge.p99_us
+		<< "]-max-us[" << edge.max_us
+		<< "]" << setprecision(precision) << endl;
+}
+
 void
 trace_stop(void)
 {
-	DWORD rv;
-	g_device_spinning = false;
-	rv = WaitForSingleObject(g_device_thread, 10000);
-	if (rv != WAIT_OBJECT_0)
-	{
-		DBG("Device thread failed to exit");
-		throw runtime_error("Device thread failed to exit");
-	}
-	g_writer_spinning = false;
-	rv = WaitForSingleObject(g_writer_thread, 10000);
-	if (rv != WAIT_OBJECT_0)
-	{
-		DBG("Writer thread failed to exit");
-		throw runtime_error("Writer thread failed to exit");
-	}
-	/**
-	 * NOTE:
-	 * We cannot call `streaming_off` before the device loop stops
-	 * because it calls into `process()` which is not re-entrant.
-	 * This can cause the deques to unexpectedly go to zero or
-	 * samples to be lost or worse.
-	 */
-	g_joulescope.streaming_on(false);
+	g_tracing = false;
+	if (g_reconnect_timer != 0)
+	{
+		g_loop.cancel(g_reconnect_timer);
+		g_reconnect_timer = 0;
+	}
+	g_reconnecting = false;
+	// Not open if the trace ended with a reconnect that failed
+	if (g_joulescope.is_open())
+	{
+		g_joulescope.streaming_on(false);
+	}
+	g_loop_tuning.end();
 	g_file_writer.close();
+	// After close(): flushing the interpolator can still find an edge
+	g_lap_notifier.stop();
 	// Required by the framework
-	cout
-		<< "m-regfile-fn["
-		<< g_fp_energy.filename().string()
-		<< "]-type[emon]-name[js110]"
-		<< endl;
+	if (g_file_writer.segmented())
+	{
+		for (const FileWriter::Segment& seg : g_file_writer.segments())
+		{
+			cout
+				<< "m-regfile-fn["
+				<< path(seg.fn).filename().string()
+				<< "]-type[emon]-name[js110]"
+				<< endl;
+		}
+		cout
+			<< "m-regfile-fn["
+			<< path(g_file_writer.manifest_fn()).filename().string()
+			<< "]-type[segments]-name[js110]"
+			<< endl;
+		if (g_file_writer.m_segment_extended > 0)
+		{
+			cout
+				<< "m-[Extended segments by " << g_file_writer.m_segment_extended
+				<< " page(s) while the next one was not ready]"
+				<< endl;
+		}
+	}
+	else
+	{
+		cout
+			<< "m-regfile-fn["
+			<< g_fp_energy.filename().string()
+			<< "]-type[emon]-name[js110]"
+			<< endl;
+	}
 	// Always write out a timestamp file, even if empty
-	fstream file;
-	file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-	file.open(g_fp_timestamps, ios::out);
-	file << "[" << endl;
+	vector<pair<path, uint32_t>> crcs;
+	ostringstream text;
+	text << "[" << endl;
 	for (size_t i(0); i < g_file_writer.m_timestamps.size(); ++i)
 	{
-		file << "\t" << g_file_writer.m_timestamps[i];
+		text << "\t" << g_file_writer.m_timestamps[i];
 		if (i < (g_file_writer.m_timestamps.size() - 1))
 		{
-			file << ",";
+			text << ",";
 		}
-		file << endl;
+		text << endl;
 	}
-	file << "]" << endl;
+	text << "]" << endl;
+	// Binary, so the CRC matches the bytes on disk
+	fstream file;
+	file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+	file.open(g_fp_timestamps, ios::out | ios::binary);
+	file << text.str();
 	file.close();
+	crcs.push_back(make_pair(g_fp_timestamps, crc32c(text.str().data(), text.str().size())));
 	// Required by the framework
 	cout
 		<< "m-regfile-fn["
 		<< g_fp_timestamps.filename().string()
 		<< "]-type[etime]-name[js110]"
 		<< endl;
+	// The repair bitmap only exists if interpolation was on
+	if (g_file_writer.m_interpolator.enabled())
+	{
+		file.open(g_fp_repaired, ios::out | ios::binary);
+		uint32_t crc = g_file_writer.m_interpolator.write_bitmap(file);
+		file.close();
+		crcs.push_back(make_pair(g_fp_repaired, crc));
+		cout
+			<< "m-regfile-fn["
+			<< g_fp_repaired.filename().string()
+			<< "]-type[nanmap]-name[js110]"
+			<< endl;
+		cout
+			<< "m-[Interpolated "
+			<< g_file_writer.m_interpolator.m_total_repaired
+			<< " NaN samples]"
+			<< endl;
+	}
+	if (g_file_writer.m_trigger.enabled())
+	{
+		crcs.push_back(make_pair(g_fp_triggers, write_triggers()));
+		cout
+			<< "m-regfile-fn["
+			<< g_fp_triggers.filename().string()
+			<< "]-type[triggers]-name[js110]"
+			<< endl;
+		cout
+			<< "m-[Captured "
+			<< g_file_writer.m_trigger.m_windows.size()
+			<< " trigger windows]"
+			<< endl;
+	}
+	// Only written if the trace survived a reconnect
+	if (!g_file_writer.m_gaps.empty())
+	{
+		crcs.push_back(make_pair(g_fp_gaps, write_gaps()));
+		cout
+			<< "m-regfile-fn["
+			<< g_fp_gaps.filename().string()
+			<< "]-type[gaps]-name[js110]"
+			<< endl;
+		cout
+			<< "m-[Reconnected "
+			<< g_file_writer.m_gaps.size()
+			<< " times]"
+			<< endl;
+	}
+	write_checksums(crcs);
+	cout
+		<< "m-regfile-fn["
+		<< g_fp_crc.filename().string()
+		<< "]-type[crc]-name[js110]"
+		<< endl;
 	// Did we drop any packets?
 	double pct = 0.0;
 	if (g_raw_buffer.m_total_pkts > 0)
@@ -328,6 +627,12 @@ trace_stop(void)
 			<< setprecision(5) << g_drop_thresh
 			<< "% of packets]" << endl;
 	}
+	cmd_usb(vector<string>());
+	print_thread(g_loop_tuning);
+	if (g_file_writer.m_observe_timestamps)
+	{
+		print_laps(g_lap_notifier);
+	}
 }
 
 void
@@ -345,6 +650,7 @@ cmd_exit(vector<string> tokens)
 	cmd_deinit(vector<string>());
 	// Per EEMBC, required to let the host know the exit was OK
 	cout << "m-exit" << endl;
+	g_protocol.finish();
 	exit(0);
 }
 
@@ -357,7 +663,33 @@ cmd_init(vector<string> tokens)
 		return;
 	}
 	string serial = tokens.size() < 2 ? "" : tokens[1];
-	wstring path = g_joulescope.find_joulescope_by_serial_number(serial);
+	wstring path;
+	if (serial == "fake")
+	{
+		FakeTransportConfig config;
+		try
+		{
+			if (tokens.size() > 2) config.latency_us = stoul(tokens[2]);
+			if (tokens.size() > 3) config.jitter_us = stoul(tokens[3]);
+			if (tokens.size() > 4) config.error_rate = stod(tokens[4]);
+		}
+		catch (...)
+		{
+			cout << "e-['init fake' takes integer latency and jitter in us and an error rate]" << endl;
+			return;
+		}
+		g_fake_transport.config(config);
+		g_fake_joulescope.attach(g_fake_transport);
+		g_joulescope.m_device.transport(&g_fake_transport);
+		path = L"fake";
+		// The remaining tokens are not a drop threshold here
+		tokens.resize(2);
+	}
+	else
+	{
+		g_joulescope.m_device.transport(nullptr);
+		path = g_joulescope.find_joulescope_by_serial_number(serial);
+	}
 	if (path.empty())
 	{
 		if (tokens.size() < 2)
@@ -379,7 +711,9 @@ cmd_init(vector<string> tokens)
 		g_raw_processor.calibration_set(g_joulescope.m_calibration);
 		g_raw_processor.set_writer(&g_file_writer);
 		g_file_writer.samplerate(1000, MAX_SAMPLE_RATE);
-		wcout << "m-[Opened Joulescope at path " << path << "]" << endl;
+		cout << "m-[Opened Joulescope at path " << std::filesystem::path(path).string() << "]" << endl;
+		cout << "m-[Calibration CRC32C 0x" << hex << g_joulescope.m_calibration_crc << dec
+			<< (g_joulescope.m_calibration_cached ? ", from cache" : "") << "]" << endl;
 	}
 	if (tokens.size() > 2) {
 		g_drop_thresh = stof(tokens[2]);
@@ -391,14 +725,13 @@ cmd_power(vector<string> tokens)
 {
 	if (tokens.size() > 1)
 	{
-		if (g_device_spinning)
+		if (g_joulescope.is_open() == false)
 		{
-			// `power_on` is not thread safe, see notes in trace_start/stop.
-			cout << "e-[Cannot change power state while tracing]" << endl;
+			cout << "e-[No Joulescopes are open]" << endl;
 		}
-		else if (g_joulescope.is_open() == false)
+		else if (g_reconnecting)
 		{
-			cout << "e-[No Joulescopes are open]" << endl;
+			cout << "e-[The Joulescope is reconnecting]" << endl;
 		}
 		else if (tokens[1] == "on")
 		{
@@ -426,7 +759,7 @@ cmd_trace(vector<string> tokens) {
 		}
 		else if (tokens[1] == "on")
 		{
-			if (!g_device_spinning)
+			if (!g_tracing)
 			{
 				if (tokens.size() > 2)
 				{
@@ -436,6 +769,10 @@ cmd_trace(vector<string> tokens) {
 				{
 					g_fp_energy = g_tmpdir / (tokens[3] + EEMBC_EMON_SUFFIX);
 					g_fp_timestamps = g_tmpdir / (tokens[3] + EEMBC_TIMESTAMP_SUFFIX);
+					g_fp_repaired = g_tmpdir / (tokens[3] + REPAIRED_SUFFIX);
+					g_fp_crc = g_tmpdir / (tokens[3] + CRC_SUFFIX);
+					g_fp_triggers = g_tmpdir / (tokens[3] + TRIGGERS_SUFFIX);
+					g_fp_gaps = g_tmpdir / (tokens[3] + GAPS_SUFFIX);
 				}
 				// Always print this on trace start so we detect any cheating.
 				cout << "m-dropthresh[" << std::setprecision(3) << g_drop_thresh << "]" << endl;
@@ -444,7 +781,7 @@ cmd_trace(vector<string> tokens) {
 		}
 		else if (tokens[1] == "off")
 		{
-			if (g_device_spinning)
+			if (g_tracing)
 			{
 				trace_stop();
 			}
@@ -454,7 +791,7 @@ cmd_trace(vector<string> tokens) {
 			cout << "e-['trace' takes 'on' or 'off' (and optional tmpdir and file prefix]" << endl;
 		}
 	}
-	cout << "m-trace[" << (g_device_spinning ? "on" : "off") << "]" << endl;
+	cout << "m-trace[" << (g_tracing ? "on" : "off") << "]" << endl;
 }
 
 void
@@ -482,7 +819,7 @@ cmd_timer(vector<string> tokens)
 void
 cmd_rate(vector<string> tokens)
 {
-	if (g_device_spinning)
+	if (g_tracing)
 	{
 		// This would screw up all of the memory pointers
 		cout << "e-[Cannot change sample rate while tracing]" << endl;
@@ -506,89 +843,1069 @@ cmd_rate(vector<string> tokens)
 void
 cmd_voltage(vector<string> tokens)
 {
-	if (g_device_spinning)
+	if (g_joulescope.is_open() == false)
 	{
-		// `get_voltage` is not thread safe, see notes in trace_start/stop.
-		cout << "e-[Cannot poll voltage while tracing]" << endl;
+		cout << "e-[No Joulescopes are open]" << endl;
+	}
+	else if (g_reconnecting)
+	{
+		cout << "e-[The Joulescope is reconnecting]" << endl;
 	}
 	else
 	{
+		// Safe mid-trace: the loop services the device while we wait
 		cout << "m-voltage-mv[" << g_joulescope.get_voltage() << "]" << endl;
 	}
 }
 
 void
-cmd_deinit(vector<string> tokens)
+cmd_interp(vector<string> tokens)
 {
-	if (g_device_spinning)
+	if (tokens.size() > 1)
 	{
-		trace_stop();
+		if (g_tracing)
+		{
+			// The interpolator holds samples back, don't pull it out from under a trace
+			cout << "e-[Cannot change interpolation while tracing]" << endl;
+		}
+		else if (tokens[1] == "off")
+		{
+			g_file_writer.m_interpolator.max_run(0);
+		}
+		else
+		{
+			int n;
+			try
+			{
+				n = stoi(tokens[1]);
+			}
+			catch (...)
+			{
+				n = 0;
+			}
+			if ((n < 1) || (n > NAN_RUN_MAX))
+			{
+				cout << "e-['interp' takes 'off' or a run length from 1 to " << NAN_RUN_MAX << "]" << endl;
+			}
+			else
+			{
+				g_file_writer.m_interpolator.max_run(n);
+			}
+		}
 	}
-	if (g_joulescope.is_open())
+	if (g_file_writer.m_interpolator.enabled())
 	{
-		g_joulescope.close();
+		cout << "m-interp[" << g_file_writer.m_interpolator.max_run() << "]" << endl;
+	}
+	else
+	{
+		cout << "m-interp[off]" << endl;
 	}
 }
 
 void
-sigint_handler(int _signal)
+cmd_live(vector<string> tokens)
 {
-	static bool cleanup_done(false);
-	cout << "e-[Caught signal #" << _signal << "]" << endl;
-	// In case of multiple signals (do I need a mutex?)
-	if (!cleanup_done)
+	if (tokens.size() > 1)
+	{
+		if (g_tracing)
+		{
+			// The trace is publishing to it
+			cout << "e-[Cannot change live publishing while tracing]" << endl;
+		}
+		else if (tokens[1] == "off")
+		{
+			g_file_writer.set_live_ring(nullptr);
+			g_live_ring.close();
+		}
+		else if (tokens[1] == "energy" || tokens[1] == "iv")
+		{
+			string name = tokens.size() > 2 ? tokens[2] : LIVE_RING_DEFAULT_NAME;
+			g_file_writer.set_live_ring(nullptr);
+			if (tokens[1] == "iv")
+			{
+				g_live_ring.open(name, LIVE_KIND_IV, LIVE_IV_CAPACITY);
+			}
+			else
+			{
+				g_live_ring.open(name, LIVE_KIND_ENERGY, LIVE_ENERGY_CAPACITY);
+			}
+			g_file_writer.set_live_ring(&g_live_ring);
+		}
+		else
+		{
+			cout << "e-['live' takes 'off', 'energy' or 'iv' (and optional mapping name)]" << endl;
+		}
+	}
+	if (g_live_ring.is_open())
+	{
+		cout
+			<< "m-live["
+			<< (g_live_ring.kind() == LIVE_KIND_IV ? "iv" : "energy")
+			<< "]-name[" << g_live_ring.name() << "]"
+			<< endl;
+	}
+	else
 	{
-		cleanup_done = true;
-		g_userin_spinning = false;
-		cmd_exit(vector<string>());
+		cout << "m-live[off]" << endl;
 	}
 }
 
-int
-main(int argc, char* argv[])
+void
+cmd_segment(vector<string> tokens)
 {
-	string line;
-
-	setvbuf(stdout, NULL, _IONBF, 0);
-	setvbuf(stderr, NULL, _IONBF, 0);
-
-	signal(SIGINT, sigint_handler);
-	signal(SIGTERM, sigint_handler);
-	signal(SIGBREAK, sigint_handler);
-
-	cout << "Joulescope(R) JS110 Win32 Driver" << endl;
-	cout << "Version : " << VERSION << endl;
-	cout << "Head    : " << PYJOULESCOPE_GITHUB_HEAD << endl;
-	
-	g_userin_spinning = true;
-	try {
-		vector<string> tokens;
-		while (g_userin_spinning)
+	if (tokens.size() > 1)
+	{
+		// Anything that is not a number falls through to the usage line
+		long long value = 0;
+		try
 		{
-			tokens.clear();
-			getline(cin, line);
-			// CTRL-C causes a fail that needs clearing before calling again
-			if (cin.fail() || cin.eof())
-			{
-				cin.clear();
-				continue;
-			}
-			trim(line);
-			tokenizer_t tok(line, delim_t("", " ", "\""));
-			for (tokenizer_t::iterator itr = tok.begin(); itr != tok.end(); ++itr) {
-				tokens.push_back(*itr);
-			}
-			if (!tokens.empty() && !tokens[0].empty())
-			{
-				CommandTable::iterator itr = g_commands.find(tokens[0]);
-				if (itr == g_commands.end())
-				{
-					cout << "e-[Unknown command: " << line << "]" << endl;
+			value = tokens.size() > 2 ? stoll(tokens[2]) : 0;
+		}
+		catch (...)
+		{
+			value = 0;
+		}
+		if (g_tracing)
+		{
+			cout << "e-[Cannot change segmenting while tracing]" << endl;
+		}
+		else if (tokens[1] == "off")
+		{
+			g_file_writer.segment(0, 0);
+		}
+		else if (tokens[1] != "off" && g_file_writer.direct())
+		{
+			cout << "e-[Cannot segment in direct mode]" << endl;
+		}
+		else if (tokens[1] == "size" && value > 0 && value < MAX_PAGE_SIZE)
+		{
+			cout << "e-[Segments must be at least one page, " << MAX_PAGE_SIZE << " samples]" << endl;
+		}
+		else if (tokens[1] == "size" && value > 0)
+		{
+			g_file_writer.segment((size_t)value, 0);
+		}
+		else if (tokens[1] == "time" && value > 0 && value <= UINT_MAX)
+		{
+			g_file_writer.segment(0, (unsigned)value);
+		}
+		else
+		{
+			cout << "e-['segment' takes 'off', 'size <samples>' or 'time <seconds>']" << endl;
+		}
+	}
+	cout << "m-segment[";
+	if (!g_file_writer.segmented())
+	{
+		cout << "off";
+	}
+	else if (g_file_writer.segment_seconds())
+	{
+		cout << "time-" << g_file_writer.segment_seconds();
+	}
+	else
+	{
+		cout << "size-" << g_file_writer.segment_samples();
+	}
+	cout << "]";
+	if (g_file_writer.segmented())
+	{
+		// Rounded up to whole pages at the current rate
+		size_t samples = g_file_writer.segment_length();
+		cout << "-samples[" << samples << "]-seconds[" << (double)samples / g_file_writer.samplerate() << "]";
+	}
+	cout << endl;
+}
+
+void
+cmd_direct(vector<string> tokens)
+{
+	if (tokens.size() > 1)
+	{
+		if (g_tracing)
+		{
+			cout << "e-[Cannot change direct mode while tracing]" << endl;
+		}
+		else if (tokens[1] == "on")
+		{
+			if (g_file_writer.segmented())
+			{
+				cout << "e-[Cannot use direct mode while segmenting]" << endl;
+			}
+			else
+			{
+				g_file_writer.direct(true);
+			}
+		}
+		else if (tokens[1] == "off")
+		{
+			g_file_writer.direct(false);
+		}
+		else
+		{
+			cout << "e-['direct' takes 'on' or 'off']" << endl;
+		}
+	}
+	cout << "m-direct[" << (g_file_writer.direct() ? "on" : "off") << "]" << endl;
+}
+
+/**
+ * Applies from the next trace, so throughput runs keep their batching.
+ */
+void
+cmd_profile(vector<string> tokens)
+{
+	if (tokens.size() > 1)
+	{
+		if (g_tracing)
+		{
+			cout << "e-[Cannot change the streaming profile while tracing]" << endl;
+			return;
+		}
+		if (tokens[1] == "latency")
+		{
+			g_joulescope.m_low_latency = true;
+		}
+		else if (tokens[1] == "throughput")
+		{
+			g_joulescope.m_low_latency = false;
+		}
+		else
+		{
+			cout << "e-['profile' takes 'throughput' or 'latency']" << endl;
+			return;
+		}
+	}
+	cout << "m-profile[" << (g_joulescope.m_low_latency ? "latency" : "throughput") << "]" << endl;
+}
+
+void
+cmd_reconnect(vector<string> tokens)
+{
+	if (tokens.size() > 1)
+	{
+		if (tokens[1] == "on")
+		{
+			if (tokens.size() > 2)
+			{
+				try
+				{
+					g_reconnect_timeout = stoul(tokens[2]);
+				}
+				catch (...)
+				{
+					cout << "e-['reconnect on' takes a timeout in seconds]" << endl;
+					return;
+				}
+			}
+			g_reconnect = true;
+		}
+		else if (tokens[1] == "off")
+		{
+			g_reconnect = false;
+		}
+		else
+		{
+			cout << "e-['reconnect' takes 'on' or 'off']" << endl;
+			return;
+		}
+	}
+	cout
+		<< "m-reconnect[" << (g_reconnect ? "on" : "off")
+		<< "]-timeout-s[" << g_reconnect_timeout << "]" << endl;
+}
+
+static void
+print_latency(const char *name, const LatencyHistogram& histogram)
+{
+	LatencySummary s = histogram.summary();
+	streamsize precision = cout.precision();
+	cout
+		<< "m-stats-" << name
+		<< "-n[" << s.count
+		<< "]-mean-us[" << setprecision(4) << s.mean_us
+		<< "]-p50-us[" << s.p50_us
+		<< "]-p99-us[" << s.p99_us
+		<< "]-p999-us[" << s.p999_us
+		<< "]-max-us[" << s.max_us
+		<< "]" << setprecision(precision) << endl;
+}
+
+/**
+ * Everything `metrics` reports. The readers run on the loop thread, like
+ * the pipeline that owns the fields.
+ */
+static void
+register_metrics(void)
+{
+	DeviceStats& stats = g_joulescope.m_device.m_stats;
+	g_metrics.counter("js110_raw_packets_total", "USB packets received this trace",
+		[]() { return (double)g_raw_buffer.m_total_pkts; });
+	g_metrics.counter("js110_raw_dropped_packets_total", "USB packets missing from the index sequence this trace",
+		[]() { return (double)g_raw_buffer.m_total_dropped_pkts; });
+	g_metrics.counter("js110_processor_skips_total", "Runs of missing or out-of-sync samples",
+		[]() { return (double)g_raw_processor.skip_count; });
+	g_metrics.counter("js110_processor_missing_samples_total", "Samples marked missing by the device",
+		[]() { return (double)g_raw_processor.sample_missing_count; });
+	g_metrics.counter("js110_energy_samples_total", "Energy samples produced this trace",
+		[]() { return (double)g_file_writer.m_total_samples; });
+	g_metrics.counter("js110_energy_nan_total", "Energy samples that are NaN this trace",
+		[]() { return (double)g_file_writer.m_total_nan; });
+	g_metrics.counter("js110_reconnects_total", "Outages recovered by reconnecting this trace",
+		[]() { return (double)g_file_writer.m_gaps.size(); });
+	g_metrics.counter("js110_lap_dropped_total", "GPI0 edges lost to a full lap queue this trace",
+		[]() { return (double)g_lap_notifier.m_dropped; });
+	g_metrics.counter("js110_segment_extended_pages_total", "Pages added to a segment because the next was not ready this trace",
+		[]() { return (double)g_file_writer.m_segment_extended; });
+	g_metrics.gauge("js110_tracing", "1 while a trace is running",
+		[]() { return g_tracing ? 1.0 : 0.0; });
+	g_metrics.gauge("js110_reconnecting", "1 while the stream is lost and being reopened",
+		[]() { return g_reconnecting ? 1.0 : 0.0; });
+	g_metrics.gauge("js110_usb_reads_per_pass_max", "Most USB reads found finished in one pass",
+		[&stats]() { return (double)stats.expire_max; });
+	g_metrics.gauge("js110_write_pages_in_flight", "Energy file pages being written now",
+		[]() { return (double)g_file_writer.pages_in_flight(); });
+	g_metrics.gauge("js110_write_pages_peak", "Most energy file pages in flight at once this trace",
+		[]() { return (double)g_file_writer.m_peak_pages; });
+	g_metrics.gauge("js110_lap_queue_depth_max", "Most GPI0 edges waiting to be printed at once this trace",
+		[]() { return (double)g_lap_notifier.m_max_depth; });
+	g_metrics.histogram("js110_usb_completion_interval_seconds", "Time between finished USB reads", &stats.completion_interval);
+	g_metrics.histogram("js110_usb_add_data_seconds", "RawBuffer::add_data() per read", &stats.add_data);
+	g_metrics.histogram("js110_usb_process_data_seconds", "RawBuffer::process_data() per pass", &stats.process_data);
+	g_metrics.histogram("js110_usb_resubmit_delay_seconds", "Finished USB read seen to re-issued", &stats.resubmit_delay);
+	g_metrics.histogram("js110_lap_queue_seconds", "GPI0 edge queued to printed", &g_lap_notifier.m_latency);
+	g_metrics.histogram("js110_lap_edge_seconds", "GPI0 edge happening to printed", &g_lap_notifier.m_edge_latency);
+}
+
+/**
+ * A loop timer: write the file whole and then rename it over the old one,
+ * so a collector never reads half of it.
+ */
+static void
+metrics_dump(void)
+{
+	g_metrics_timer = g_loop.timer(g_metrics_seconds * 1000, metrics_dump);
+	path tmp = g_metrics_fn;
+	tmp += ".tmp";
+	{
+		ofstream file(tmp, ios::binary | ios::trunc);
+		if (!(file << Metrics::prometheus(g_metrics.snapshot())))
+		{
+			return;
+		}
+	}
+	MoveFileExA(tmp.string().c_str(), g_metrics_fn.string().c_str(), MOVEFILE_REPLACE_EXISTING);
+}
+
+void
+cmd_metrics(vector<string> tokens)
+{
+	if (tokens.size() > 1)
+	{
+		if (tokens[1] != "dump" || tokens.size() < 3)
+		{
+			cout << "e-['metrics' takes 'dump <file> [seconds]' or 'dump off']" << endl;
+			return;
+		}
+		unsigned seconds = 10;
+		if (tokens[2] != "off")
+		{
+			try
+			{
+				seconds = tokens.size() > 3 ? stoul(tokens[3]) : seconds;
+			}
+			catch (...)
+			{
+				seconds = 0;
+			}
+			if (seconds == 0)
+			{
+				cout << "e-['metrics dump' takes a whole number of seconds]" << endl;
+				return;
+			}
+		}
+		if (g_metrics_timer != 0)
+		{
+			g_loop.cancel(g_metrics_timer);
+			g_metrics_timer = 0;
+		}
+		g_metrics_seconds = 0;
+		if (tokens[2] != "off")
+		{
+			g_metrics_fn = tokens[2];
+			g_metrics_seconds = seconds;
+			metrics_dump();
+		}
+	}
+	streamsize precision = cout.precision();
+	for (auto& s : g_metrics.snapshot())
+	{
+		cout << "m-metric-" << s.name;
+		if (s.type == MetricType::HISTOGRAM)
+		{
+			cout
+				<< "-n[" << s.summary.count
+				<< "]-p50-us[" << setprecision(4) << s.summary.p50_us
+				<< "]-p99-us[" << s.summary.p99_us
+				<< "]-p999-us[" << s.summary.p999_us
+				<< "]" << setprecision(precision) << endl;
+		}
+		else
+		{
+			cout << "[" << setprecision(15) << s.value << "]" << setprecision(precision) << endl;
+		}
+	}
+	if (g_metrics_seconds > 0)
+	{
+		cout << "m-metrics-dump[" << g_metrics_fn.string() << "]-seconds[" << g_metrics_seconds << "]" << endl;
+	}
+	else
+	{
+		cout << "m-metrics-dump[off]" << endl;
+	}
+}
+
+void
+cmd_stats(vector<string> tokens)
+{
+	DeviceStats& stats = g_joulescope.m_device.m_stats;
+	if (tokens.size() > 1)
+	{
+		if (tokens[1] != "reset")
+		{
+			cout << "e-['stats' takes 'reset' or nothing]" << endl;
+			return;
+		}
+		if (g_tracing)
+		{
+			cout << "e-[Cannot reset stats while tracing]" << endl;
+			return;
+		}
+		stats.reset();
+	}
+	print_latency("completion-interval", stats.completion_interval);
+	print_latency("add-data", stats.add_data);
+	print_latency("process-data", stats.process_data);
+	print_latency("resubmit-delay", stats.resubmit_delay);
+}
+
+void
+cmd_usb(vector<string> tokens)
+{
+	if (tokens.size() > 1)
+	{
+		if (g_tracing)
+		{
+			cout << "e-[Cannot change the USB read queue while tracing]" << endl;
+			return;
+		}
+		size_t next = 1;
+		if (tokens[1] == "auto" || tokens[1] == "fixed")
+		{
+			g_joulescope.m_transfer_adaptive = (tokens[1] == "auto");
+			++next;
+		}
+		if (tokens.size() > next)
+		{
+			UINT transfers, packets;
+			try
+			{
+				transfers = stoul(tokens[next]);
+				packets = tokens.size() > next + 1 ? stoul(tokens[next + 1]) : g_joulescope.m_transfer_length;
+			}
+			catch (...)
+			{
+				cout << "e-['usb' takes [auto|fixed] [transfers packets]]" << endl;
+				return;
+			}
+			if (transfers < USB_TRANSFERS_MIN || transfers > USB_TRANSFERS_MAX ||
+				packets < USB_PACKETS_MIN || packets > USB_PACKETS_MAX ||
+				transfers * packets > USB_QUEUED_PACKETS_MAX)
+			{
+				cout
+					<< "e-[USB transfers must be " << USB_TRANSFERS_MIN << "-" << USB_TRANSFERS_MAX
+					<< ", packets " << USB_PACKETS_MIN << "-" << USB_PACKETS_MAX
+					<< ", and their product at most " << USB_QUEUED_PACKETS_MAX << "]" << endl;
+				return;
+			}
+			g_joulescope.m_transfers_outstanding = transfers;
+			g_joulescope.m_transfer_length = packets;
+		}
+	}
+	cout
+		<< "m-usb-" << (g_joulescope.m_transfer_adaptive ? "auto" : "fixed")
+		<< "-transfers[" << g_joulescope.m_transfers_outstanding
+		<< "]-packets[" << g_joulescope.m_transfer_length
+		<< "]" << endl;
+}
+
+static const map<string, int> g_thread_priorities = {
+	{ "normal",   THREAD_PRIORITY_NORMAL },
+	{ "above",    THREAD_PRIORITY_ABOVE_NORMAL },
+	{ "highest",  THREAD_PRIORITY_HIGHEST },
+	{ "critical", THREAD_PRIORITY_TIME_CRITICAL },
+};
+
+static void
+print_thread_config(const ThreadConfig& config)
+{
+	string priority("normal");
+	for (auto& p : g_thread_priorities)
+	{
+		if (p.second == config.priority)
+		{
+			priority = p.first;
+		}
+	}
+	cout
+		<< "m-threads-loop-core[" << (config.core < 0 ? string("any") : to_string(config.core))
+		<< "]-priority[" << priority
+		<< "]-mmcss[" << (config.mmcss ? "on" : "off")
+		<< "]" << endl;
+}
+
+/**
+ * The event loop thread does the USB reads, all of the sample processing
+ * and the file write completions. Settings apply from the next trace, and
+ * the thread goes back to normal when the trace stops.
+ */
+void
+cmd_threads(vector<string> tokens)
+{
+	if (tokens.size() > 1)
+	{
+		if (g_tracing)
+		{
+			cout << "e-[Cannot change thread settings while tracing]" << endl;
+			return;
+		}
+		ThreadConfig next;
+		for (size_t i(1); i < tokens.size(); ++i)
+		{
+			if (tokens[i] == "any")
+			{
+				next.core = -1;
+			}
+			else if (tokens[i] == "mmcss")
+			{
+				next.mmcss = true;
+			}
+			else if (g_thread_priorities.count(tokens[i]))
+			{
+				next.priority = g_thread_priorities.at(tokens[i]);
+			}
+			else
+			{
+				try
+				{
+					next.core = stoi(tokens[i]);
 				}
-				else
+				catch (...)
 				{
-					itr->second.func(tokens);
+					next.core = 64;
 				}
+				if (next.core < 0 || next.core >= 64)
+				{
+					cout << "e-[Unknown thread setting '" << tokens[i] << "']" << endl;
+					return;
+				}
+			}
+		}
+		g_loop_thread_config = next;
+	}
+	print_thread_config(g_loop_thread_config);
+}
+
+/**
+ * Turning it on starts a fresh timeline; a dump can be taken at any time,
+ * also while tracing, and leaves it recording.
+ */
+void
+cmd_timeline(vector<string> tokens)
+{
+	if (tokens.size() > 1)
+	{
+		if (tokens[1] == "on" || tokens[1] == "off")
+		{
+			g_timeline.enable(tokens[1] == "on");
+		}
+		else if (tokens[1] == "dump" && tokens.size() > 2)
+		{
+			ofstream file(tokens[2], ios::binary | ios::trunc);
+			uint64_t events = g_timeline.write(file);
+			if (!file)
+			{
+				cout << "e-[Failed to write timeline to '" << tokens[2] << "']" << endl;
+				return;
+			}
+			cout << "m-timeline-dump[" << tokens[2] << "]-events[" << events << "]" << endl;
+		}
+		else
+		{
+			cout << "e-['timeline' takes 'on', 'off' or 'dump <file>']" << endl;
+			return;
+		}
+	}
+	cout << "m-timeline[" << (g_timeline.enabled() ? "on" : "off") << "]" << endl;
+}
+
+void
+cmd_bench(vector<string> tokens)
+{
+	if (g_tracing)
+	{
+		cout << "e-[Cannot benchmark while tracing]" << endl;
+		return;
+	}
+	string which = tokens.size() > 1 ? tokens[1] : "write";
+	if (which == "write")
+	{
+		uint64_t mb = tokens.size() > 2 ? stoull(tokens[2]) : 1024;
+		path fn = g_tmpdir / "js110-bench.bin";
+		for (bool direct : { false, true })
+		{
+			WriteBenchResult r = bench_write(fn.string(), mb * 1024 * 1024, direct);
+			cout
+				<< "m-bench-write[" << (direct ? "direct" : "buffered")
+				<< "]-mbps[" << fixed << setprecision(1) << r.mbps
+				<< "]-stall-ms[" << r.stall_ms
+				<< "]-peak-pages[" << r.peak_pages << "/" << MAX_OVERLAPPED_WRITES
+				<< "]" << defaultfloat << endl;
+		}
+	}
+	else if (which == "pipeline")
+	{
+		string save, compare, data;
+		for (size_t i(2); i + 1 < tokens.size(); i += 2)
+		{
+			if (tokens[i] == "save")
+			{
+				save = tokens[i + 1];
+			}
+			else if (tokens[i] == "compare")
+			{
+				compare = tokens[i + 1];
+			}
+			else if (tokens[i] == "data")
+			{
+				data = tokens[i + 1];
+			}
+			else
+			{
+				cout << "e-['bench pipeline' takes [save file] [compare file] [data file]]" << endl;
+				return;
+			}
+		}
+		map<string, double> baseline;
+		if (!compare.empty())
+		{
+			baseline = bench_load_baseline(compare);
+		}
+		vector<UCHAR> packets = data.empty() ? bench_packets(BENCH_PACKETS) : bench_load_packets(data);
+		path fn = g_tmpdir / "js110-bench.bin";
+		vector<PipelineBenchResult> results = bench_pipeline(fn.string(), packets);
+		unsigned regressions = 0;
+		for (auto& r : results)
+		{
+			cout
+				<< "m-bench-" << r.name
+				<< "-ns-per-sample[" << fixed << setprecision(2) << r.ns_per_sample
+				<< "]-msps[" << 1e3 / r.ns_per_sample << "]";
+			auto itr = baseline.find(r.name);
+			if (itr != baseline.end() && itr->second > 0.0)
+			{
+				double change = r.ns_per_sample / itr->second - 1.0;
+				cout
+					<< "-baseline-ns[" << itr->second
+					<< "]-change-pct[" << showpos << change * 100.0 << noshowpos << "]";
+				regressions += (change > BENCH_REGRESSION) ? 1 : 0;
+			}
+			cout << defaultfloat << endl;
+		}
+		if (regressions > 0)
+		{
+			cout
+				<< "e-[" << regressions << " benchmark(s) more than "
+				<< (int)(BENCH_REGRESSION * 100) << "% slower than " << compare << "]" << endl;
+		}
+		if (!save.empty())
+		{
+			bench_save_baseline(save, results);
+			cout << "m-[Saved baseline to " << save << "]" << endl;
+		}
+	}
+	else if (which == "headroom")
+	{
+		double seconds = tokens.size() > 2 ? stod(tokens[2]) : 10.0;
+		path fn = g_tmpdir / "js110-bench.bin";
+		unsigned queue = g_joulescope.m_transfers_outstanding * g_joulescope.m_transfer_length;
+		unsigned headroom = 0;
+		for (unsigned factor : { 1u, 2u, 5u, 10u })
+		{
+			HeadroomBenchResult r = bench_headroom(fn.string(), factor, seconds,
+				g_file_writer.samplerate(), g_file_writer.direct(), queue, g_joulescope.m_transfer_length);
+			cout
+				<< "m-bench-e2e-x[" << factor
+				<< "]-ok[" << (r.ok ? "yes" : "no")
+				<< "]-dropped-pkts[" << r.dropped << "/" << r.packets
+				<< "]-max-backlog-pkts[" << r.max_backlog << "/" << queue
+				<< "]-peak-pages[" << r.peak_pages << "/" << MAX_OVERLAPPED_WRITES
+				<< "]-add-data-pct[" << fixed << setprecision(1) << r.add_data_pct
+				<< "]-process-pct[" << r.process_pct
+				<< "]-write-pct[" << r.write_pct
+				<< "]-cpu-user-s[" << setprecision(2) << r.cpu_user_s
+				<< "]-cpu-kernel-s[" << r.cpu_kernel_s
+				<< "]" << defaultfloat << endl;
+			if (!r.error.empty())
+			{
+				cout << "e-[Headroom run at " << factor << "x failed: " << r.error << "]" << endl;
+			}
+			if (!r.ok)
+			{
+				break;
+			}
+			headroom = factor;
+		}
+		cout << "m-bench-headroom-factor[" << headroom << "]" << endl;
+	}
+	else if (which == "stream")
+	{
+		double seconds = 5.0;
+		int port = STREAM_DEFAULT_PORT + 1;
+		try
+		{
+			if (tokens.size() > 2) seconds = stod(tokens[2]);
+			if (tokens.size() > 3) port = stoi(tokens[3]);
+		}
+		catch (...)
+		{
+			port = 0;
+		}
+		if ((seconds <= 0.0) || (port < 1) || (port > 65535))
+		{
+			cout << "e-['bench stream' takes [seconds] [port 1 to 65535]]" << endl;
+			return;
+		}
+		unsigned failed = 0;
+		for (auto& r : bench_stream((unsigned short)port, seconds))
+		{
+			cout
+				<< "m-bench-stream-client[" << r.name
+				<< "]-ok[" << (r.ok ? "yes" : "no")
+				<< "]-frames[" << r.frames
+				<< "]-records[" << r.records
+				<< "]-skipped-blocks[" << r.skipped_blocks
+				<< "]-dropped-blocks[" << r.dropped
+				<< "]-max-decimation[" << r.max_decimation
+				<< "]" << endl;
+			if (!r.ok)
+			{
+				cout << "e-[Stream bench " << r.name << " client: " << r.error << "]" << endl;
+				++failed;
+			}
+		}
+		cout << "m-bench-stream-ok[" << (failed == 0 ? "yes" : "no") << "]" << endl;
+	}
+	else
+	{
+		cout << "e-[Unknown benchmark '" << which << "']" << endl;
+	}
+}
+
+void
+cmd_trigger(vector<string> tokens)
+{
+	TriggerCapture& trigger = g_file_writer.m_trigger;
+	if (tokens.size() > 1)
+	{
+		// A window that does not parse falls through to the usage line
+		float pre = -1.0f;
+		float post = -1.0f;
+		float watts = INFINITY;
+		uint32_t sources = TRIGGER_SNAPSHOT;
+		if (tokens[1] == "on" && tokens.size() > 3)
+		{
+			try
+			{
+				pre = stof(tokens[2]);
+				post = stof(tokens[3]);
+				for (size_t i(4); i < tokens.size(); ++i)
+				{
+					if (tokens[i] == "gpi0")
+					{
+						sources |= TRIGGER_GPI0;
+					}
+					else if (tokens[i] == "threshold" && (i + 1) < tokens.size())
+					{
+						sources |= TRIGGER_THRESHOLD;
+						watts = stof(tokens[++i]);
+					}
+				}
+			}
+			catch (...)
+			{
+				pre = -1.0f;
+			}
+		}
+		if (g_tracing)
+		{
+			cout << "e-[Cannot change triggering while tracing]" << endl;
+		}
+		else if (tokens[1] == "off")
+		{
+			trigger.sources(0);
+		}
+		else if (tokens[1] == "on" && pre >= 0 && post >= 0)
+		{
+			trigger.configure(pre, post);
+			trigger.threshold(watts);
+			trigger.sources(sources);
+		}
+		else
+		{
+			cout << "e-['trigger' takes 'off' or 'on <pre s> <post s> [gpi0] [threshold <W>]']" << endl;
+		}
+	}
+	if (trigger.enabled())
+	{
+		cout
+			<< "m-trigger[on]-pre[" << trigger.pre_seconds()
+			<< "]-post[" << trigger.post_seconds()
+			<< "]-gpi0[" << ((trigger.sources() & TRIGGER_GPI0) ? "on" : "off")
+			<< "]-threshold[";
+		if (trigger.sources() & TRIGGER_THRESHOLD)
+		{
+			cout << trigger.threshold();
+		}
+		else
+		{
+			cout << "off";
+		}
+		cout << "]" << endl;
+	}
+	else
+	{
+		cout << "m-trigger[off]" << endl;
+	}
+}
+
+void
+cmd_snapshot(vector<string> tokens)
+{
+	if (!g_file_writer.m_trigger.enabled() || !g_tracing)
+	{
+		cout << "e-['snapshot' needs 'trigger on' and a running trace]" << endl;
+		return;
+	}
+	g_file_writer.m_trigger.snapshot();
+}
+
+void
+cmd_stream(vector<string> tokens)
+{
+	if (tokens.size() > 1)
+	{
+		if (g_tracing)
+		{
+			// The trace is publishing to it
+			cout << "e-[Cannot change streaming while tracing]" << endl;
+		}
+		else if (tokens[1] == "off")
+		{
+			g_file_writer.set_stream_server(nullptr);
+			g_stream_server.stop();
+		}
+		else if (tokens[1] == "on")
+		{
+			int port = STREAM_DEFAULT_PORT;
+			try
+			{
+				port = tokens.size() > 2 ? stoi(tokens[2]) : port;
+			}
+			catch (...)
+			{
+				port = 0;
+			}
+			uint32_t kind = STREAM_KIND_ENERGY;
+			if (tokens.size() > 3 && tokens[3] == "iv")
+			{
+				kind = STREAM_KIND_IV;
+			}
+			if ((port < 1) || (port > 65535))
+			{
+				cout << "e-['stream on' takes a port from 1 to 65535 (and optional 'energy' or 'iv')]" << endl;
+			}
+			else
+			{
+				g_file_writer.set_stream_server(nullptr);
+				g_stream_server.start((unsigned short)port, kind);
+				g_file_writer.set_stream_server(&g_stream_server);
+			}
+		}
+		else
+		{
+			cout << "e-['stream' takes 'off' or 'on' (and optional port and 'energy' or 'iv')]" << endl;
+		}
+	}
+	if (g_stream_server.is_running())
+	{
+		cout
+			<< "m-stream["
+			<< (g_stream_server.kind() == STREAM_KIND_IV ? "iv" : "energy")
+			<< "]-port[" << g_stream_server.port()
+			<< "]-clients[" << g_stream_server.clients() << "]"
+			<< endl;
+	}
+	else
+	{
+		cout << "m-stream[off]" << endl;
+	}
+}
+
+void
+cmd_deinit(vector<string> tokens)
+{
+	if (g_tracing)
+	{
+		trace_stop();
+	}
+	if (g_joulescope.is_open())
+	{
+		g_joulescope.close();
+	}
+}
+
+/**
+ * Signals arrive on a thread of their own, so hand the exit to the loop
+ * like any other command. cmd_exit() ends the process; if the loop is
+ * wedged, give up after ten seconds rather than hang.
+ */
+void
+sigint_handler(int _signal)
+{
+	static atomic<bool> cleanup_done(false);
+	cout << "e-[Caught signal #" << _signal << "]" << endl;
+	if (!cleanup_done.exchange(true))
+	{
+		g_loop.post([]() { cmd_exit(vector<string>()); });
+		Sleep(10000);
+		cout << "e-[Timed out waiting for a clean exit]" << endl;
+		exit(-1);
+	}
+}
+
+/**
+ * Find and run one command. Called on the loop thread.
+ */
+void
+run_command(string line, vector<string> tokens)
+{
+	try
+	{
+		CommandTable::iterator itr = g_commands.find(tokens[0]);
+		if (itr == g_commands.end())
+		{
+			cout << "e-[Unknown command: " << line << "]" << endl;
+		}
+		else
+		{
+			itr->second.func(tokens);
+		}
+	}
+	catch (runtime_error re)
+	{
+		cout << "e-[Command runtime error: " << re.what() << "]" << endl;
+	}
+	catch (...)
+	{
+		cout << "e-[Unknown exception in command]" << endl;
+	}
+}
+
+/**
+ * The main thread only reads stdin. Each command is handed to the loop and
+ * finishes before `m-ready` is printed and the next line is read, as when
+ * commands ran here. With `--json`, requests are framed (see protocol.hpp)
+ * and handed over as soon as they arrive; the loop runs them in order and
+ * each response says when its request is done.
+ */
+int
+main(int argc, char* argv[])
+{
+	string line;
+
+	setvbuf(stdout, NULL, _IONBF, 0);
+	setvbuf(stderr, NULL, _IONBF, 0);
+
+	for (int i(1); i < argc; ++i)
+	{
+		if (string(argv[i]) == "--json")
+		{
+			g_protocol.enable();
+			g_joulescope.m_device.m_notify = &g_protocol.notify();
+		}
+	}
+
+	signal(SIGINT, sigint_handler);
+	signal(SIGTERM, sigint_handler);
+	signal(SIGBREAK, sigint_handler);
+
+	cout << "Joulescope(R) JS110 Win32 Driver" << endl;
+	cout << "Version : " << VERSION << endl;
+	cout << "Head    : " << PYJOULESCOPE_GITHUB_HEAD << endl;
+
+	g_file_writer.set_lap_notifier(&g_lap_notifier);
+	g_raw_buffer.set_lap_notifier(&g_lap_notifier);
+	register_metrics();
+	g_loop.add(&g_device_source);
+	g_loop.add(&g_writer_source);
+	g_loop_thread = CreateThread(NULL, 0, loop_spin, NULL, 0, NULL);
+	if (g_loop_thread == NULL)
+	{
+		cout << "e-[Failed to create event loop thread]" << endl;
+		return -1;
+	}
+	try {
+		if (g_protocol.enabled())
+		{
+			Json::Value request;
+			while (g_protocol.read(request))
+			{
+				g_loop.post([request]()
+				{
+					g_protocol.serve(request, run_command);
+				});
+			}
+			// The host closed our stdin: nobody is left to send `exit`
+			g_loop.post([]() { cmd_exit(vector<string>()); });
+			Sleep(INFINITE);
+		}
+		vector<string> tokens;
+		for (;;)
+		{
+			tokens.clear();
+			getline(cin, line);
+			// CTRL-C causes a fail that needs clearing before calling again
+			if (cin.fail() || cin.eof())
+			{
+				cin.clear();
+				continue;
+			}
+			trim(line);
+			tokenizer_t tok(line, delim_t("", " ", "\""));
+			for (tokenizer_t::iterator itr = tok.begin(); itr != tok.end(); ++itr) {
+				tokens.push_back(*itr);
+			}
+			if (!tokens.empty() && !tokens[0].empty())
+			{
+				promise<void> done;
+				g_loop.post([&]()
+				{
+					run_command(line, tokens);
+					done.set_value();
+				});
+				done.get_future().wait();
 			}
 			cout << "m-ready" << endl;
 		}
@@ -17,13 +17,23 @@
 
 #pragma once
 
+// Winsock must come before Windows.h
+#include <winsock2.h>
 #include "joulescope.hpp"
 #include "raw_processor.hpp"
 #include "raw_buffer.hpp"
 #include "file_writer.hpp"
+#include "live_ring.hpp"
+#include "bench.hpp"
+#include "thread_tuning.hpp"
+#include "event_loop.hpp"
+#include "protocol.hpp"
+#include "metrics.hpp"
+#include "timeline.hpp"
 #include <fstream>
 #include <filesystem>
 #include <iomanip>
+#include <sstream>
 
 #include <csignal>
 
@@ -42,13 +52,28 @@ struct Command
 
 typedef std::map<std::string, Command> CommandTable;
 
+void cmd_bench(std::vector<std::string>);
 void cmd_debug(std::vector<std::string>);
 void cmd_deinit(std::vector<std::string>);
+void cmd_direct(std::vector<std::string>);
 void cmd_exit(std::vector<std::string>);
 void cmd_help(std::vector<std::string>);
 void cmd_init(std::vector<std::string>);
+void cmd_interp(std::vector<std::string>);
+void cmd_live(std::vector<std::string>);
+void cmd_metrics(std::vector<std::string>);
 void cmd_power(std::vector<std::string>);
+void cmd_profile(std::vector<std::string>);
+void cmd_reconnect(std::vector<std::string>);
+void cmd_segment(std::vector<std::string>);
+void cmd_snapshot(std::vector<std::string>);
+void cmd_stats(std::vector<std::string>);
+void cmd_stream(std::vector<std::string>);
+void cmd_threads(std::vector<std::string>);
+void cmd_timeline(std::vector<std::string>);
 void cmd_timer(std::vector<std::string>);
 void cmd_trace(std::vector<std::string>);
+void cmd_trigger(std::vector<std::string>);
+void cmd_usb(std::vector<std::string>);
 void cmd_rate(std::vector<std::string>);
 void cmd_voltage(std::vector<std::string>);
@@ -0,0 +1,95 @@
+/**
+ * Copyright 2021 Peter Torelli
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "metrics.hpp"
+
+#include <iomanip>
+#include <sstream>
+
+using namespace std;
+
+void
+Metrics::counter(string name, string help, read_fn_t read)
+{
+	m_metrics.push_back(Metric{ name, help, MetricType::COUNTER, read, nullptr });
+}
+
+void
+Metrics::gauge(string name, string help, read_fn_t read)
+{
+	m_metrics.push_back(Metric{ name, help, MetricType::GAUGE, read, nullptr });
+}
+
+void
+Metrics::histogram(string name, string help, const LatencyHistogram *histogram)
+{
+	m_metrics.push_back(Metric{ name, help, MetricType::HISTOGRAM, nullptr, histogram });
+}
+
+vector<MetricSample>
+Metrics::snapshot(void) const
+{
+	vector<MetricSample> samples;
+	samples.reserve(m_metrics.size());
+	for (auto& m : m_metrics)
+	{
+		MetricSample s = {};
+		s.name = m.name;
+		s.help = m.help;
+		s.type = m.type;
+		if (m.type == MetricType::HISTOGRAM)
+		{
+			s.summary = m.histogram->summary();
+		}
+		else
+		{
+			s.value = m.read();
+		}
+		samples.push_back(s);
+	}
+	return samples;
+}
+
+string
+Metrics::prometheus(const vector<MetricSample>& samples)
+{
+	ostringstream out;
+	out << setprecision(17);
+	for (auto& s : samples)
+	{
+		out << "# HELP " << s.name << " " << s.help << "\n";
+		switch (s.type)
+		{
+		case MetricType::COUNTER:
+			out << "# TYPE " << s.name << " counter\n";
+			out << s.name << " " << s.value << "\n";
+			break;
+		case MetricType::GAUGE:
+			out << "# TYPE " << s.name << " gauge\n";
+			out << s.name << " " << s.value << "\n";
+			break;
+		case MetricType::HISTOGRAM:
+			out << "# TYPE " << s.name << " summary\n";
+			out << s.name << "{quantile=\"0.5\"} " << s.summary.p50_us / 1e6 << "\n";
+			out << s.name << "{quantile=\"0.99\"} " << s.summary.p99_us / 1e6 << "\n";
+			out << s.name << "{quantile=\"0.999\"} " << s.summary.p999_us / 1e6 << "\n";
+			out << s.name << "_sum " << s.summary.mean_us * s.summary.count / 1e6 << "\n";
+			out << s.name << "_count " << s.summary.count << "\n";
+			break;
+		}
+	}
+	return out.str();
+}
@@ -0,0 +1,73 @@
+/**
+ * Copyright 2021 Peter Torelli
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+#include "latency_histogram.hpp"
+
+enum class MetricType { COUNTER, GAUGE, HISTOGRAM };
+
+struct MetricSample
+{
+	std::string    name;
+	std::string    help;
+	MetricType     type;
+	double         value;   // counters and gauges
+	LatencySummary summary; // histograms
+};
+
+/**
+ * One place that knows every counter, gauge and latency histogram in the
+ * driver, so they can be read all at once and exported. The registry
+ * does not hold the values: the pipeline keeps counting in its own plain
+ * fields, as fast as ever, and each metric is a function that reads one.
+ *
+ * Nearly all of them are owned by the event loop thread, so snapshot()
+ * must be called there (from a command or a timer): it then reads them
+ * between two loop passes, where they are all consistent with each other,
+ * without a lock. The few written by other threads (the lap notifier's,
+ * and every LatencyHistogram) are single-writer atomics and may be read
+ * from anywhere.
+ */
+class Metrics
+{
+public:
+	typedef std::function<double(void)> read_fn_t;
+	// Only goes up, except at a trace start
+	void counter(std::string name, std::string help, read_fn_t read);
+	void gauge(std::string name, std::string help, read_fn_t read);
+	void histogram(std::string name, std::string help, const LatencyHistogram *histogram);
+	std::vector<MetricSample> snapshot(void) const;
+	/**
+	 * The Prometheus text exposition format, which most collectors (and
+	 * node_exporter's textfile collector) read. Histograms are written as
+	 * summaries: p50, p99 and p99.9, in seconds.
+	 */
+	static std::string prometheus(const std::vector<MetricSample>& samples);
+private:
+	struct Metric
+	{
+		std::string             name;
+		std::string             help;
+		MetricType              type;
+		read_fn_t               read;
+		const LatencyHistogram *histogram;
+	};
+	std::vector<Metric> m_metrics;
+};
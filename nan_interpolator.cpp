@@ -0,0 +1,152 @@
+/**
+ * Copyright 2021 Peter Torelli
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nan_interpolator.hpp"
+#include "file_writer.hpp"
+#include "crc32c.hpp"
+
+#include <algorithm>
+
+#define BITMAP_CHUNK 4096 // bytes of bitmap built at a time
+
+void
+NanInterpolator::reset(void)
+{
+	m_pending = 0;
+	m_overflow = false;
+	m_last = NAN;
+	m_index = 0;
+	m_total_repaired = 0;
+	m_runs.clear();
+}
+
+/**
+ * Feed one downsampled sample. NaNs are only counted until we know how the
+ * run ends, so the lookahead is bounded by `m_max_run` samples.
+ */
+void
+NanInterpolator::add(float e)
+{
+	if (isnan(e))
+	{
+		if (!m_overflow && !isnan(m_last) && m_pending < m_max_run)
+		{
+			++m_pending;
+			return;
+		}
+		// Too long (or nothing to anchor to): give up on this run.
+		emit_pending_nans();
+		m_overflow = true;
+		emit(e);
+		return;
+	}
+	if (m_pending)
+	{
+		float step = (e - m_last) / (float)(m_pending + 1);
+		for (unsigned k(1); k <= m_pending; ++k)
+		{
+			emit_repaired(m_last + step * (float)k);
+		}
+		m_pending = 0;
+	}
+	m_overflow = false;
+	m_last = e;
+	emit(e);
+}
+
+/**
+ * A trace that ends inside a run has no right-hand neighbor, so whatever is
+ * pending goes out as NaN.
+ */
+void
+NanInterpolator::flush(void)
+{
+	emit_pending_nans();
+}
+
+void
+NanInterpolator::emit(float e)
+{
+	m_writer->store(e);
+	++m_index;
+}
+
+void
+NanInterpolator::emit_repaired(float e)
+{
+	if (!m_runs.empty() && m_runs.back().start + m_runs.back().length == m_index)
+	{
+		++m_runs.back().length;
+	}
+	else
+	{
+		m_runs.push_back(Run{ m_index, 1 });
+	}
+	++m_total_repaired;
+	emit(e);
+}
+
+/**
+ * Write the repairs as a bitmap up to the byte holding the last repaired
+ * sample, BITMAP_CHUNK bytes at a time so a long trace never needs the
+ * whole bitmap in memory. Returns the CRC-32C of the bytes written.
+ */
+uint32_t
+NanInterpolator::write_bitmap(ostream& out) const
+{
+	uint32_t crc = 0;
+	if (m_runs.empty())
+	{
+		return crc;
+	}
+	uint64_t bytes = ((m_runs.back().start + m_runs.back().length - 1) >> 3) + 1;
+	uint8_t chunk[BITMAP_CHUNK];
+	size_t run = 0;
+	for (uint64_t base(0); base < bytes; base += BITMAP_CHUNK)
+	{
+		size_t n = (size_t)min<uint64_t>(BITMAP_CHUNK, bytes - base);
+		uint64_t first = base << 3;
+		uint64_t end = (base + n) << 3;
+		fill_n(chunk, n, (uint8_t)0);
+		for (; run < m_runs.size() && m_runs[run].start < end; ++run)
+		{
+			uint64_t lo = max(m_runs[run].start, first);
+			uint64_t hi = min(m_runs[run].start + m_runs[run].length, end);
+			for (uint64_t s(lo); s < hi; ++s)
+			{
+				chunk[(s - first) >> 3] |= (uint8_t)(1u << (s & 7));
+			}
+			if (m_runs[run].start + m_runs[run].length > end)
+			{
+				// Carries on into the next chunk
+				break;
+			}
+		}
+		out.write((const char*)chunk, n);
+		crc = crc32c(chunk, n, crc);
+	}
+	return crc;
+}
+
+void
+NanInterpolator::emit_pending_nans(void)
+{
+	while (m_pending)
+	{
+		--m_pending;
+		emit(NAN);
+	}
+}
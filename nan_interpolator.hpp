@@ -0,0 +1,84 @@
+/**
+ * Copyright 2021 Peter Torelli
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <vector>
+#include <cinttypes>
+#include <cmath>
+#include <ostream>
+
+using namespace std;
+
+#define NAN_RUN_MAX 1024 // longest run we are willing to hold back, in samples
+
+class FileWriter;
+
+/**
+ * Streaming NaN repair for the downsampled energy samples. Samples pass
+ * through `add()` on their way to the FileWriter pages. A run of NaNs is
+ * held back (only the count is needed, they are all NaN) until the next
+ * finite sample arrives, at which point the run is replaced by a straight
+ * line between the two finite neighbors. Runs longer than `max_run()`, or
+ * runs with no finite sample before them, pass through as NaN.
+ *
+ * Every repaired sample is recorded so the host can tell measured data
+ * from interpolated data. Repairs come in runs, so they are kept as runs
+ * (one per dropout, however long the trace) and only expanded into the
+ * bitmap file (bit n = sample n, LSB first) by `write_bitmap()`.
+ */
+class NanInterpolator
+{
+public:
+	void set_writer(FileWriter *ptr)
+	{
+		m_writer = ptr;
+	}
+	void reset(void);
+	void add(float e);
+	void flush(void);
+	unsigned max_run(void)
+	{
+		return m_max_run;
+	}
+	void max_run(unsigned n)
+	{
+		m_max_run = n > NAN_RUN_MAX ? NAN_RUN_MAX : n;
+	}
+	bool enabled(void)
+	{
+		return m_max_run > 0;
+	}
+	uint32_t write_bitmap(ostream& out) const;
+	size_t m_total_repaired = 0;
+private:
+	struct Run
+	{
+		uint64_t start;  // first repaired sample
+		uint64_t length; // in samples
+	};
+	vector<Run> m_runs;
+	FileWriter *m_writer = nullptr;
+	unsigned    m_max_run = 0;
+	unsigned    m_pending = 0;     // NaNs held back since m_last
+	bool        m_overflow = false; // current run is too long to repair
+	float       m_last = NAN;
+	size_t      m_index = 0;       // index of the next sample to emit
+
+	void emit(float e);
+	void emit_repaired(float e);
+	void emit_pending_nans(void);
+};
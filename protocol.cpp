@@ -0,0 +1,343 @@
+/**
+ * Copyright 2021 Peter Torelli
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "protocol.hpp"
+
+#include <boost\tokenizer.hpp>
+#include <fcntl.h>
+#include <io.h>
+#include <memory>
+
+using namespace std;
+
+// A request bigger than this is garbage, not a command
+#define PROTOCOL_FRAME_MAX (1024 * 1024)
+
+Protocol::Protocol()
+	: m_command_buf(this, false)
+	, m_notify_buf(this, true)
+	, m_notify(&m_notify_buf)
+{
+	m_writer["indentation"] = "";
+}
+
+Protocol::~Protocol()
+{
+	if (m_out != nullptr)
+	{
+		cout.rdbuf(m_out);
+	}
+}
+
+/**
+ * From here on stdout only carries frames, so cout is routed through a
+ * LineBuf: a command's lines are collected for its response and all
+ * others become notifications. Both pipes go binary so Windows does not
+ * turn a 0x0a in a length into CR LF.
+ */
+void
+Protocol::enable(void)
+{
+	_setmode(_fileno(stdin), _O_BINARY);
+	_setmode(_fileno(stdout), _O_BINARY);
+	m_out = cout.rdbuf(&m_command_buf);
+	m_enabled = true;
+}
+
+bool
+Protocol::read(Json::Value& request)
+{
+	for (;;)
+	{
+		unsigned char hdr[4];
+		if (!cin.read((char*)hdr, sizeof(hdr)))
+		{
+			return false;
+		}
+		uint32_t len = hdr[0] | (hdr[1] << 8) | (hdr[2] << 16) | ((uint32_t)hdr[3] << 24);
+		if (len > PROTOCOL_FRAME_MAX)
+		{
+			// There is no way to find the next frame; stop reading
+			_error("Request frame of " + to_string(len) + " bytes is too large");
+			return false;
+		}
+		string json(len, '\0');
+		if (!cin.read(&json[0], len))
+		{
+			return false;
+		}
+		JSONCPP_STRING err;
+		Json::CharReaderBuilder builder;
+		const unique_ptr<Json::CharReader> reader(builder.newCharReader());
+		if (!reader->parse(json.c_str(), json.c_str() + json.length(), &request, &err))
+		{
+			_error("Bad request: " + err);
+			continue;
+		}
+		if (!request.isObject())
+		{
+			_error("Bad request: not an object");
+			continue;
+		}
+		return true;
+	}
+}
+
+/**
+ * Runs on the loop thread, like a command typed at the CLI. A batch is
+ * just several commands with nothing between them; the loop still
+ * services the device and the writer after the last one.
+ */
+void
+Protocol::serve(const Json::Value& request, run_fn_t run)
+{
+	m_response = Json::Value(Json::objectValue);
+	m_response["id"] = request.get("id", Json::Value());
+	m_response["ok"] = true;
+	m_batch = request.isMember("batch");
+	m_serving = true;
+	if (m_batch)
+	{
+		m_response["results"] = Json::Value(Json::arrayValue);
+		const Json::Value& batch = request["batch"];
+		for (Json::ArrayIndex i(0); batch.isArray() && i < batch.size(); ++i)
+		{
+			string line;
+			vector<string> tokens;
+			_capture();
+			if (_command(batch[i], line, tokens))
+			{
+				run(line, tokens);
+			}
+			m_response["results"].append(_result());
+		}
+	}
+	else
+	{
+		string line;
+		vector<string> tokens;
+		_capture();
+		if (_command(request, line, tokens))
+		{
+			run(line, tokens);
+		}
+		Json::Value result = _result();
+		m_response["lines"] = result["lines"];
+	}
+	_respond();
+}
+
+/**
+ * `exit` never returns to serve(), so it calls this to send what it
+ * printed first.
+ */
+void
+Protocol::finish(void)
+{
+	if (!m_serving)
+	{
+		return;
+	}
+	Json::Value result = _result();
+	if (m_batch)
+	{
+		m_response["results"].append(result);
+	}
+	else
+	{
+		m_response["lines"] = result["lines"];
+	}
+	_respond();
+}
+
+/**
+ * Either a command string or {"cmd": ..., "args": [...]}, with each arg a
+ * string, number, bool or null. Anything else is answered with an `e-`
+ * line in the response, never thrown: serve() must always respond.
+ */
+bool
+Protocol::_command(const Json::Value& item, string& line, vector<string>& tokens)
+{
+	if (!item.isString() && !item.isObject())
+	{
+		cout << "e-[Bad request: a command must be a string or an object]" << endl;
+		return false;
+	}
+	const Json::Value& cmd = item.isString() ? item : item.get("cmd", Json::Value());
+	if (!cmd.isString())
+	{
+		cout << "e-[Bad request: no 'cmd' string]" << endl;
+		return false;
+	}
+	line = cmd.asString();
+	if (item.isObject() && item.isMember("args"))
+	{
+		const Json::Value& args = item["args"];
+		if (!args.isArray())
+		{
+			cout << "e-[Bad request: 'args' must be an array]" << endl;
+			return false;
+		}
+		for (const Json::Value& arg : args)
+		{
+			if (arg.isArray() || arg.isObject() || !arg.isConvertibleTo(Json::stringValue))
+			{
+				cout << "e-[Bad request: each of 'args' must be a string, number or bool]" << endl;
+				tokens.clear();
+				return false;
+			}
+		}
+		tokens.push_back(line);
+		for (const Json::Value& arg : args)
+		{
+			tokens.push_back(arg.asString());
+			line += " " + arg.asString();
+		}
+	}
+	else
+	{
+		typedef boost::tokenizer<boost::escaped_list_separator<char>> tokenizer_t;
+		tokenizer_t tok(line, boost::escaped_list_separator<char>("", " ", "\""));
+		for (tokenizer_t::iterator itr = tok.begin(); itr != tok.end(); ++itr)
+		{
+			if (!itr->empty())
+			{
+				tokens.push_back(*itr);
+			}
+		}
+	}
+	return !tokens.empty();
+}
+
+void
+Protocol::_capture(void)
+{
+	lock_guard<mutex> guard(m_lock);
+	m_lines.clear();
+	m_capture_thread = GetCurrentThreadId();
+}
+
+Json::Value
+Protocol::_result(void)
+{
+	Json::Value result(Json::objectValue);
+	result["ok"] = true;
+	result["lines"] = Json::Value(Json::arrayValue);
+	lock_guard<mutex> guard(m_lock);
+	for (auto& line : m_lines)
+	{
+		if (line.compare(0, 2, "e-") == 0)
+		{
+			result["ok"] = false;
+			m_response["ok"] = false;
+		}
+		result["lines"].append(line);
+	}
+	m_lines.clear();
+	m_capture_thread = 0;
+	return result;
+}
+
+void
+Protocol::_respond(void)
+{
+	m_serving = false;
+	lock_guard<mutex> guard(m_lock);
+	_write(m_response);
+}
+
+// For requests that could not be read, so have no id to answer
+void
+Protocol::_error(string msg)
+{
+	Json::Value response(Json::objectValue);
+	response["id"] = Json::Value();
+	response["ok"] = false;
+	response["lines"].append("e-[" + msg + "]");
+	lock_guard<mutex> guard(m_lock);
+	_write(response);
+}
+
+/**
+ * A finished line. The command being served only gets the lines its own
+ * thread printed to cout; the rest are somebody else's news. m_lock is
+ * held.
+ */
+void
+Protocol::_line(string line, bool async)
+{
+	if (!line.empty() && line.back() == '\r')
+	{
+		line.pop_back();
+	}
+	if (!async && m_capture_thread == GetCurrentThreadId())
+	{
+		m_lines.push_back(line);
+		return;
+	}
+	Json::Value frame(Json::objectValue);
+	frame["seq"] = (Json::UInt64)++m_seq;
+	frame["notify"] = line;
+	_write(frame);
+}
+
+// m_lock is held
+void
+Protocol::_write(const Json::Value& frame)
+{
+	string json = Json::writeString(m_writer, frame);
+	uint32_t len = (uint32_t)json.size();
+	unsigned char hdr[4] = {
+		(unsigned char)len,
+		(unsigned char)(len >> 8),
+		(unsigned char)(len >> 16),
+		(unsigned char)(len >> 24)
+	};
+	m_out->sputn((const char*)hdr, sizeof(hdr));
+	m_out->sputn(json.data(), json.size());
+	m_out->pubsync();
+}
+
+Protocol::LineBuf::int_type
+Protocol::LineBuf::overflow(int_type c)
+{
+	if (c != traits_type::eof())
+	{
+		char ch = (char)c;
+		xsputn(&ch, 1);
+	}
+	return traits_type::not_eof(c);
+}
+
+streamsize
+Protocol::LineBuf::xsputn(const char *s, streamsize n)
+{
+	lock_guard<mutex> guard(m_owner->m_lock);
+	string& partial = m_partial[GetCurrentThreadId()];
+	for (streamsize i(0); i < n; ++i)
+	{
+		if (s[i] == '\n')
+		{
+			m_owner->_line(partial, m_async);
+			partial.clear();
+		}
+		else
+		{
+			partial += s[i];
+		}
+	}
+	return n;
+}
@@ -0,0 +1,125 @@
+/**
+ * Copyright 2021 Peter Torelli
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "dist/json/json.h"
+#include <Windows.h>
+#include <cinttypes>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+/**
+ * Framed control protocol, for hosts that would rather not scrape text.
+ * Started with `--json` on the command line. Every frame, in both
+ * directions, is a 4-byte little-endian length followed by that many bytes
+ * of UTF-8 JSON.
+ *
+ * A request carries an id, which comes back on its response:
+ *
+ *     {"id":1,"cmd":"power on"}
+ *     {"id":1,"ok":true,"lines":["m-power[on]"]}
+ *
+ * `cmd` may also be given split, as {"cmd":"power","args":["on"]}. A
+ * batch runs its commands back to back on the loop and answers once:
+ *
+ *     {"id":2,"batch":["power on",{"cmd":"trace","args":["on",".","t"]}]}
+ *     {"id":2,"ok":true,"results":[{"ok":true,"lines":[...]},...]}
+ *
+ * `ok` is false if any line is an `e-` line. Requests need not wait for
+ * responses: they run in the order sent and are answered in that order.
+ *
+ * Everything printed outside of a command, and anything asynchronous
+ * (laps, USB retuning, reconnects) even while one runs, goes out as a frame
+ * of its own with a sequence number, never inside a response:
+ *
+ *     {"seq":17,"notify":"m-lap-us-1500000"}
+ *
+ * The lines are the ones the text CLI prints, so they parse the same way.
+ */
+class Protocol
+{
+public:
+	typedef std::function<void(std::string, std::vector<std::string>)> run_fn_t;
+	Protocol();
+	~Protocol();
+	// Take over stdin and stdout; call once, before any other thread prints
+	void enable(void);
+	bool enabled(void)
+	{
+		return m_enabled;
+	}
+	/**
+	 * Where asynchronous messages go. They can be printed in the middle of
+	 * a command (a lap while `voltage` waits on the device), so they must
+	 * not land in its response. Plain std::cout when the protocol is off.
+	 */
+	std::ostream& notify(void)
+	{
+		return m_enabled ? m_notify : std::cout;
+	}
+	// Main thread: block for the next request; false at end of input
+	bool read(Json::Value& request);
+	// Loop thread: run a request with `run` and send its response
+	void serve(const Json::Value& request, run_fn_t run);
+	// Loop thread: the process is about to exit inside serve(), answer now
+	void finish(void);
+private:
+	/**
+	 * Unbuffered, so every character comes straight here and lines from
+	 * different threads are kept apart.
+	 */
+	class LineBuf : public std::streambuf
+	{
+	public:
+		LineBuf(Protocol *owner, bool async) : m_owner(owner), m_async(async) {}
+	protected:
+		int_type overflow(int_type c);
+		std::streamsize xsputn(const char *s, std::streamsize n);
+	private:
+		Protocol *m_owner;
+		bool      m_async;
+		std::map<DWORD, std::string> m_partial; // by thread
+	};
+	void _line(std::string line, bool async);
+	bool _command(const Json::Value& item, std::string& line, std::vector<std::string>& tokens);
+	void _capture(void);
+	Json::Value _result(void);
+	void _respond(void);
+	void _write(const Json::Value& frame);
+	void _error(std::string msg);
+
+	bool            m_enabled = false;
+	std::streambuf *m_out = nullptr; // the real stdout
+	LineBuf         m_command_buf;
+	LineBuf         m_notify_buf;
+	std::ostream    m_notify;
+	// Held while a line is routed or a frame written
+	std::mutex      m_lock;
+	uint64_t        m_seq = 0;
+	// The request serve() is running
+	bool            m_serving = false;
+	Json::Value     m_response;
+	bool            m_batch = false;
+	DWORD           m_capture_thread = 0;
+	std::vector<std::string> m_lines;
+	Json::StreamWriterBuilder m_writer;
+};
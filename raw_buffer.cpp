@@ -25,13 +25,18 @@ bool RawBuffer::add_data(vector<UCHAR>& data)
 	{
 		add_pkt(pkts++);
 	}
+	if (m_laps != nullptr)
+	{
+		m_laps->delivered(m_raw_total);
+	}
 	return false;
 }
 
 void RawBuffer::add_pkt(JoulescopePacket* pkt)
 {
 	++m_total_pkts;
-	UINT16 delta = pkt->pkt_index - m_last_pkt_index;
+	UINT16 delta = m_resync ? 1 : pkt->pkt_index - m_last_pkt_index;
+	m_resync = false;
 	if (delta > 1)
 	{
 		m_total_dropped_pkts += delta;
@@ -52,6 +57,7 @@ void RawBuffer::copy_raw_samples(UINT32 *samples)
 	CopyMemory(&(m_raw[m_raw_pos]), samples,
 		JS110_SAMPLES_PER_PACKET * sizeof(UINT32));
 	m_raw_pos += JS110_SAMPLES_PER_PACKET;
+	m_raw_total += JS110_SAMPLES_PER_PACKET;
 	if (m_raw_pos >= MAX_RAW_SAMPLES)
 	{
 		// This means we couldn't call the RawProcesor fast enough.
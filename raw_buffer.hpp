@@ -18,20 +18,39 @@ public:
 	{
 		m_raw_processor = ptr;
 	}
+	// Told how far the data has got, to date the edges it finds
+	void set_lap_notifier(LapNotifier *ptr)
+	{
+		m_laps = ptr;
+	}
 	void reset(void)
 	{
 		m_last_pkt_index = 0;
 		m_total_pkts = 0;
 		m_total_dropped_pkts = 0;
 		m_raw_pos = 0;
+		m_raw_total = 0;
+		m_resync = false;
 	};
+	/**
+	 * The device restarted its stream (a reconnect), so its packet index
+	 * starts over: take the next one as-is rather than count the jump as
+	 * dropped packets.
+	 */
+	void resync(void)
+	{
+		m_resync = true;
+	}
 	size_t m_total_pkts = 0;
 	size_t m_total_dropped_pkts = 0;
 private:
 	UINT16 m_last_pkt_index = 0;
+	bool   m_resync = false;
 	UINT32 m_raw[MAX_RAW_SAMPLES];
 	size_t m_raw_pos = 0;
+	uint64_t m_raw_total = 0; // samples added, bad ones included
 	RawProcessor *m_raw_processor = nullptr;
+	LapNotifier *m_laps = nullptr;
 	void add_pkt(struct JoulescopePacket *pkt);
 	void copy_raw_samples(UINT32 *samples);
 };
@@ -0,0 +1,123 @@
+/**
+ * Copyright 2021 Peter Torelli
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+/**
+ * Header-only client for the `stream on` server. Include it (and
+ * `stream_server.hpp`, for the frame layout) before Windows.h:
+ *
+ *     StreamClient client;
+ *     client.open("127.0.0.1", STREAM_DEFAULT_PORT);
+ *     StreamFrameHeader hdr;
+ *     std::vector<float> data;
+ *     while (client.read(hdr, data))
+ *     {
+ *         ... hdr.first_record says where data[0] belongs ...
+ *     }
+ */
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include "stream_server.hpp"
+#include <stdexcept>
+
+class StreamClient
+{
+public:
+	~StreamClient()
+	{
+		close();
+	}
+	void open(std::string host, unsigned short port)
+	{
+		close();
+		WSADATA wsa;
+		if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+		{
+			throw std::runtime_error("WSAStartup failed");
+		}
+		m_started = true;
+		sockaddr_in addr;
+		ZeroMemory(&addr, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1)
+		{
+			close();
+			throw std::runtime_error("Bad stream host address " + host);
+		}
+		m_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (m_socket == INVALID_SOCKET ||
+			connect(m_socket, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR)
+		{
+			close();
+			throw std::runtime_error("Unable to connect to stream server " + host);
+		}
+	}
+	void close(void)
+	{
+		if (m_socket != INVALID_SOCKET)
+		{
+			closesocket(m_socket);
+			m_socket = INVALID_SOCKET;
+		}
+		if (m_started)
+		{
+			WSACleanup();
+			m_started = false;
+		}
+	}
+	/**
+	 * Block until the next frame arrives. Returns false when the server
+	 * closes the connection; throws on a malformed frame.
+	 */
+	bool read(StreamFrameHeader& hdr, std::vector<float>& data)
+	{
+		if (!_recv_all((char*)&hdr, sizeof(hdr)))
+		{
+			return false;
+		}
+		if (hdr.magic != STREAM_FRAME_MAGIC || hdr.version != STREAM_FRAME_VERSION)
+		{
+			throw std::runtime_error("Bad stream frame header");
+		}
+		size_t floats = (size_t)hdr.count * ((hdr.kind == STREAM_KIND_IV) ? 2 : 1);
+		if (floats > STREAM_BLOCK_FLOATS)
+		{
+			throw std::runtime_error("Stream frame too large");
+		}
+		data.resize(floats);
+		return _recv_all((char*)data.data(), (int)(floats * sizeof(float)));
+	}
+private:
+	bool _recv_all(char* buf, int len)
+	{
+		while (len > 0)
+		{
+			int n = recv(m_socket, buf, len, 0);
+			if (n == SOCKET_ERROR || n == 0)
+			{
+				return false;
+			}
+			buf += n;
+			len -= n;
+		}
+		return true;
+	}
+	SOCKET m_socket = INVALID_SOCKET;
+	bool   m_started = false;
+};
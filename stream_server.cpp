@@ -0,0 +1,410 @@
+/**
+ * Copyright 2021 Peter Torelli
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Winsock must come before Windows.h
+#include <winsock2.h>
+#include "stream_server.hpp"
+
+#include <stdexcept>
+#include <iostream>
+
+#pragma comment (lib, "Ws2_32.lib")
+
+using namespace std;
+
+#if 0
+#	define DBG(x) { cout << x << endl; }
+#else
+#	define DBG(x) {}
+#endif
+
+static bool
+send_all(SOCKET s, const char* buf, int len)
+{
+	while (len > 0)
+	{
+		int n = send(s, buf, len, 0);
+		if (n == SOCKET_ERROR || n == 0)
+		{
+			return false;
+		}
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+/**
+ * Bind, listen and start accepting. Clients may connect at any time; they
+ * receive data from the next full block on.
+ */
+void
+StreamServer::start(unsigned short port, uint32_t kind)
+{
+	stop();
+	WSADATA wsa;
+	if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+	{
+		throw runtime_error("WSAStartup failed");
+	}
+	SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (s == INVALID_SOCKET)
+	{
+		WSACleanup();
+		throw runtime_error("Unable to create stream socket");
+	}
+	BOOL reuse = TRUE;
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+	sockaddr_in addr;
+	ZeroMemory(&addr, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(s, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR ||
+		listen(s, SOMAXCONN) == SOCKET_ERROR)
+	{
+		closesocket(s);
+		WSACleanup();
+		throw runtime_error("Unable to listen on stream port " + to_string(port));
+	}
+	m_listen = (uintptr_t)s;
+	m_port = port;
+	m_kind = kind;
+	m_record_floats = (kind == STREAM_KIND_IV) ? 2 : 1;
+	if (m_block == nullptr)
+	{
+		lock_guard<mutex> guard(m_lock);
+		m_block = _take();
+	}
+	begin(0.0f);
+	m_running = true;
+	m_accept_thread = CreateThread(NULL, 0, _accept_thread, this, 0, NULL);
+	if (m_accept_thread == NULL)
+	{
+		m_running = false;
+		closesocket(s);
+		WSACleanup();
+		throw runtime_error("Failed to create stream accept thread");
+	}
+}
+
+/**
+ * Close the listener and every client. Blocks (briefly) until all of the
+ * sender threads have exited.
+ */
+void
+StreamServer::stop(void)
+{
+	if (!m_running)
+	{
+		return;
+	}
+	m_running = false;
+	closesocket((SOCKET)m_listen);
+	WaitForSingleObject(m_accept_thread, 5000);
+	CloseHandle(m_accept_thread);
+	m_accept_thread = NULL;
+	{
+		lock_guard<mutex> guard(m_lock);
+		for (auto& client : m_clients)
+		{
+			client->closing = true;
+			shutdown((SOCKET)client->socket, SD_BOTH);
+			SetEvent(client->event);
+		}
+	}
+	for (auto& client : m_clients)
+	{
+		WaitForSingleObject(client->thread, 5000);
+		closesocket((SOCKET)client->socket);
+		CloseHandle(client->thread);
+		CloseHandle(client->event);
+	}
+	lock_guard<mutex> guard(m_lock);
+	m_clients.clear();
+	m_active = false;
+	// Every sender is gone, so every block but the one being filled is free
+	m_free.clear();
+	for (auto& block : m_blocks)
+	{
+		block->refs = 0;
+		if (block.get() != m_block)
+		{
+			m_free.push_back(block.get());
+		}
+	}
+	WSACleanup();
+}
+
+size_t
+StreamServer::clients(void)
+{
+	lock_guard<mutex> guard(m_lock);
+	size_t n(0);
+	for (auto& client : m_clients)
+	{
+		if (!client->closing)
+		{
+			++n;
+		}
+	}
+	return n;
+}
+
+/**
+ * Called at trace start: record numbering starts over at zero.
+ */
+void
+StreamServer::begin(float sample_rate)
+{
+	m_sample_rate = sample_rate;
+	m_records = 0;
+	m_block->count = 0;
+	m_block->first_record = 0;
+}
+
+/**
+ * Called at trace stop to send the last partial block.
+ */
+void
+StreamServer::flush(void)
+{
+	if (m_block->count > 0)
+	{
+		_post();
+	}
+}
+
+/**
+ * Hand the current block to every client that can take it, then start a new
+ * one (or the same one again, if nobody took it). Runs on the event loop
+ * thread, so it never waits on a socket, and only allocates while the pool
+ * is still growing to what the clients' queues hold.
+ */
+void
+StreamServer::_post(void)
+{
+	Block *block = m_block;
+	m_records += block->count / m_record_floats;
+	{
+		lock_guard<mutex> guard(m_lock);
+		for (auto& client : m_clients)
+		{
+			if (client->closing)
+			{
+				continue;
+			}
+			if (client->skip > 0)
+			{
+				--client->skip;
+				continue;
+			}
+			if (client->queue.size() >= STREAM_QUEUE_BLOCKS)
+			{
+				++client->dropped;
+				if (client->decimation < STREAM_DECIMATION_MAX)
+				{
+					client->decimation *= 2;
+				}
+			}
+			else
+			{
+				client->queue.push_back(block);
+				++block->refs;
+				SetEvent(client->event);
+			}
+			client->skip = client->decimation - 1;
+		}
+		if (block->refs > 0)
+		{
+			m_block = _take();
+		}
+	}
+	m_block->count = 0;
+	m_block->first_record = m_records;
+}
+
+// Must hold m_lock
+StreamServer::Block *
+StreamServer::_take(void)
+{
+	if (m_free.empty())
+	{
+		m_blocks.push_back(make_unique<Block>());
+		m_free.push_back(m_blocks.back().get());
+	}
+	Block *block = m_free.back();
+	m_free.pop_back();
+	block->refs = 0;
+	return block;
+}
+
+// Must hold m_lock
+void
+StreamServer::_release(Block *block)
+{
+	if (--block->refs == 0)
+	{
+		m_free.push_back(block);
+	}
+}
+
+// Must hold m_lock
+void
+StreamServer::_update_active(void)
+{
+	bool active = false;
+	for (auto& client : m_clients)
+	{
+		active = active || !client->closing;
+	}
+	m_active = active;
+}
+
+// Must hold m_lock
+void
+StreamServer::_reap(void)
+{
+	for (auto itr = m_clients.begin(); itr != m_clients.end();)
+	{
+		Client *client = itr->get();
+		if (client->closing && WaitForSingleObject(client->thread, 0) == WAIT_OBJECT_0)
+		{
+			closesocket((SOCKET)client->socket);
+			CloseHandle(client->thread);
+			CloseHandle(client->event);
+			itr = m_clients.erase(itr);
+		}
+		else
+		{
+			++itr;
+		}
+	}
+}
+
+DWORD WINAPI
+StreamServer::_accept_thread(LPVOID arg)
+{
+	((StreamServer*)arg)->_accept_loop();
+	return 0;
+}
+
+DWORD WINAPI
+StreamServer::_client_thread(LPVOID arg)
+{
+	Client *client = (Client*)arg;
+	client->server->_client_loop(client);
+	return 0;
+}
+
+void
+StreamServer::_accept_loop(void)
+{
+	while (m_running)
+	{
+		SOCKET s = accept((SOCKET)m_listen, NULL, NULL);
+		if (s == INVALID_SOCKET)
+		{
+			// Either stop() closed the listener or the stack gave up on us
+			break;
+		}
+		BOOL nodelay = TRUE;
+		setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&nodelay, sizeof(nodelay));
+		unique_ptr<Client> client(new Client);
+		client->socket = (uintptr_t)s;
+		client->server = this;
+		client->event = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if (client->event == NULL)
+		{
+			DBG("Failed to create stream client event");
+			closesocket(s);
+			continue;
+		}
+		lock_guard<mutex> guard(m_lock);
+		_reap();
+		client->thread = CreateThread(NULL, 0, _client_thread, client.get(), 0, NULL);
+		if (client->thread == NULL)
+		{
+			DBG("Failed to create stream client thread");
+			CloseHandle(client->event);
+			closesocket(s);
+			continue;
+		}
+		m_clients.push_back(move(client));
+		_update_active();
+	}
+}
+
+void
+StreamServer::_client_loop(Client *client)
+{
+	vector<char> frame(sizeof(StreamFrameHeader) + STREAM_BLOCK_FLOATS * sizeof(float));
+	StreamFrameHeader *hdr = (StreamFrameHeader*)frame.data();
+	hdr->magic = STREAM_FRAME_MAGIC;
+	hdr->version = STREAM_FRAME_VERSION;
+	hdr->kind = (uint16_t)m_kind;
+	for (;;)
+	{
+		WaitForSingleObject(client->event, 100);
+		for (;;)
+		{
+			Block *block;
+			{
+				lock_guard<mutex> guard(m_lock);
+				if (client->closing)
+				{
+					return;
+				}
+				if (client->queue.empty())
+				{
+					// Caught up: try a finer stream again
+					if (client->decimation > 1)
+					{
+						client->decimation /= 2;
+					}
+					break;
+				}
+				block = client->queue.front();
+				client->queue.pop_front();
+				hdr->decimation = client->decimation;
+				hdr->dropped = client->dropped;
+				client->dropped = 0;
+			}
+			hdr->count = block->count / m_record_floats;
+			hdr->first_record = block->first_record;
+			hdr->sample_rate = m_sample_rate;
+			CopyMemory(frame.data() + sizeof(StreamFrameHeader), block->data, block->count * sizeof(float));
+			int len = (int)(sizeof(StreamFrameHeader) + block->count * sizeof(float));
+			{
+				lock_guard<mutex> guard(m_lock);
+				_release(block);
+			}
+			if (!send_all((SOCKET)client->socket, frame.data(), len))
+			{
+				DBG("Stream client went away");
+				lock_guard<mutex> guard(m_lock);
+				client->closing = true;
+				for (Block *queued : client->queue)
+				{
+					_release(queued);
+				}
+				client->queue.clear();
+				_update_active();
+				return;
+			}
+		}
+	}
+}
@@ -0,0 +1,173 @@
+/**
+ * Copyright 2021 Peter Torelli
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <Windows.h>
+#include <atomic>
+#include <cinttypes>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define STREAM_FRAME_MAGIC    0x4653534au // "JSSF"
+#define STREAM_FRAME_VERSION  1u
+#define STREAM_DEFAULT_PORT   6110
+#define STREAM_BLOCK_FLOATS   4096u // payload of one frame
+#define STREAM_QUEUE_BLOCKS   32u   // per-client backlog before we drop
+#define STREAM_DECIMATION_MAX 64u
+
+#define STREAM_KIND_ENERGY 1u // one float per record: downsampled energy
+#define STREAM_KIND_IV     2u // two floats per record: calibrated i, v at 2 MS/s
+
+/**
+ * Every frame on the wire is this header (little-endian) followed by
+ * `count * record_floats` Float32LE values. `first_record` counts records
+ * from trace start, so a client can see exactly where data is missing.
+ * `decimation` is how many blocks the server is currently skipping per
+ * block sent to this client (1 = everything), and `dropped` is the number
+ * of blocks dropped for this client since the previous frame.
+ */
+#pragma pack(push, 1)
+struct StreamFrameHeader
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t kind;
+	uint32_t count;
+	uint32_t decimation;
+	uint64_t first_record;
+	float    sample_rate;
+	uint32_t dropped;
+};
+#pragma pack(pop)
+
+/**
+ * Sends samples to any number of TCP clients. The event loop fills one
+ * block at a time with `put()`; a full block is handed to every client's
+ * queue by reference, so the only work on the sample path is a short lock
+ * per block. Blocks are recycled once every client has sent them, and
+ * with no clients at all `put()` only counts records. Each client has its own sender thread doing the blocking
+ * `send()`. A client whose queue is full has the block dropped and its
+ * decimation doubled, so a slow viewer sees a coarser stream instead of
+ * slowing anyone else down. The decimation halves again each time that
+ * client's queue drains.
+ */
+class StreamServer
+{
+public:
+	~StreamServer()
+	{
+		stop();
+	}
+	void start(unsigned short port, uint32_t kind);
+	void stop(void);
+	bool is_running(void)
+	{
+		return m_running;
+	}
+	uint32_t kind(void)
+	{
+		return m_kind;
+	}
+	unsigned short port(void)
+	{
+		return m_port;
+	}
+	size_t clients(void);
+	void begin(float sample_rate);
+	void flush(void);
+	void put(float a)
+	{
+		if (!m_active.load(std::memory_order_relaxed))
+		{
+			_idle();
+			return;
+		}
+		m_block->data[m_block->count++] = a;
+		if (m_block->count == STREAM_BLOCK_FLOATS)
+		{
+			_post();
+		}
+	}
+	void put(float a, float b)
+	{
+		if (!m_active.load(std::memory_order_relaxed))
+		{
+			_idle();
+			return;
+		}
+		m_block->data[m_block->count++] = a;
+		m_block->data[m_block->count++] = b;
+		if (m_block->count == STREAM_BLOCK_FLOATS)
+		{
+			_post();
+		}
+	}
+private:
+	struct Block
+	{
+		uint64_t first_record;
+		uint32_t count; // in floats
+		uint32_t refs;  // client queues holding it, under m_lock
+		float    data[STREAM_BLOCK_FLOATS];
+	};
+	struct Client
+	{
+		uintptr_t                           socket;
+		HANDLE                              event;
+		HANDLE                              thread;
+		StreamServer                       *server;
+		std::deque<Block*>                 queue;
+		uint32_t                            decimation = 1;
+		uint32_t                            skip = 0;
+		uint32_t                            dropped = 0;
+		bool                                closing = false;
+	};
+	static DWORD WINAPI _accept_thread(LPVOID arg);
+	static DWORD WINAPI _client_thread(LPVOID arg);
+	void _accept_loop(void);
+	void _client_loop(Client *client);
+	void _post(void);
+	void _reap(void);
+	// Nobody is listening: the record (and any left in the block) is only counted
+	void _idle(void)
+	{
+		m_records += m_block->count / m_record_floats + 1;
+		m_block->count = 0;
+		m_block->first_record = m_records;
+	}
+	Block *_take(void);
+	void _release(Block *block);
+	void _update_active(void);
+
+	std::mutex                           m_lock;
+	std::vector<std::unique_ptr<Client>> m_clients;
+	std::vector<std::unique_ptr<Block>>  m_blocks; // every block, for reuse
+	std::vector<Block*>                  m_free;
+	Block                               *m_block = nullptr;
+	uintptr_t                            m_listen;
+	HANDLE                               m_accept_thread = NULL;
+	std::atomic<bool>                    m_running{ false };
+	std::atomic<bool>                    m_active{ false }; // any client open
+	uint32_t                             m_kind = STREAM_KIND_ENERGY;
+	uint32_t                             m_record_floats = 1;
+	unsigned short                       m_port = STREAM_DEFAULT_PORT;
+	float                                m_sample_rate = 0.0f;
+	uint64_t                             m_records = 0;
+};
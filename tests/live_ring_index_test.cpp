@@ -0,0 +1,139 @@
+/**
+ * Copyright 2021 Peter Torelli
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Checks the live ring's reader index math against a producer that works
+ * like LiveRing::put(). Portable and self-contained:
+ *
+ *     g++ -std=c++17 -O2 -pthread -I.. live_ring_index_test.cpp
+ *     cl /std:c++17 /EHsc /O2 /I.. live_ring_index_test.cpp
+ *
+ * Exits non-zero on the first failure.
+ */
+
+#include "live_ring_index.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#define CHECK(x) \
+	if (!(x)) { printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #x); exit(1); }
+
+/**
+ * Every head: the tail is never the record whose slot the producer may be
+ * writing, and valid() agrees with it.
+ */
+static void
+test_bounds(void)
+{
+	const uint32_t capacity = 8;
+	for (uint64_t head(0); head < 4 * capacity; ++head)
+	{
+		uint64_t tail = live_ring_tail(head, capacity);
+		CHECK(tail <= head);
+		CHECK(head - tail < capacity);
+		if (head >= capacity)
+		{
+			// Record `head` is the one being written
+			CHECK((tail & (capacity - 1)) != (head & (capacity - 1)));
+			CHECK(!live_ring_valid(head - capacity, head, capacity));
+		}
+		CHECK(live_ring_valid(tail, head, capacity));
+		if (tail > 0)
+		{
+			CHECK(!live_ring_valid(tail - 1, head, capacity));
+		}
+	}
+}
+
+/**
+ * A producer writing two-float records as put() does, and a reader that
+ * only keeps what valid() accepts: it must never see a record whose halves
+ * disagree, or that is not the record its index says.
+ *
+ * Left alone the producer laps the reader almost every time, so only a
+ * sliver of the records would ever be checked. It is held to half a ring
+ * ahead of the reader instead, except for a burst of two rings' worth out
+ * of every BURST_EVERY records, which is where the reader gets lapped.
+ */
+#define BURST_EVERY 65536
+
+static void
+test_torn(void)
+{
+	const uint32_t capacity = 4096;
+	const uint64_t records = 20'000'000;
+	std::vector<std::atomic<uint64_t>> data(capacity * 2);
+	std::atomic<uint64_t> write_count{ 0 };
+	std::atomic<uint64_t> read_count{ 0 };
+	std::thread producer([&]() {
+		for (uint64_t n(0); n < records; ++n)
+		{
+			bool burst = (n % BURST_EVERY) < 2 * capacity;
+			while (!burst && n >= read_count.load(std::memory_order_acquire) + capacity / 2)
+			{
+				std::this_thread::yield();
+			}
+			std::atomic<uint64_t> *rec = &data[(n & (capacity - 1)) * 2];
+			rec[0].store(n, std::memory_order_relaxed);
+			rec[1].store(n, std::memory_order_relaxed);
+			write_count.store(n + 1, std::memory_order_release);
+		}
+	});
+	uint64_t checked = 0;
+	uint64_t lapped = 0;
+	uint64_t cursor = 0;
+	while (cursor < records)
+	{
+		read_count.store(cursor, std::memory_order_release);
+		uint64_t head = write_count.load(std::memory_order_acquire);
+		if (cursor >= head)
+		{
+			std::this_thread::yield();
+			continue;
+		}
+		std::atomic<uint64_t> *rec = &data[(cursor & (capacity - 1)) * 2];
+		uint64_t a = rec[0].load(std::memory_order_relaxed);
+		uint64_t b = rec[1].load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (!live_ring_valid(cursor, write_count.load(std::memory_order_relaxed), capacity))
+		{
+			cursor = live_ring_tail(write_count.load(std::memory_order_acquire), capacity);
+			++lapped;
+			continue;
+		}
+		CHECK(a == cursor && b == cursor);
+		++checked;
+		++cursor;
+	}
+	producer.join();
+	printf("test_torn: %llu records checked, lapped %llu times\n",
+		(unsigned long long)checked, (unsigned long long)lapped);
+	// Only the bursts can outrun the reader
+	CHECK(checked > records / 2);
+}
+
+int
+main(void)
+{
+	test_bounds();
+	test_torn();
+	printf("PASS\n");
+	return 0;
+}
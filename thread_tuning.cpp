@@ -0,0 +1,200 @@
+/**
+ * Copyright 2021 Peter Torelli
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "thread_tuning.hpp"
+
+#include <winternl.h>
+#include <avrt.h>
+#include <vector>
+
+#pragma comment (lib, "Avrt.lib")
+
+using namespace std;
+
+typedef NTSTATUS (NTAPI *NtQuerySystemInformation_fn)(
+	SYSTEM_INFORMATION_CLASS, PVOID, ULONG, PULONG);
+
+/**
+ * Pin, prioritize and (optionally) register the calling thread. A setting
+ * that fails is noted in m_error and the rest are still applied: a thread
+ * that runs unpinned is better than no trace at all.
+ */
+void
+ThreadTuning::begin(string name, const ThreadConfig& config)
+{
+	m_name = name;
+	m_config = config;
+	m_thread_id = GetCurrentThreadId();
+	m_cores = 0;
+	m_context_switches = 0;
+	m_kernel_s = 0.0;
+	m_user_s = 0.0;
+	m_mmcss = false;
+	m_error.clear();
+	HANDLE thread = GetCurrentThread();
+	m_old_affinity = 0;
+	m_old_priority = GetThreadPriority(thread);
+	if (config.core >= 0)
+	{
+		if (config.core < 64)
+		{
+			m_old_affinity = SetThreadAffinityMask(thread, 1ull << config.core);
+		}
+		if (m_old_affinity == 0)
+		{
+			m_error = "affinity";
+		}
+	}
+	if (config.mmcss)
+	{
+		DWORD task_index = 0;
+		m_mmcss_handle = AvSetMmThreadCharacteristicsA("Pro Audio", &task_index);
+		if (m_mmcss_handle == NULL)
+		{
+			m_error = m_error.empty() ? "mmcss" : m_error;
+		}
+		else
+		{
+			m_mmcss = true;
+			AvSetMmThreadPriority(m_mmcss_handle, AVRT_PRIORITY_HIGH);
+		}
+	}
+	// MMCSS manages the priority of the threads it owns
+	if (!m_mmcss && config.priority != THREAD_PRIORITY_NORMAL)
+	{
+		if (!SetThreadPriority(thread, config.priority))
+		{
+			m_error = m_error.empty() ? "priority" : m_error;
+		}
+	}
+	context_switches(m_thread_id, m_switches_start);
+	cpu_times(m_kernel_start, m_user_start);
+	sample();
+}
+
+/**
+ * Take the final counters and put the thread back as begin() found it.
+ */
+void
+ThreadTuning::end(void)
+{
+	uint64_t switches;
+	if (context_switches(m_thread_id, switches))
+	{
+		m_context_switches = switches - m_switches_start;
+	}
+	cpu_times(m_kernel_s, m_user_s);
+	m_kernel_s -= m_kernel_start;
+	m_user_s -= m_user_start;
+	HANDLE thread = GetCurrentThread();
+	if (m_mmcss_handle != NULL)
+	{
+		AvRevertMmThreadCharacteristics(m_mmcss_handle);
+		m_mmcss_handle = NULL;
+	}
+	if (m_old_affinity != 0)
+	{
+		SetThreadAffinityMask(thread, m_old_affinity);
+		m_old_affinity = 0;
+	}
+	if (GetThreadPriority(thread) != m_old_priority)
+	{
+		SetThreadPriority(thread, m_old_priority);
+	}
+}
+
+// CPU time of the calling thread so far
+void
+ThreadTuning::cpu_times(double& kernel_s, double& user_s)
+{
+	FILETIME created, exited, kernel, user;
+	kernel_s = 0.0;
+	user_s = 0.0;
+	if (GetThreadTimes(GetCurrentThread(), &created, &exited, &kernel, &user))
+	{
+		// 100 ns units
+		kernel_s = (double)(((uint64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime) / 1e7;
+		user_s = (double)(((uint64_t)user.dwHighDateTime << 32) | user.dwLowDateTime) / 1e7;
+	}
+}
+
+// The cores seen, as a comma-separated list
+string
+ThreadTuning::cores(void) const
+{
+	string out;
+	for (unsigned i(0); i < 64; ++i)
+	{
+		if (m_cores & (1ull << i))
+		{
+			out += (out.empty() ? "" : ",") + to_string(i);
+		}
+	}
+	return out;
+}
+
+/**
+ * Windows only keeps a per-thread context switch count in the kernel's
+ * thread list, so take a snapshot of it and find our thread. The count is
+ * the field winternl.h calls SYSTEM_THREAD_INFORMATION::Reserved3. This is
+ * far too slow for the loop, but fine at thread start and exit.
+ */
+bool
+ThreadTuning::context_switches(DWORD thread_id, uint64_t& count)
+{
+	static NtQuerySystemInformation_fn query = (NtQuerySystemInformation_fn)
+		GetProcAddress(GetModuleHandleA("ntdll.dll"), "NtQuerySystemInformation");
+	if (query == nullptr)
+	{
+		return false;
+	}
+	vector<uint8_t> buffer(1024 * 1024);
+	ULONG needed = 0;
+	NTSTATUS status;
+	while ((status = query(SystemProcessInformation, buffer.data(), (ULONG)buffer.size(), &needed)) < 0)
+	{
+		// STATUS_INFO_LENGTH_MISMATCH: the list grew, try again bigger
+		if ((ULONG)status != 0xc0000004 || buffer.size() >= 64 * 1024 * 1024)
+		{
+			return false;
+		}
+		buffer.resize(max((size_t)needed + 64 * 1024, buffer.size() * 2));
+	}
+	HANDLE pid = (HANDLE)(uintptr_t)GetCurrentProcessId();
+	uint8_t *p = buffer.data();
+	for (;;)
+	{
+		SYSTEM_PROCESS_INFORMATION *proc = (SYSTEM_PROCESS_INFORMATION*)p;
+		if (proc->UniqueProcessId == pid)
+		{
+			SYSTEM_THREAD_INFORMATION *threads = (SYSTEM_THREAD_INFORMATION*)(proc + 1);
+			for (ULONG i(0); i < proc->NumberOfThreads; ++i)
+			{
+				if ((DWORD)(uintptr_t)threads[i].ClientId.UniqueThread == thread_id)
+				{
+					count = threads[i].Reserved3;
+					return true;
+				}
+			}
+			return false;
+		}
+		if (proc->NextEntryOffset == 0)
+		{
+			return false;
+		}
+		p += proc->NextEntryOffset;
+	}
+}
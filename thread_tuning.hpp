@@ -0,0 +1,71 @@
+/**
+ * Copyright 2021 Peter Torelli
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <Windows.h>
+#include <cinttypes>
+#include <string>
+
+/**
+ * Where and how one pipeline thread runs. The defaults leave the thread
+ * exactly as CreateThread made it.
+ */
+struct ThreadConfig
+{
+	int  core = -1;                         // logical processor, -1 = any
+	int  priority = THREAD_PRIORITY_NORMAL; // SetThreadPriority value
+	bool mmcss = false;                     // join the MMCSS "Pro Audio" task
+};
+
+/**
+ * Applies a ThreadConfig to the thread that calls begin() (MMCSS only
+ * works on the calling thread) and measures how that thread actually ran:
+ * which cores it was seen on, how often it was switched out, and its CPU
+ * time. The thread calls sample() on every pass of its loop (it only
+ * reads the current core number) and end() when it is done, which puts
+ * the thread back the way it was.
+ */
+class ThreadTuning
+{
+public:
+	void begin(std::string name, const ThreadConfig& config);
+	void sample(void)
+	{
+		DWORD core = GetCurrentProcessorNumber();
+		m_cores |= (core < 64) ? (1ull << core) : 0;
+	}
+	void end(void);
+	std::string cores(void) const;
+	std::string m_name;
+	ThreadConfig m_config;
+	DWORD       m_thread_id = 0;
+	uint64_t    m_cores = 0;            // bit n: seen running on core n
+	uint64_t    m_context_switches = 0; // between begin() and end()
+	double      m_kernel_s = 0.0;
+	double      m_user_s = 0.0;
+	bool        m_mmcss = false;        // registered with MMCSS
+	std::string m_error;                // the first setting that failed
+private:
+	static bool context_switches(DWORD thread_id, uint64_t& count);
+	static void cpu_times(double& kernel_s, double& user_s);
+	HANDLE    m_mmcss_handle = NULL;
+	uint64_t  m_switches_start = 0;
+	double    m_kernel_start = 0.0;
+	double    m_user_start = 0.0;
+	DWORD_PTR m_old_affinity = 0;
+	int       m_old_priority = THREAD_PRIORITY_NORMAL;
+};
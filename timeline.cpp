@@ -0,0 +1,140 @@
+/**
+ * Copyright 2021 Peter Torelli
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "timeline.hpp"
+
+#include <iomanip>
+
+using namespace std;
+
+Timeline g_timeline;
+
+// A thread's ring, found once and then kept here
+static thread_local void *t_ring = nullptr;
+
+Timeline::Timeline()
+{
+	LARGE_INTEGER f;
+	QueryPerformanceFrequency(&f);
+	m_frequency = f.QuadPart;
+}
+
+void
+Timeline::enable(bool on)
+{
+	if (on)
+	{
+		m_origin = now();
+	}
+	m_enabled = on;
+}
+
+/**
+ * A thread that is started again (the lap notifier, with each trace)
+ * gets its old ring back, so the rings do not pile up.
+ */
+void
+Timeline::name_thread(const char *name)
+{
+	t_ring = _find(name);
+}
+
+Timeline::Ring *
+Timeline::_ring(void)
+{
+	if (t_ring == nullptr)
+	{
+		t_ring = _find("thread-" + to_string(GetCurrentThreadId()));
+	}
+	return (Ring*)t_ring;
+}
+
+Timeline::Ring *
+Timeline::_find(const string& name)
+{
+	lock_guard<mutex> guard(m_lock);
+	for (auto& ring : m_rings)
+	{
+		if (ring->name == name)
+		{
+			return ring.get();
+		}
+	}
+	m_rings.push_back(make_unique<Ring>());
+	m_rings.back()->name = name;
+	return m_rings.back().get();
+}
+
+/**
+ * Each ring is read between two looks at its head. Events from before the
+ * first look are complete; of those, the oldest that the writer may have
+ * reached by the second look are dropped. Times are in microseconds from
+ * enable(), and the ring's index is the thread id.
+ */
+uint64_t
+Timeline::write(ostream& out)
+{
+	int64_t origin = m_origin;
+	double us = 1e6 / (double)m_frequency;
+	uint64_t written = 0;
+	streamsize precision = out.precision();
+	out << fixed << setprecision(3);
+	out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+	lock_guard<mutex> guard(m_lock);
+	for (size_t tid(0); tid < m_rings.size(); ++tid)
+	{
+		Ring& ring = *m_rings[tid];
+		out << (tid ? "," : "")
+			<< "\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << tid
+			<< ",\"args\":{\"name\":\"" << ring.name << "\"}}";
+		uint64_t head = ring.head.load(memory_order_acquire);
+		uint64_t first = (head > TIMELINE_EVENTS) ? head - TIMELINE_EVENTS : 0;
+		vector<TimelineEvent> events(ring.events, ring.events + TIMELINE_EVENTS);
+		uint64_t after = ring.head.load(memory_order_acquire);
+		if (after >= TIMELINE_EVENTS && after - TIMELINE_EVENTS + 1 > first)
+		{
+			first = after - TIMELINE_EVENTS + 1;
+		}
+		for (uint64_t i(first); i < head; ++i)
+		{
+			const TimelineEvent& e = events[i & (TIMELINE_EVENTS - 1)];
+			if (e.begin < origin)
+			{
+				continue;
+			}
+			out << ",\n{\"name\":\"" << e.name << "\",\"pid\":1,\"tid\":" << tid
+				<< ",\"ts\":" << (double)(e.begin - origin) * us;
+			if (e.end < 0)
+			{
+				out << ",\"ph\":\"i\",\"s\":\"t\"";
+			}
+			else
+			{
+				out << ",\"ph\":\"X\",\"dur\":" << (double)(e.end - e.begin) * us;
+			}
+			if (e.arg_name != nullptr)
+			{
+				out << ",\"args\":{\"" << e.arg_name << "\":" << e.arg << "}";
+			}
+			out << "}";
+			++written;
+		}
+	}
+	out << "\n]}\n";
+	out.unsetf(ios::floatfield);
+	out << setprecision(precision);
+	return written;
+}
@@ -0,0 +1,139 @@
+/**
+ * Copyright 2021 Peter Torelli
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <Windows.h>
+#include <atomic>
+#include <cinttypes>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define TIMELINE_EVENTS 65536 // per thread, power of two
+
+/**
+ * One span (end >= begin) or instant (end < 0), in QueryPerformanceCounter
+ * ticks. The strings must be literals: only the pointers are kept.
+ */
+struct TimelineEvent
+{
+	const char *name;
+	const char *arg_name; // may be null
+	int64_t     begin;
+	int64_t     end;
+	int64_t     arg;
+};
+
+/**
+ * When each pipeline stage ran, for looking at a drop stage by stage in
+ * chrome://tracing or Perfetto. Each thread records into a ring of its
+ * own, so recording takes no lock: two counter reads and a store when on,
+ * and one relaxed load when off. The rings keep the newest
+ * TIMELINE_EVENTS events per thread and are written out on demand by
+ * write(), from any thread, while the others keep recording; an event
+ * that is being overwritten as it is read is left out.
+ */
+class Timeline
+{
+public:
+	Timeline();
+	static int64_t now(void)
+	{
+		LARGE_INTEGER t;
+		QueryPerformanceCounter(&t);
+		return t.QuadPart;
+	}
+	bool enabled(void)
+	{
+		return m_enabled.load(std::memory_order_relaxed);
+	}
+	// Also forgets what was recorded before
+	void enable(bool on);
+	// The calling thread's track name; call once when the thread starts
+	void name_thread(const char *name);
+	void span(const char *name, int64_t begin, const char *arg_name = nullptr, int64_t arg = 0)
+	{
+		_record(name, arg_name, begin, now(), arg);
+	}
+	void instant(const char *name, const char *arg_name = nullptr, int64_t arg = 0)
+	{
+		if (enabled())
+		{
+			_record(name, arg_name, now(), -1, arg);
+		}
+	}
+	// Chrome trace event JSON; returns how many events it wrote
+	uint64_t write(std::ostream& out);
+private:
+	struct Ring
+	{
+		std::string           name;
+		std::atomic<uint64_t> head{ 0 };
+		TimelineEvent         events[TIMELINE_EVENTS];
+	};
+	Ring *_ring(void);
+	void _record(const char *name, const char *arg_name, int64_t begin, int64_t end, int64_t arg)
+	{
+		Ring *ring = _ring();
+		uint64_t head = ring->head.load(std::memory_order_relaxed);
+		ring->events[head & (TIMELINE_EVENTS - 1)] = TimelineEvent{ name, arg_name, begin, end, arg };
+		ring->head.store(head + 1, std::memory_order_release);
+	}
+	Ring *_find(const std::string& name);
+	std::atomic<bool>     m_enabled{ false };
+	std::atomic<int64_t>  m_origin{ 0 }; // events before this are forgotten
+	int64_t               m_frequency;
+	std::mutex            m_lock; // for m_rings
+	std::vector<std::unique_ptr<Ring>> m_rings;
+};
+
+extern Timeline g_timeline;
+
+/**
+ * Records the scope it lives in as a span, if the timeline was on when
+ * it began.
+ */
+class TimelineSpan
+{
+public:
+	TimelineSpan(const char *name, const char *arg_name = nullptr, int64_t arg = 0)
+		: m_name(name)
+		, m_arg_name(arg_name)
+		, m_arg(arg)
+		, m_begin(g_timeline.enabled() ? Timeline::now() : 0)
+	{
+	}
+	~TimelineSpan()
+	{
+		if (m_begin != 0)
+		{
+			g_timeline.span(m_name, m_begin, m_arg_name, m_arg);
+		}
+	}
+	// For an argument only known at the end
+	void arg(int64_t v)
+	{
+		m_arg = v;
+	}
+private:
+	const char *m_name;
+	const char *m_arg_name;
+	int64_t     m_arg;
+	int64_t     m_begin;
+};
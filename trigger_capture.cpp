@@ -0,0 +1,126 @@
+/**
+ * Copyright 2021 Peter Torelli
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "trigger_capture.hpp"
+#include "file_writer.hpp"
+
+/**
+ * Called at trace start: size the history for this sample rate and forget
+ * everything from the last trace.
+ */
+void
+TriggerCapture::reset(unsigned sample_rate)
+{
+	m_pre = (size_t)(m_pre_seconds * sample_rate);
+	m_pre = m_pre > TRIGGER_HISTORY_MAX ? TRIGGER_HISTORY_MAX : m_pre;
+	m_post = (size_t)(m_post_seconds * sample_rate);
+	m_history.assign(m_pre, 0.0f);
+	m_history_head = 0;
+	m_history_count = 0;
+	m_index = 0;
+	m_post_left = 0;
+	m_file_samples = 0;
+	m_pending.clear();
+	m_windows.clear();
+	m_snapshot = false;
+}
+
+void
+TriggerCapture::add(float e)
+{
+	if (m_snapshot.load(memory_order_relaxed) && m_snapshot.exchange(false))
+	{
+		trigger(m_index, TRIGGER_SNAPSHOT);
+	}
+	while (!m_pending.empty() && m_pending.front().sample <= m_index)
+	{
+		fire(m_pending.front());
+		m_pending.pop_front();
+	}
+	if (m_post_left)
+	{
+		commit(e);
+		--m_post_left;
+	}
+	else if (m_pre)
+	{
+		m_history[m_history_head] = e;
+		m_history_head = (m_history_head + 1) % m_pre;
+		if (m_history_count < m_pre)
+		{
+			++m_history_count;
+		}
+	}
+	++m_index;
+}
+
+/**
+ * A trace that ends inside a window keeps what it has so far.
+ */
+void
+TriggerCapture::flush(void)
+{
+	m_post_left = 0;
+}
+
+/**
+ * Open a window (committing the history) or extend the current one. The
+ * triggering sample itself is the next one to arrive, so the window is
+ * the history, that sample, and `m_post` more. A threshold crossing in an
+ * open window is only counted, so a noisy load hovering at the threshold
+ * cannot grow the list without bound.
+ */
+void
+TriggerCapture::fire(const Trigger& t)
+{
+	if (m_post_left == 0)
+	{
+		Window w;
+		w.first_sample = m_index - m_history_count;
+		w.samples = 0;
+		w.file_sample = m_file_samples;
+		w.retriggers = 0;
+		m_windows.push_back(w);
+		size_t slot = (m_history_head + m_pre - m_history_count) % (m_pre ? m_pre : 1);
+		for (size_t n(0); n < m_history_count; ++n)
+		{
+			// Up to TRIGGER_HISTORY_MAX samples at once: far more than the ring holds
+			if (m_writer->pages_in_flight() >= MAX_OVERLAPPED_WRITES / 2)
+			{
+				m_writer->reap();
+			}
+			commit(m_history[slot]);
+			slot = (slot + 1) % m_pre;
+		}
+		m_history_count = 0;
+	}
+	else if (t.source == TRIGGER_THRESHOLD)
+	{
+		++m_windows.back().retriggers;
+		m_post_left = m_post + 1;
+		return;
+	}
+	m_windows.back().triggers.push_back(Trigger{ m_index, t.source });
+	m_post_left = m_post + 1;
+}
+
+void
+TriggerCapture::commit(float e)
+{
+	m_writer->commit(e);
+	++m_windows.back().samples;
+	++m_file_samples;
+}
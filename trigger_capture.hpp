@@ -0,0 +1,144 @@
+/**
+ * Copyright 2021 Peter Torelli
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cinttypes>
+#include <cmath>
+#include <deque>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+#define TRIGGER_HISTORY_MAX (1u << 26) // samples of pre-trigger history, 256 MB
+#define TRIGGER_HYSTERESIS  0.1f      // power must fall 10% below the threshold to re-arm
+
+#define TRIGGER_GPI0      1u // GPI0 falling edge
+#define TRIGGER_THRESHOLD 2u // power rising through the threshold
+#define TRIGGER_SNAPSHOT  4u // `snapshot` command
+
+class FileWriter;
+
+/**
+ * Event-triggered capture. Energy samples pass through `add()` on their way
+ * to the FileWriter pages, but while idle they only go into a ring holding
+ * the last `pre` samples. A trigger commits that history, the triggering
+ * sample, and the `post` samples after it. Another trigger inside the post
+ * window extends it, so overlapping events produce one window and no sample
+ * is written twice.
+ *
+ * Triggers are noted against the absolute sample index they happened in
+ * (see FileWriter::add) and fire when that sample arrives here, so any
+ * delay upstream (e.g. the NaN interpolator) does not move them. The
+ * energy file then holds the windows back to back; `m_windows` says where
+ * each one came from.
+ */
+class TriggerCapture
+{
+public:
+	struct Trigger
+	{
+		uint64_t sample;
+		uint32_t source;
+	};
+	struct Window
+	{
+		uint64_t        first_sample; // absolute sample index
+		uint64_t        samples;
+		uint64_t        file_sample;  // where it starts in the energy file
+		vector<Trigger> triggers;
+		uint64_t        retriggers;   // threshold crossings that only extended it
+	};
+	void set_writer(FileWriter *ptr)
+	{
+		m_writer = ptr;
+	}
+	void configure(float pre_seconds, float post_seconds)
+	{
+		m_pre_seconds = pre_seconds;
+		m_post_seconds = post_seconds;
+	}
+	void sources(uint32_t mask)
+	{
+		m_sources = mask;
+	}
+	uint32_t sources(void)
+	{
+		return m_sources;
+	}
+	void threshold(float watts)
+	{
+		m_threshold = watts;
+	}
+	float threshold(void)
+	{
+		return m_threshold;
+	}
+	float pre_seconds(void)
+	{
+		return m_pre_seconds;
+	}
+	float post_seconds(void)
+	{
+		return m_post_seconds;
+	}
+	bool enabled(void)
+	{
+		return m_sources != 0;
+	}
+	void reset(unsigned sample_rate);
+	void add(float e);
+	void flush(void);
+	/**
+	 * Loop thread: note a trigger at absolute sample `sample`. Several in
+	 * the same sample from the same source are one.
+	 */
+	void trigger(uint64_t sample, uint32_t source)
+	{
+		if ((m_sources & source) &&
+			(m_pending.empty() || m_pending.back().sample != sample || m_pending.back().source != source))
+		{
+			m_pending.push_back(Trigger{ sample, source });
+		}
+	}
+	// Any thread: trigger on the next sample.
+	void snapshot(void)
+	{
+		m_snapshot = true;
+	}
+	vector<Window> m_windows;
+	size_t         m_pre = 0;  // in samples, for this trace
+	size_t         m_post = 0;
+private:
+	FileWriter     *m_writer = nullptr;
+	float           m_pre_seconds = 1.0f;
+	float           m_post_seconds = 1.0f;
+	uint32_t        m_sources = 0;
+	float           m_threshold = INFINITY;
+	atomic<bool>    m_snapshot{ false };
+	deque<Trigger>  m_pending;
+	vector<float>   m_history;
+	size_t          m_history_head = 0;  // next slot to write
+	size_t          m_history_count = 0;
+	uint64_t        m_index = 0;         // absolute index of the next sample
+	uint64_t        m_post_left = 0;     // 0 = idle
+	uint64_t        m_file_samples = 0;
+
+	void fire(const Trigger& t);
+	void commit(float e);
+};
@@ -0,0 +1,59 @@
+/**
+ * Copyright 2021 Peter Torelli
+ * Copyright 2020 Jetperch LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "usb_transport.hpp"
+
+#include <stdexcept>
+
+using namespace std;
+
+void
+WinUsbTransport::open(wstring path)
+{
+	close();
+	m_file = CreateFile(
+		path.c_str(),
+		GENERIC_WRITE | GENERIC_READ,
+		FILE_SHARE_WRITE | FILE_SHARE_READ,
+		NULL,
+		OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED,
+		NULL);
+	if (m_file == INVALID_HANDLE_VALUE)
+	{
+		m_file = NULL;
+		throw runtime_error("Open failed on invalid handle");
+	}
+	if (!WinUsb_Initialize(m_file, &m_winusb))
+	{
+		CloseHandle(m_file);
+		m_file = NULL;
+		throw runtime_error("Open failed"); // get last error
+	}
+}
+
+void
+WinUsbTransport::close(void)
+{
+	if (m_file != NULL)
+	{
+		WinUsb_Free(m_winusb);
+		m_winusb = NULL;
+		CloseHandle(m_file);
+		m_file = NULL;
+	}
+}
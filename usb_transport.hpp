@@ -0,0 +1,124 @@
+/**
+ * Copyright 2021 Peter Torelli
+ * Copyright 2020 Jetperch LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cinttypes>
+#include <string>
+#include <vector>
+
+#include <Windows.h>
+#include "WinUsb.h"
+
+/**
+ * This is a wrapper around Windows OVERLAPPED object that contains
+ * its own STL buffer container. Each overlapped transfer has an
+ * event associated with it, and is used either by ReadPipe or
+ * ControlTransfer. Note that before using each OVERLAPPED, the
+ * event handle needs to be reset and the structure zeroed.
+ */
+struct TransferOverlapped
+{
+	TransferOverlapped(HANDLE _event, size_t _size) : m_event(_event)
+	{
+		m_size = _size;
+		m_buffer.resize(m_size);
+		reset();
+	};
+	LPOVERLAPPED ov_ptr(void) {
+		return &m_ov;
+	}
+	void reset(void)
+	{
+		ZeroMemory(&m_ov, sizeof(m_ov));
+		m_ov.hEvent = m_event;
+		/**
+		 * TODO: This should be sized according to the request.
+		 * Revisit the Python, it properly resizes this buffer duringcontrol transfers
+		 * It is unlikely we will have a bug here since there are limited ctrl transfers
+		 * but if we exceed 4096B it might fail.
+		 */
+		m_buffer.resize(m_size);
+	};
+	OVERLAPPED         m_ov;
+	std::vector<UCHAR> m_buffer;
+	HANDLE             m_event;
+	size_t             m_size;
+	// When it was last handed to the transport, for EndpointIn's tuning
+	std::chrono::steady_clock::time_point m_issued;
+	// Issue order, so EndpointIn can deliver in order
+	uint64_t m_seq = 0;
+};
+
+/**
+ * Everything the endpoint and control-transfer code needs from the USB
+ * stack. The calls mirror the WinUsb_* functions they replace, including
+ * the BOOL + GetLastError() convention and ERROR_IO_PENDING for a transfer
+ * that was queued, so a backend only has to behave like WinUSB: signal
+ * `ov->m_event` when a transfer finishes and report it through
+ * `get_overlapped_result()`.
+ */
+class UsbTransport
+{
+public:
+	virtual ~UsbTransport() {}
+	virtual void open(std::wstring path) = 0;
+	virtual void close(void) = 0;
+	virtual BOOL read_pipe(UCHAR pipe_id, TransferOverlapped *ov) = 0;
+	virtual BOOL control_transfer(WINUSB_SETUP_PACKET setup_packet, TransferOverlapped *ov) = 0;
+	virtual BOOL get_overlapped_result(TransferOverlapped *ov, ULONG *length, BOOL wait) = 0;
+	virtual BOOL abort_pipe(UCHAR pipe_id) = 0;
+	virtual BOOL set_pipe_policy(UCHAR pipe_id, ULONG policy, ULONG length, PVOID value) = 0;
+};
+
+/**
+ * The real thing.
+ */
+class WinUsbTransport : public UsbTransport
+{
+public:
+	~WinUsbTransport()
+	{
+		close();
+	}
+	void open(std::wstring path);
+	void close(void);
+	BOOL read_pipe(UCHAR pipe_id, TransferOverlapped *ov)
+	{
+		return WinUsb_ReadPipe(m_winusb, pipe_id, ov->m_buffer.data(), (ULONG)ov->m_buffer.size(), NULL, ov->ov_ptr());
+	}
+	BOOL control_transfer(WINUSB_SETUP_PACKET setup_packet, TransferOverlapped *ov)
+	{
+		return WinUsb_ControlTransfer(m_winusb, setup_packet, ov->m_buffer.data(), setup_packet.Length, NULL, ov->ov_ptr());
+	}
+	BOOL get_overlapped_result(TransferOverlapped *ov, ULONG *length, BOOL wait)
+	{
+		return WinUsb_GetOverlappedResult(m_winusb, ov->ov_ptr(), length, wait);
+	}
+	BOOL abort_pipe(UCHAR pipe_id)
+	{
+		return WinUsb_AbortPipe(m_winusb, pipe_id);
+	}
+	BOOL set_pipe_policy(UCHAR pipe_id, ULONG policy, ULONG length, PVOID value)
+	{
+		return WinUsb_SetPipePolicy(m_winusb, pipe_id, policy, length, value);
+	}
+private:
+	HANDLE m_file = NULL;
+	HANDLE m_winusb = NULL;
+};